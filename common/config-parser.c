@@ -45,69 +45,143 @@
 #include <syslog.h>
 #include <stdarg.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
 #include <bsnmp/asn1.h>
 #include <bsnmp/snmp.h>
 
-static void
+static int
 errmsg(const char* filename, void* data, const char* msg, ...)
 {
     #define MAX_MSGLEN  1024
     char buf[MAX_MSGLEN];
     va_list ap;
+    int ret;
 
     va_start(ap, msg);
     vsnprintf(buf, MAX_MSGLEN, msg, ap);
     buf[MAX_MSGLEN - 1] = 0;
-    cfg_error(filename, buf, data);
+    ret = cfg_error(filename, buf, data);
     va_end(ap);
+
+    return ret;
 }
 
 /* -----------------------------------------------------------------------------
  * CONFIG PARSER
  */
 
+/*
+ * The config files are listed first, and then each one is read, split
+ * into values and handed to cfg_value(), one file after another, in
+ * the order of their paths.
+ *
+ * Each file is read into its own block with read(), not mapped. The
+ * values are split in place, and the file name goes on the end, so a
+ * mapping would be copied anyway, and for files this small mapping
+ * costs more than reading. The blocks aren't put in one arena either,
+ * as a reload frees the block of each changed file on its own.
+ */
+
+typedef struct _config_value
+{
+    char* header;
+    char* name;
+    char* value;
+}
+config_value;
+
+typedef struct _config_file
+{
+    char* path;                 /* Path as found in the directory */
+    const char* filename;       /* Points into config after reading */
+    char* config;               /* The file, all the strings are in here */
+    char* error;                /* A problem reading or parsing, or NULL */
+
+    config_value* values;
+    int n_values;
+    int max_values;
+}
+config_file;
+
+typedef struct _config_files
+{
+    config_file* files;
+    int n_files;
+    int max_files;
+}
+config_files;
+
+static void
+file_error(config_file* file, const char* msg, ...)
+{
+    char buf[MAX_MSGLEN];
+    va_list ap;
+
+    /* Only the first problem */
+    if(file->error)
+        return;
+
+    va_start(ap, msg);
+    vsnprintf(buf, MAX_MSGLEN, msg, ap);
+    buf[MAX_MSGLEN - 1] = 0;
+    va_end(ap);
+
+    file->error = strdup(buf);
+}
+
 static char*
-read_config_file(const char** configfile, void* data)
+read_config_file(config_file* file)
 {
     char* config = NULL;
-    char* newfilename;
-    FILE* f = NULL;
-    long len;
-    int flen;
-
-    ASSERT(configfile);
+    struct stat sb;
+    size_t flen;
+    size_t len;
+    ssize_t r;
+    int fd;
 
-    f = fopen(*configfile, "r");
-    if(f == NULL)
+    fd = open(file->filename, O_RDONLY);
+    if(fd < 0)
     {
-        errmsg(*configfile, data, "couldn't open config file: %s", *configfile);
+        file_error(file, "couldn't open config file: %s", file->filename);
         return NULL;
     }
 
     /* Figure out size */
-    if(fseek(f, 0, SEEK_END) == -1 || (len = ftell(f)) == -1 || fseek(f, 0, SEEK_SET) == -1)
+    if(fstat(fd, &sb) < 0)
     {
-        errmsg(*configfile, data, "couldn't seek config file: %s", *configfile);
+        file_error(file, "couldn't stat config file: %s", file->filename);
+        close(fd);
         return NULL;
     }
 
-    flen = strlen(*configfile);
-    if((config = (char*)malloc(len + 4 + flen)) == NULL)
+    flen = strlen(file->filename);
+    if((config = (char*)malloc(sb.st_size + 4 + flen)) == NULL)
     {
-        errmsg(*configfile, data, "out of memory");
+        file_error(file, "out of memory");
+        close(fd);
         return NULL;
     }
 
-    /* And read in one block */
-    if(fread(config, 1, len, f) != len)
+    /* And read in one block, or as much of it as there is */
+    for(len = 0; len < sb.st_size; len += r)
     {
-        errmsg(*configfile, data, "couldn't read config file: %s", *configfile);
-        return NULL;
+        r = read(fd, config + len, sb.st_size - len);
+        if(r < 0 && errno == EINTR)
+            r = 0;
+        else if(r < 0)
+        {
+            file_error(file, "couldn't read config file: %s", file->filename);
+            close(fd);
+            free(config);
+            return NULL;
+        }
+        else if(r == 0)
+            break;
     }
 
-    fclose(f);
+    close(fd);
 
     /* Null terminate the data */
     config[len] = '\n';
@@ -117,32 +191,44 @@ read_config_file(const char** configfile, void* data)
     strcln(config, '\r');
 
     /* Persistent allocation for filename */
-    newfilename = config + len + 2;
-    strcpy(newfilename, *configfile);
-    *configfile = newfilename;
+    strcpy(config + len + 2, file->filename);
+    file->filename = config + len + 2;
 
     return config;
 }
 
-int
-cfg_parse_file(const char* filename, void* data, char** memory)
+static void
+add_value(config_file* file, char* header, char* name, char* value)
+{
+    if(file->n_values == file->max_values)
+    {
+        file->max_values = file->max_values ? file->max_values * 2 : 16;
+        file->values = (config_value*)xrealloc(file->values,
+                                sizeof(config_value) * file->max_values);
+    }
+
+    file->values[file->n_values].header = header;
+    file->values[file->n_values].name = name;
+    file->values[file->n_values].value = value;
+    file->n_values++;
+}
+
+/* Splits the file up into values, in place */
+static int
+parse_config_file(config_file* file)
 {
     char* name = NULL;
     char* value = NULL;
-    char* config;
     char* next;
-    char* header;
-    int ret = -1;
+    char* header = NULL;
     char* p;
     char* t;
 
-    ASSERT(filename);
-
-    config = read_config_file(&filename, data);
-    if(!config)
-        goto finally;
+    file->config = read_config_file(file);
+    if(!file->config)
+        return -1;
 
-    next = config;
+    next = file->config;
 
     /* Go through lines and process them */
     while((t = strchr(next, '\n')) != NULL)
@@ -158,9 +244,9 @@ cfg_parse_file(const char* filename, void* data, char** memory)
         {
             if(!value)
             {
-                errmsg(filename, data, "%s: invalid continuation in config: %s",
-                       filename, p);
-                goto finally;
+                file_error(file, "%s: invalid continuation in config: %s",
+                           file->filename, p);
+                return -1;
             }
 
             /* Calculate the end of the current value */
@@ -176,10 +262,7 @@ cfg_parse_file(const char* filename, void* data, char** memory)
 
         /* No continuation hand off value if necessary */
         if(name && value)
-        {
-            if(cfg_value(filename, header, name, strtrim(value), data) == -1)
-                goto finally;
-        }
+            add_value(file, header, name, strtrim(value));
 
         name = NULL;
         value = NULL;
@@ -194,9 +277,9 @@ cfg_parse_file(const char* filename, void* data, char** memory)
             t = p + strcspn(p, "]");
             if(!*t || t == p + 1)
             {
-                errmsg(filename, data, "%s: invalid config header: %s",
-                       filename, p);
-                goto finally;
+                file_error(file, "%s: invalid config header: %s",
+                           file->filename, p);
+                return -1;
             }
 
             *t = 0;
@@ -208,9 +291,9 @@ cfg_parse_file(const char* filename, void* data, char** memory)
         t = p + strcspn(p, ":=");
         if(!*t)
         {
-            errmsg(filename, data, "%s: invalid config line: %s",
-                   filename, p);
-            goto finally;
+            file_error(file, "%s: invalid config line: %s",
+                       file->filename, p);
+            return -1;
         }
 
         /* Null terminate and split value part */
@@ -222,32 +305,77 @@ cfg_parse_file(const char* filename, void* data, char** memory)
     }
 
     if(name && value)
+        add_value(file, header, name, value);
+
+    return 0;
+}
+
+/* Hands the values of a parsed file to the callbacks, -1 stops the parsing */
+static int
+deliver_config_file(config_file* file, void* data)
+{
+    int i;
+
+    for(i = 0; i < file->n_values; ++i)
     {
-        if(cfg_value(filename, header, name, value, data) == -1)
-            goto finally;
+        if(cfg_value(file->filename, file->values[i].header, file->values[i].name,
+                     file->values[i].value, data) == -1)
+            return -1;
     }
 
-    ret = 0;
+    if(file->error)
+        return errmsg(file->filename, data, "%s", file->error) == -1 ? -1 : 0;
+
+    return 0;
+}
+
+static void
+free_config_file(config_file* file)
+{
+    free(file->values);
+    free(file->error);
+    file->values = NULL;
+    file->error = NULL;
+}
+
+int
+cfg_parse_file(const char* filename, void* data, char** memory)
+{
+    config_file file;
+    int ret;
 
+    ASSERT(filename);
+
+    memset(&file, 0, sizeof(file));
+    file.filename = filename;
 
-finally:
+    parse_config_file(&file);
+    ret = deliver_config_file(&file, data);
+    if(file.error)
+        ret = -1;
+    free_config_file(&file);
 
     if(!memory || ret != 0)
-        free(config);
+        free(file.config);
     else if(memory)
-        *memory = config;
+        *memory = file.config;
 
     return ret;
 }
 
 static int
-parse_dir_internal(const char* subdir, void* data)
+compare_files(const void* a, const void* b)
+{
+    return strcmp(((const config_file*)a)->path, ((const config_file*)b)->path);
+}
+
+static int
+find_config_files(const char* subdir, config_files* cf, void* data)
 {
     char path[MAXPATHLEN];
     struct dirent* dire;
     int is_dir, is_reg, is_lnk;
     struct stat st;
-    char* memory;
     DIR* dir;
     int r;
 
@@ -286,6 +414,7 @@ parse_dir_internal(const char* subdir, void* data)
             if(stat(path, &st) < 0)
             {
                 errmsg(NULL, data, "couldn't stat path: %s", path);
+                closedir(dir);
                 return -1;
             }
 
@@ -304,9 +433,12 @@ parse_dir_internal(const char* subdir, void* data)
             if(dire->d_name[0] == '.')
                 continue;
 
-            r = parse_dir_internal(path, data);
+            r = find_config_files(path, cf, data);
             if(r < 0)
+            {
+                closedir(dir);
                 return r;
+            }
 
             continue;
         }
@@ -314,16 +446,23 @@ parse_dir_internal(const char* subdir, void* data)
         if(!is_reg && !is_lnk)
             continue;
 
-        memory = NULL;
-        cfg_parse_file(path, data, &memory);
-
-        /* We call it with blanks after files */
-        if(cfg_value(path, NULL, NULL, NULL, data) == -1)
-            break;
+        if(cf->n_files == cf->max_files)
+        {
+            cf->max_files = cf->max_files ? cf->max_files * 2 : 64;
+            cf->files = (config_file*)xrealloc(cf->files,
+                                sizeof(config_file) * cf->max_files);
+        }
 
-        /* Keep the memory around */
-        if(memory)
-            atexitv(free, memory);
+        memset(&cf->files[cf->n_files], 0, sizeof(config_file));
+        cf->files[cf->n_files].path = strdup(path);
+        cf->files[cf->n_files].filename = cf->files[cf->n_files].path;
+        if(!cf->files[cf->n_files].path)
+        {
+            errmsg(NULL, data, "out of memory");
+            closedir(dir);
+            return -1;
+        }
+        cf->n_files++;
     }
 
     closedir(dir);
@@ -331,6 +470,63 @@ parse_dir_internal(const char* subdir, void* data)
     return 0;
 }
 
+static int
+parse_dir_internal(void* data)
+{
+    config_files cf;
+    config_file* file;
+    int stop = 0;
+    int ret;
+    int i, r;
+
+    memset(&cf, 0, sizeof(cf));
+
+    ret = find_config_files(NULL, &cf, data);
+    if(ret == 0)
+    {
+        /* Always in the same order */
+        qsort(cf.files, cf.n_files, sizeof(config_file), compare_files);
+    }
+
+    for(i = 0; i < cf.n_files; ++i)
+    {
+        file = &cf.files[i];
+
+        if(ret == 0 && !stop)
+        {
+            /* Problems are reported to the callback */
+            parse_config_file(file);
+            r = deliver_config_file(file, data);
+
+            /*
+             * We call it with blanks after files, and the memory the
+             * values are in. The callback can take the memory over,
+             * otherwise it's done with it.
+             */
+            if(r == 0)
+                r = cfg_value(file->path, NULL, NULL, file->config, data);
+            if(r == -1)
+            {
+                stop = 1;
+                ret = -1;
+            }
+
+            if(r != 1)
+                free(file->config);
+        }
+        else
+        {
+            free(file->config);
+        }
+
+        free_config_file(file);
+        free(file->path);
+    }
+
+    free(cf.files);
+    return ret;
+}
+
 int
 cfg_parse_dir(const char* dirname, void* data)
 {
@@ -348,7 +544,7 @@ cfg_parse_dir(const char* dirname, void* data)
         return -1;
     }
 
-    ret = parse_dir_internal(NULL, data);
+    ret = parse_dir_internal(data);
 
     if(olddir[0])
         chdir(olddir);
@@ -41,7 +41,14 @@
 #include <bsnmp/asn1.h>
 #include <bsnmp/snmp.h>
 
-/* Callbacks must be defined by the caller */
+/*
+ * Callbacks must be defined by the caller. After each file cfg_value
+ * is called with a NULL header, and the memory the values of that file
+ * are in. Returning 1 then takes over that memory, to be freed later,
+ * otherwise it's freed. Returning -1 from cfg_value stops the parsing,
+ * and cfg_parse_dir() returns -1. So does returning -1 from cfg_error
+ * for a problem in a file, otherwise the next file is parsed.
+ */
 extern int cfg_value(const char* filename, const char* header, const char* name,
                      char* value, void* data);
 extern int cfg_error(const char* filename, const char* errmsg, void* data);
@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) 2008, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+
+
+#include "usuals.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "latest-values.h"
+
+/*
+ * FILE LAYOUT
+ *
+ * Numbers are in the byte order of the machine, as the file is only
+ * read locally.
+ *
+ *  header:   "RRDBOTLV" u32 version, u32 entry count,
+ *            u32 pid of the daemon, u32 zero, u64 time it started
+ *  entries:  u32 sequence, u32 value type, i64 when, 8 byte value,
+ *            u64 zero, name, field
+ *
+ * The entries are sorted by name and then field. The sequence of an
+ * entry is odd while it's being written. The file is built under
+ * another name and then renamed into place, so readers never see a
+ * half made one.
+ */
+
+#define LATEST_MAGIC    "RRDBOTLV"
+#define LATEST_VERSION  1
+
+/* Reads tried before checking that the daemon is still there */
+#define MAX_TRIES       1024
+
+typedef struct _latest_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t pid;
+    uint32_t reserved;
+    uint64_t started;
+}
+latest_header;
+
+typedef struct _latest_slot
+{
+    volatile uint32_t seq;
+    uint32_t type;
+    int64_t when;
+    union
+    {
+        int64_t i_value;
+        double f_value;
+    } v;
+    uint64_t reserved;
+    char name[LATEST_NAME];
+    char field[LATEST_FIELD];
+}
+latest_slot;
+
+struct _latest_writer
+{
+    char* path;
+    char* temp;
+    latest_header* header;
+    latest_slot* entries;
+    size_t size;
+};
+
+struct _latest_reader
+{
+    latest_header* header;
+    latest_slot* entries;
+    size_t size;
+    ino_t inode;
+    char* path;
+};
+
+static size_t
+latest_size(int count)
+{
+    return sizeof(latest_header) + sizeof(latest_slot) * count;
+}
+
+/* -----------------------------------------------------------------------------
+ * WRITING
+ */
+
+latest_writer*
+latest_create(const char* path, int count, char* errbuf, size_t errlen)
+{
+    latest_writer* lw;
+    struct timeval tv;
+    void* map;
+    int fd;
+
+    lw = (latest_writer*)calloc(1, sizeof(latest_writer));
+    if(!lw || !(lw->path = strdup(path)) ||
+       !(lw->temp = (char*)malloc(strlen(path) + 5)))
+    {
+        latest_destroy(lw);
+        snprintf(errbuf, errlen, "out of memory");
+        return NULL;
+    }
+
+    strcpy(lw->temp, path);
+    strcat(lw->temp, ".tmp");
+    lw->size = latest_size(count);
+
+    fd = open(lw->temp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        snprintf(errbuf, errlen, "couldn't create file: %s: %s", lw->temp, strerror(errno));
+        latest_destroy(lw);
+        return NULL;
+    }
+
+    if(ftruncate(fd, lw->size) < 0)
+    {
+        snprintf(errbuf, errlen, "couldn't size file: %s: %s", lw->temp, strerror(errno));
+        close(fd);
+        unlink(lw->temp);
+        latest_destroy(lw);
+        return NULL;
+    }
+
+    map = mmap(NULL, lw->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(map == MAP_FAILED)
+    {
+        snprintf(errbuf, errlen, "couldn't map file: %s: %s", lw->temp, strerror(errno));
+        unlink(lw->temp);
+        latest_destroy(lw);
+        return NULL;
+    }
+
+    lw->header = (latest_header*)map;
+    lw->entries = (latest_slot*)(lw->header + 1);
+
+    gettimeofday(&tv, NULL);
+    memcpy(lw->header->magic, LATEST_MAGIC, sizeof(lw->header->magic));
+    lw->header->version = LATEST_VERSION;
+    lw->header->count = count;
+    lw->header->pid = getpid();
+    lw->header->started = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+    return lw;
+}
+
+/* Names must be set in sorted order, before publishing */
+int
+latest_name(latest_writer* lw, int index, const char* name, const char* field)
+{
+    latest_slot* entry;
+
+    ASSERT(index >= 0 && index < (int)lw->header->count);
+
+    if(strlen(name) >= LATEST_NAME || strlen(field) >= LATEST_FIELD)
+        return -1;
+
+    entry = &lw->entries[index];
+    strcpy(entry->name, name);
+    strcpy(entry->field, field);
+    return 0;
+}
+
+int
+latest_publish(latest_writer* lw, char* errbuf, size_t errlen)
+{
+    if(rename(lw->temp, lw->path) < 0)
+    {
+        snprintf(errbuf, errlen, "couldn't rename file: %s: %s", lw->temp, strerror(errno));
+        unlink(lw->temp);
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+latest_set(latest_writer* lw, int index, const latest_value* value)
+{
+    latest_slot* entry;
+
+    ASSERT(index >= 0 && index < (int)lw->header->count);
+    entry = &lw->entries[index];
+
+    entry->seq++;
+    __sync_synchronize();
+
+    entry->type = value->type;
+    entry->when = value->when;
+    if(value->type == LATEST_FLOAT)
+        entry->v.f_value = value->v.f_value;
+    else
+        entry->v.i_value = value->v.i_value;
+
+    __sync_synchronize();
+    entry->seq++;
+}
+
+void
+latest_destroy(latest_writer* lw)
+{
+    if(!lw)
+        return;
+
+    if(lw->header)
+        munmap(lw->header, lw->size);
+    free(lw->path);
+    free(lw->temp);
+    free(lw);
+}
+
+/* -----------------------------------------------------------------------------
+ * READING
+ */
+
+latest_reader*
+latest_open(const char* path, char* errbuf, size_t errlen)
+{
+    latest_reader* lr;
+    latest_header* header;
+    struct stat sb;
+    void* map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        snprintf(errbuf, errlen, "couldn't open file: %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    if(fstat(fd, &sb) < 0)
+    {
+        snprintf(errbuf, errlen, "couldn't stat file: %s: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    if((size_t)sb.st_size < sizeof(latest_header))
+    {
+        snprintf(errbuf, errlen, "not a latest values file: %s", path);
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(map == MAP_FAILED)
+    {
+        snprintf(errbuf, errlen, "couldn't map file: %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    header = (latest_header*)map;
+    if(memcmp(header->magic, LATEST_MAGIC, sizeof(header->magic)) != 0 ||
+       header->version != LATEST_VERSION ||
+       latest_size(header->count) > (size_t)sb.st_size)
+    {
+        snprintf(errbuf, errlen, "not a latest values file: %s", path);
+        munmap(map, sb.st_size);
+        return NULL;
+    }
+
+    lr = (latest_reader*)calloc(1, sizeof(latest_reader));
+    if(!lr || !(lr->path = strdup(path)))
+    {
+        snprintf(errbuf, errlen, "out of memory");
+        free(lr);
+        munmap(map, sb.st_size);
+        return NULL;
+    }
+
+    lr->header = header;
+    lr->entries = (latest_slot*)(header + 1);
+    lr->size = sb.st_size;
+    lr->inode = sb.st_ino;
+    return lr;
+}
+
+int
+latest_count(latest_reader* lr)
+{
+    return lr->header->count;
+}
+
+static int
+compare_entry(const latest_slot* entry, const char* name, const char* field)
+{
+    int r = strcmp(entry->name, name);
+    return r ? r : strcmp(entry->field, field);
+}
+
+/* Returns the index of the entry, or -1 */
+int
+latest_find(latest_reader* lr, const char* name, const char* field)
+{
+    int lo = 0;
+    int hi = lr->header->count - 1;
+    int mid, r;
+
+    while(lo <= hi)
+    {
+        mid = (lo + hi) / 2;
+        r = compare_entry(&lr->entries[mid], name, field);
+        if(r == 0)
+            return mid;
+        if(r < 0)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return -1;
+}
+
+int
+latest_entry(latest_reader* lr, int index, const char** name, const char** field)
+{
+    if(index < 0 || index >= (int)lr->header->count)
+        return -1;
+
+    *name = lr->entries[index].name;
+    *field = lr->entries[index].field;
+    return 0;
+}
+
+int
+latest_get(latest_reader* lr, int index, latest_value* value)
+{
+    latest_slot* entry;
+    uint32_t seq;
+    int tries;
+
+    if(index < 0 || index >= (int)lr->header->count)
+        return -1;
+
+    entry = &lr->entries[index];
+
+    for(tries = 1; ; ++tries)
+    {
+        /* The daemon may have died halfway through a write */
+        if(tries % MAX_TRIES == 0)
+        {
+            if(!latest_running(lr))
+                return -1;
+            sched_yield();
+        }
+
+        seq = entry->seq;
+        __sync_synchronize();
+
+        /* Being written right now */
+        if(seq & 1)
+            continue;
+
+        value->type = entry->type;
+        value->when = entry->when;
+        value->v.i_value = entry->v.i_value;
+
+        __sync_synchronize();
+        if(entry->seq == seq)
+            return 0;
+    }
+}
+
+/*
+ * Whether the daemon that wrote the file is still writing to it. It
+ * replaces the file when it starts again, so then open it again.
+ */
+int
+latest_running(latest_reader* lr)
+{
+    struct stat sb;
+
+    if(stat(lr->path, &sb) < 0 || sb.st_ino != lr->inode)
+        return 0;
+    if(kill(lr->header->pid, 0) < 0 && errno == ESRCH)
+        return 0;
+    return 1;
+}
+
+void
+latest_close(latest_reader* lr)
+{
+    if(!lr)
+        return;
+
+    munmap(lr->header, lr->size);
+    free(lr->path);
+    free(lr);
+}
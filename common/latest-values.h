@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2008, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+
+
+#ifndef __LATEST_VALUES_H__
+#define __LATEST_VALUES_H__
+
+#include <stdint.h>
+
+/*
+ * The latest value of each field, published by rrdbotd in a memory
+ * mapped file. There's an entry for each field of each config, sorted
+ * by name, so an entry stays put while the daemon runs. Each entry has
+ * a sequence lock, and readers copy the entry out and try again when
+ * it changed underneath them.
+ */
+
+#define LATEST_DEFAULT  "/var/db/rrdbot/latest-values"
+
+#define LATEST_UNSET    0
+#define LATEST_INT      1
+#define LATEST_FLOAT    2
+
+#define LATEST_NAME     192             /* Including the null */
+#define LATEST_FIELD    64
+
+typedef struct _latest_value
+{
+    int type;
+    union
+    {
+        int64_t i_value;
+        double f_value;
+    } v;
+    int64_t when;                       /* Milliseconds since the epoch */
+}
+latest_value;
+
+/* Writing, only from one thread */
+typedef struct _latest_writer latest_writer;
+
+latest_writer* latest_create(const char* path, int count, char* errbuf, size_t errlen);
+int latest_name(latest_writer* lw, int index, const char* name, const char* field);
+int latest_publish(latest_writer* lw, char* errbuf, size_t errlen);
+void latest_set(latest_writer* lw, int index, const latest_value* value);
+void latest_destroy(latest_writer* lw);
+
+/* Reading, from any number of processes */
+typedef struct _latest_reader latest_reader;
+
+latest_reader* latest_open(const char* path, char* errbuf, size_t errlen);
+int latest_count(latest_reader* lr);
+int latest_find(latest_reader* lr, const char* name, const char* field);
+int latest_entry(latest_reader* lr, int index, const char** name, const char** field);
+int latest_get(latest_reader* lr, int index, latest_value* value);
+int latest_running(latest_reader* lr);
+void latest_close(latest_reader* lr);
+
+#endif /* __LATEST_VALUES_H__ */
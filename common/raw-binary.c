@@ -0,0 +1,1187 @@
+/*
+ * Copyright (c) 2008, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+
+#include "usuals.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "raw-binary.h"
+
+/*
+ * FILE LAYOUT
+ *
+ * All numbers are little endian.
+ *
+ *  header:   "RRDBOTRB" u32 version, u32 zero
+ *  records:  u8 type, u8 zero, u16 zero, u32 payload length, payload
+ *    'D':    u16 field id, field name
+ *    'B':    u16 field id, u8 value type, u8 zero, u32 count,
+ *            i64 first time, i64 last time, u32 bit count, bits
+ *    'I':    u32 fields, for each: u16 id, u16 length, name
+ *            u32 blocks, for each: u64 record offset, u16 field id,
+ *            u8 value type, u8 zero, u32 count, i64 first, i64 last
+ *  trailer:  "RRDBOTIX" u64 offset of the 'I' record
+ *
+ * Times are in milliseconds.
+ *
+ * The index and trailer are only written when a file is closed. When
+ * a file is opened again, they're cut off, and new records appended.
+ * If a file wasn't closed properly, the records are scanned instead.
+ *
+ * In a block the first value is stored as is, and the timestamps
+ * and the rest of the values are compressed like in Facebook's
+ * Gorilla paper.
+ */
+
+#define FILE_MAGIC      "RRDBOTRB"
+#define INDEX_MAGIC     "RRDBOTIX"
+#define FILE_VERSION    1
+
+#define HEADER_LEN      16
+#define TRAILER_LEN     16
+#define RECORD_LEN      8
+#define BLOCK_LEN       28
+#define ENTRY_LEN       32
+
+#define RECORD_FIELD    'D'
+#define RECORD_BLOCK    'B'
+#define RECORD_INDEX    'I'
+
+/* The most values in a block, and fields in a file */
+#define MAX_POINTS      1024
+#define MAX_FIELDS      0xFFFF
+
+/* -----------------------------------------------------------------------------
+ * HELPERS
+ */
+
+static void
+put_u16(unsigned char* p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+static void
+put_u32(unsigned char* p, uint32_t v)
+{
+    put_u16(p, v & 0xFFFF);
+    put_u16(p + 2, (v >> 16) & 0xFFFF);
+}
+
+static void
+put_u64(unsigned char* p, uint64_t v)
+{
+    put_u32(p, v & 0xFFFFFFFF);
+    put_u32(p + 4, (v >> 32) & 0xFFFFFFFF);
+}
+
+static uint16_t
+get_u16(const unsigned char* p)
+{
+    return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+
+static uint32_t
+get_u32(const unsigned char* p)
+{
+    return (uint32_t)get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static uint64_t
+get_u64(const unsigned char* p)
+{
+    return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+static int
+leading_zeros(uint64_t v)
+{
+    int n = 0;
+    while(n < 64 && !(v & ((uint64_t)1 << (63 - n))))
+        n++;
+    return n;
+}
+
+static int
+trailing_zeros(uint64_t v)
+{
+    int n = 0;
+    while(n < 64 && !(v & ((uint64_t)1 << n)))
+        n++;
+    return n;
+}
+
+static uint64_t
+value_bits(const rawbin_value* value)
+{
+    uint64_t bits = 0;
+
+    if(value->type == RAWBIN_INT)
+        bits = (uint64_t)value->v.i_value;
+    else if(value->type == RAWBIN_FLOAT)
+        memcpy(&bits, &value->v.f_value, sizeof(bits));
+    return bits;
+}
+
+static void
+bits_value(int type, uint64_t bits, rawbin_value* value)
+{
+    value->type = type;
+    if(type == RAWBIN_INT)
+        value->v.i_value = (int64_t)bits;
+    else if(type == RAWBIN_FLOAT)
+        memcpy(&value->v.f_value, &bits, sizeof(bits));
+}
+
+/* -----------------------------------------------------------------------------
+ * BITS
+ */
+
+typedef struct _bitbuf
+{
+    unsigned char* data;
+    size_t alloc;
+    uint32_t len;               /* In bits */
+    int failed;
+}
+bitbuf;
+
+/* Write the low n bits of value, most significant first */
+static void
+bits_put(bitbuf* bb, uint64_t value, int n)
+{
+    unsigned char* data;
+    size_t need;
+
+    need = (bb->len + n + 7) / 8;
+    if(need > bb->alloc)
+    {
+        data = (unsigned char*)realloc(bb->data, MAX(need, bb->alloc * 2));
+        if(!data)
+        {
+            bb->failed = 1;
+            return;
+        }
+        memset(data + bb->alloc, 0, MAX(need, bb->alloc * 2) - bb->alloc);
+        bb->data = data;
+        bb->alloc = MAX(need, bb->alloc * 2);
+    }
+
+    while(n-- > 0)
+    {
+        if((value >> n) & 1)
+            bb->data[bb->len >> 3] |= 0x80 >> (bb->len & 7);
+        bb->len++;
+    }
+}
+
+static void
+bits_reset(bitbuf* bb)
+{
+    if(bb->data)
+        memset(bb->data, 0, (bb->len + 7) / 8);
+    bb->len = 0;
+    bb->failed = 0;
+}
+
+typedef struct _bitreader
+{
+    const unsigned char* data;
+    uint32_t len;               /* In bits */
+    uint32_t pos;
+}
+bitreader;
+
+static int
+bits_get(bitreader* br, int n, uint64_t* value)
+{
+    uint64_t v = 0;
+
+    if(br->len - br->pos < (uint32_t)n)
+        return -1;
+
+    while(n-- > 0)
+    {
+        v = (v << 1) | ((br->data[br->pos >> 3] >> (7 - (br->pos & 7))) & 1);
+        br->pos++;
+    }
+
+    *value = v;
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * INDEX
+ */
+
+typedef struct _rawbin_entry
+{
+    uint64_t offset;
+    uint16_t id;
+    int type;
+    uint32_t count;
+    int64_t first;
+    int64_t last;
+}
+rawbin_entry;
+
+/* What's in a file, read from its index or by scanning it */
+typedef struct _rawbin_index
+{
+    char** names;               /* Indexed by field id */
+    int n_names;
+    rawbin_entry* entries;
+    size_t n_entries;
+    size_t alloc_entries;
+    uint64_t end;               /* Where the records end */
+}
+rawbin_index;
+
+static int
+index_name(rawbin_index* idx, uint16_t id, const unsigned char* name, size_t len)
+{
+    char** names;
+
+    if(id >= idx->n_names)
+    {
+        names = (char**)realloc(idx->names, (id + 1) * sizeof(char*));
+        if(!names)
+            return -1;
+        memset(names + idx->n_names, 0, (id + 1 - idx->n_names) * sizeof(char*));
+        idx->names = names;
+        idx->n_names = id + 1;
+    }
+
+    free(idx->names[id]);
+    idx->names[id] = (char*)malloc(len + 1);
+    if(!idx->names[id])
+        return -1;
+    memcpy(idx->names[id], name, len);
+    idx->names[id][len] = 0;
+    return 0;
+}
+
+static int
+index_entry(rawbin_index* idx, const rawbin_entry* entry)
+{
+    rawbin_entry* entries;
+    size_t alloc;
+
+    if(idx->n_entries == idx->alloc_entries)
+    {
+        alloc = idx->alloc_entries ? idx->alloc_entries * 2 : 64;
+        entries = (rawbin_entry*)realloc(idx->entries, alloc * sizeof(rawbin_entry));
+        if(!entries)
+            return -1;
+        idx->entries = entries;
+        idx->alloc_entries = alloc;
+    }
+
+    memcpy(&idx->entries[idx->n_entries++], entry, sizeof(rawbin_entry));
+    return 0;
+}
+
+static void
+index_free(rawbin_index* idx)
+{
+    int i;
+
+    for(i = 0; i < idx->n_names; ++i)
+        free(idx->names[i]);
+    free(idx->names);
+    free(idx->entries);
+    memset(idx, 0, sizeof(*idx));
+}
+
+static void
+parse_block(const unsigned char* p, uint64_t offset, rawbin_entry* entry)
+{
+    entry->offset = offset;
+    entry->id = get_u16(p);
+    entry->type = p[2];
+    entry->count = get_u32(p + 4);
+    entry->first = (int64_t)get_u64(p + 8);
+    entry->last = (int64_t)get_u64(p + 16);
+}
+
+/* Read the index record written when the file was closed */
+static int
+parse_index(const unsigned char* data, size_t len, rawbin_index* idx)
+{
+    const unsigned char* p;
+    const unsigned char* end;
+    rawbin_entry entry;
+    uint64_t offset;
+    uint32_t n, i;
+    uint16_t id, nlen;
+
+    if(len < HEADER_LEN + TRAILER_LEN ||
+       memcmp(data + len - TRAILER_LEN, INDEX_MAGIC, 8) != 0)
+        return -1;
+
+    offset = get_u64(data + len - 8);
+    if(offset < HEADER_LEN || offset > len - TRAILER_LEN - RECORD_LEN ||
+       data[offset] != RECORD_INDEX ||
+       get_u32(data + offset + 4) != len - TRAILER_LEN - RECORD_LEN - offset)
+        return -1;
+
+    p = data + offset + RECORD_LEN;
+    end = data + len - TRAILER_LEN;
+
+    if(end - p < 4)
+        return -1;
+    n = get_u32(p);
+    p += 4;
+
+    for(i = 0; i < n; ++i)
+    {
+        if(end - p < 4)
+            return -1;
+        id = get_u16(p);
+        nlen = get_u16(p + 2);
+        p += 4;
+        if(end - p < nlen || index_name(idx, id, p, nlen) < 0)
+            return -1;
+        p += nlen;
+    }
+
+    if(end - p < 4)
+        return -1;
+    n = get_u32(p);
+    p += 4;
+
+    if((uint64_t)(end - p) != (uint64_t)n * ENTRY_LEN)
+        return -1;
+
+    for(i = 0; i < n; ++i, p += ENTRY_LEN)
+    {
+        parse_block(p + 8, get_u64(p), &entry);
+        if(entry.offset < HEADER_LEN || entry.offset >= offset)
+            return -1;
+        if(index_entry(idx, &entry) < 0)
+            return -1;
+    }
+
+    idx->end = offset;
+    return 0;
+}
+
+/* Go through the records, for files that weren't closed properly */
+static int
+scan_records(const unsigned char* data, size_t len, rawbin_index* idx)
+{
+    rawbin_entry entry;
+    uint64_t offset, rlen;
+
+    for(offset = HEADER_LEN; len - offset >= RECORD_LEN; offset += RECORD_LEN + rlen)
+    {
+        rlen = get_u32(data + offset + 4);
+        if(rlen > len - offset - RECORD_LEN)
+            break;
+
+        switch(data[offset])
+        {
+        case RECORD_FIELD:
+            if(rlen < 2)
+                return -1;
+            if(index_name(idx, get_u16(data + offset + RECORD_LEN),
+                          data + offset + RECORD_LEN + 2, rlen - 2) < 0)
+                return -1;
+            break;
+        case RECORD_BLOCK:
+            if(rlen < BLOCK_LEN)
+                return -1;
+            parse_block(data + offset + RECORD_LEN, offset, &entry);
+            if(index_entry(idx, &entry) < 0)
+                return -1;
+            break;
+        default:
+            break;
+        }
+    }
+
+    /* Anything after the last whole record is cut off */
+    idx->end = offset;
+    return 0;
+}
+
+static int
+parse_file(const unsigned char* data, size_t len, rawbin_index* idx,
+           char* errbuf, size_t errlen)
+{
+    if(len < HEADER_LEN || memcmp(data, FILE_MAGIC, 8) != 0)
+    {
+        snprintf(errbuf, errlen, "not a binary raw file");
+        return -1;
+    }
+
+    if(get_u32(data + 8) != FILE_VERSION)
+    {
+        snprintf(errbuf, errlen, "unsupported binary raw file version: %u",
+                 (unsigned int)get_u32(data + 8));
+        return -1;
+    }
+
+    if(parse_index(data, len, idx) == 0)
+        return 0;
+
+    index_free(idx);
+    if(scan_records(data, len, idx) < 0)
+    {
+        snprintf(errbuf, errlen, "invalid or corrupted binary raw file");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * WRITING
+ */
+
+typedef struct _rawbin_series
+{
+    uint16_t id;
+    int type;                   /* Type of values in the block */
+    uint32_t count;             /* Values in the block */
+    int64_t first;
+    int64_t last;
+    int64_t delta;              /* Between the last two times */
+    uint64_t prev;              /* Bits of the last value */
+    int lead;                   /* Window of the last XOR, or -1 */
+    int trail;
+    bitbuf bits;
+}
+rawbin_series;
+
+struct _rawbin_file
+{
+    int fd;
+    rawbin_index idx;
+    hsh_t* series;              /* By field name */
+    rawbin_series** by_id;
+    int n_series;
+};
+
+static int
+write_record(rawbin_file* rf, int type, const unsigned char* payload,
+             size_t plen, const unsigned char* extra, size_t elen)
+{
+    unsigned char header[RECORD_LEN];
+    struct iovec iov[3];
+    ssize_t r;
+
+    memset(header, 0, sizeof(header));
+    header[0] = type;
+    put_u32(header + 4, plen + elen);
+
+    if(lseek(rf->fd, rf->idx.end, SEEK_SET) == (off_t)-1)
+        return -1;
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = RECORD_LEN;
+    iov[1].iov_base = (void*)payload;
+    iov[1].iov_len = plen;
+    iov[2].iov_base = (void*)extra;
+    iov[2].iov_len = elen;
+
+    r = writev(rf->fd, iov, elen ? 3 : 2);
+    if(r < 0)
+        return -1;
+    if((size_t)r != RECORD_LEN + plen + elen)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    rf->idx.end += r;
+    return 0;
+}
+
+static int
+write_block(rawbin_file* rf, rawbin_series* s)
+{
+    unsigned char header[BLOCK_LEN];
+    rawbin_entry entry;
+    int r;
+
+    if(!s->count)
+        return 0;
+
+    if(s->bits.failed)
+    {
+        errno = ENOMEM;
+        r = -1;
+    }
+    else
+    {
+        memset(header, 0, sizeof(header));
+        put_u16(header, s->id);
+        header[2] = s->type;
+        put_u32(header + 4, s->count);
+        put_u64(header + 8, (uint64_t)s->first);
+        put_u64(header + 16, (uint64_t)s->last);
+        put_u32(header + 24, s->bits.len);
+
+        entry.offset = rf->idx.end;
+        r = write_record(rf, RECORD_BLOCK, header, BLOCK_LEN,
+                         s->bits.data, (s->bits.len + 7) / 8);
+        if(r == 0)
+        {
+            parse_block(header, entry.offset, &entry);
+            if(index_entry(&rf->idx, &entry) < 0)
+            {
+                errno = ENOMEM;
+                r = -1;
+            }
+        }
+    }
+
+    /* Start a new block either way */
+    s->count = 0;
+    bits_reset(&s->bits);
+    return r;
+}
+
+static rawbin_series*
+get_series(rawbin_file* rf, const char* field)
+{
+    rawbin_series** by_id;
+    rawbin_series* s;
+    unsigned char id[2];
+    size_t len;
+    int i;
+
+    s = (rawbin_series*)hsh_get(rf->series, field, -1);
+    if(s)
+        return s;
+
+    /* Use the id from the file if it has this field already */
+    for(i = 0; i < rf->idx.n_names; ++i)
+    {
+        if(rf->idx.names[i] && strcmp(rf->idx.names[i], field) == 0)
+            break;
+    }
+
+    len = strlen(field);
+    if(i == rf->idx.n_names)
+    {
+        if(i >= MAX_FIELDS || len > 0xFFFF)
+        {
+            errno = E2BIG;
+            return NULL;
+        }
+
+        put_u16(id, i);
+        if(write_record(rf, RECORD_FIELD, id, 2, (const unsigned char*)field, len) < 0)
+            return NULL;
+        if(index_name(&rf->idx, i, (const unsigned char*)field, len) < 0)
+        {
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    s = (rawbin_series*)calloc(1, sizeof(rawbin_series));
+    by_id = (rawbin_series**)realloc(rf->by_id, (rf->n_series + 1) * sizeof(rawbin_series*));
+    if(by_id)
+        rf->by_id = by_id;
+    if(!s || !by_id || !hsh_set(rf->series, rf->idx.names[i], -1, s))
+    {
+        free(s);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    s->id = i;
+    rf->by_id[rf->n_series++] = s;
+    return s;
+}
+
+static void
+encode_time(bitbuf* bb, int64_t dod)
+{
+    if(dod == 0)
+    {
+        bits_put(bb, 0, 1);
+    }
+    else if(dod >= -63 && dod <= 64)
+    {
+        bits_put(bb, 0x2, 2);
+        bits_put(bb, dod + 63, 7);
+    }
+    else if(dod >= -255 && dod <= 256)
+    {
+        bits_put(bb, 0x6, 3);
+        bits_put(bb, dod + 255, 9);
+    }
+    else if(dod >= -2047 && dod <= 2048)
+    {
+        bits_put(bb, 0xE, 4);
+        bits_put(bb, dod + 2047, 12);
+    }
+    else
+    {
+        bits_put(bb, 0xF, 4);
+        bits_put(bb, (uint64_t)dod, 64);
+    }
+}
+
+static void
+encode_value(rawbin_series* s, uint64_t bits)
+{
+    uint64_t x = bits ^ s->prev;
+    int lead, trail, sig;
+
+    if(x == 0)
+    {
+        bits_put(&s->bits, 0, 1);
+        return;
+    }
+
+    lead = leading_zeros(x);
+    if(lead > 31)
+        lead = 31;
+    trail = trailing_zeros(x);
+
+    /* Fits in the same window as last time */
+    if(s->lead >= 0 && lead >= s->lead && trail >= s->trail)
+    {
+        sig = 64 - s->lead - s->trail;
+        bits_put(&s->bits, 0x2, 2);
+        bits_put(&s->bits, x >> s->trail, sig);
+    }
+    else
+    {
+        sig = 64 - lead - trail;
+        bits_put(&s->bits, 0x3, 2);
+        bits_put(&s->bits, lead, 5);
+        bits_put(&s->bits, sig - 1, 6);
+        bits_put(&s->bits, x >> trail, sig);
+        s->lead = lead;
+        s->trail = trail;
+    }
+}
+
+rawbin_file*
+rawbin_open(const char* path, char* errbuf, size_t errlen)
+{
+    unsigned char header[HEADER_LEN];
+    rawbin_file* rf;
+    struct stat sb;
+    void* data;
+    int erno;
+
+    rf = (rawbin_file*)calloc(1, sizeof(rawbin_file));
+    if(!rf || !(rf->series = hsh_create()))
+    {
+        snprintf(errbuf, errlen, "out of memory");
+        free(rf);
+        return NULL;
+    }
+
+    rf->fd = open(path, O_RDWR | O_CREAT, 0666);
+    if(rf->fd < 0 || fstat(rf->fd, &sb) < 0)
+    {
+        snprintf(errbuf, errlen, "%s", strerror(errno));
+        goto failed;
+    }
+
+    /* A new file */
+    if(sb.st_size == 0)
+    {
+        memset(header, 0, sizeof(header));
+        memcpy(header, FILE_MAGIC, 8);
+        put_u32(header + 8, FILE_VERSION);
+        if(write(rf->fd, header, HEADER_LEN) != HEADER_LEN)
+        {
+            snprintf(errbuf, errlen, "%s", strerror(errno ? errno : ENOSPC));
+            goto failed;
+        }
+        rf->idx.end = HEADER_LEN;
+        return rf;
+    }
+
+    data = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, rf->fd, 0);
+    if(data == MAP_FAILED)
+    {
+        snprintf(errbuf, errlen, "%s", strerror(errno));
+        goto failed;
+    }
+
+    if(parse_file((unsigned char*)data, sb.st_size, &rf->idx, errbuf, errlen) < 0)
+    {
+        munmap(data, sb.st_size);
+        errno = EINVAL;
+        goto failed;
+    }
+
+    munmap(data, sb.st_size);
+
+    /* New records go over the old index */
+    if(ftruncate(rf->fd, rf->idx.end) < 0)
+    {
+        snprintf(errbuf, errlen, "%s", strerror(errno));
+        goto failed;
+    }
+
+    return rf;
+
+failed:
+    erno = errno;
+    if(rf->fd >= 0)
+        close(rf->fd);
+    index_free(&rf->idx);
+    hsh_free(rf->series);
+    free(rf);
+    errno = erno;
+    return NULL;
+}
+
+int
+rawbin_add(rawbin_file* rf, const char* field, int64_t when, const rawbin_value* value)
+{
+    rawbin_series* s;
+    uint64_t bits;
+    int64_t delta;
+    int r = 0;
+
+    s = get_series(rf, field);
+    if(!s)
+        return -1;
+
+    /* These need a new block */
+    if(s->count && (s->type != value->type || when < s->last ||
+                    s->count >= MAX_POINTS))
+        r = write_block(rf, s);
+
+    bits = value_bits(value);
+
+    if(!s->count)
+    {
+        s->type = value->type;
+        s->first = s->last = when;
+        s->delta = 0;
+        s->lead = -1;
+        s->trail = 0;
+        s->prev = bits;
+        if(s->type != RAWBIN_UNSET)
+            bits_put(&s->bits, bits, 64);
+        s->count = 1;
+        return r;
+    }
+
+    delta = when - s->last;
+    encode_time(&s->bits, delta - s->delta);
+    s->delta = delta;
+    s->last = when;
+
+    if(s->type != RAWBIN_UNSET)
+        encode_value(s, bits);
+    s->prev = bits;
+    s->count++;
+
+    return r;
+}
+
+int
+rawbin_flush(rawbin_file* rf, int64_t older)
+{
+    int i, r = 0;
+
+    for(i = 0; i < rf->n_series; ++i)
+    {
+        if(rf->by_id[i]->count && rf->by_id[i]->first < older)
+        {
+            if(write_block(rf, rf->by_id[i]) < 0)
+                r = -1;
+        }
+    }
+
+    return r;
+}
+
+static int
+write_index(rawbin_file* rf)
+{
+    unsigned char trailer[TRAILER_LEN];
+    unsigned char* data;
+    unsigned char* p;
+    rawbin_entry* entry;
+    uint64_t offset;
+    size_t len, i;
+    int n_names = 0;
+    int r;
+
+    len = 8;
+    for(i = 0; i < (size_t)rf->idx.n_names; ++i)
+    {
+        if(rf->idx.names[i])
+        {
+            len += 4 + strlen(rf->idx.names[i]);
+            n_names++;
+        }
+    }
+    len += rf->idx.n_entries * ENTRY_LEN;
+
+    p = data = (unsigned char*)calloc(1, len);
+    if(!data)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    put_u32(p, n_names);
+    p += 4;
+    for(i = 0; i < (size_t)rf->idx.n_names; ++i)
+    {
+        if(rf->idx.names[i])
+        {
+            put_u16(p, i);
+            put_u16(p + 2, strlen(rf->idx.names[i]));
+            memcpy(p + 4, rf->idx.names[i], strlen(rf->idx.names[i]));
+            p += 4 + strlen(rf->idx.names[i]);
+        }
+    }
+
+    put_u32(p, rf->idx.n_entries);
+    p += 4;
+    for(i = 0; i < rf->idx.n_entries; ++i, p += ENTRY_LEN)
+    {
+        entry = &rf->idx.entries[i];
+        put_u64(p, entry->offset);
+        put_u16(p + 8, entry->id);
+        p[10] = entry->type;
+        put_u32(p + 12, entry->count);
+        put_u64(p + 16, (uint64_t)entry->first);
+        put_u64(p + 24, (uint64_t)entry->last);
+    }
+
+    offset = rf->idx.end;
+    r = write_record(rf, RECORD_INDEX, data, len, NULL, 0);
+    free(data);
+
+    /* And the trailer pointing to the index goes right after it */
+    if(r == 0)
+    {
+        memcpy(trailer, INDEX_MAGIC, 8);
+        put_u64(trailer + 8, offset);
+        if(write(rf->fd, trailer, TRAILER_LEN) != TRAILER_LEN)
+            r = -1;
+    }
+
+    return r;
+}
+
+int
+rawbin_close(rawbin_file* rf)
+{
+    int i, r;
+
+    r = rawbin_flush(rf, INT64_MAX);
+    if(write_index(rf) < 0)
+        r = -1;
+    if(close(rf->fd) < 0)
+        r = -1;
+
+    for(i = 0; i < rf->n_series; ++i)
+    {
+        free(rf->by_id[i]->bits.data);
+        free(rf->by_id[i]);
+    }
+
+    free(rf->by_id);
+    hsh_free(rf->series);
+    index_free(&rf->idx);
+    free(rf);
+    return r;
+}
+
+/* -----------------------------------------------------------------------------
+ * READING
+ */
+
+struct _rawbin_reader
+{
+    unsigned char* data;
+    size_t len;
+    rawbin_index idx;
+};
+
+static int
+decode_time(bitreader* br, int64_t* dod)
+{
+    uint64_t v;
+    int n;
+
+    /* Count the leading ones of the prefix, up to four */
+    for(n = 0; n < 4; ++n)
+    {
+        if(bits_get(br, 1, &v) < 0)
+            return -1;
+        if(v == 0)
+            break;
+    }
+
+    switch(n)
+    {
+    case 0:
+        *dod = 0;
+        return 0;
+    case 1:
+        if(bits_get(br, 7, &v) < 0)
+            return -1;
+        *dod = (int64_t)v - 63;
+        return 0;
+    case 2:
+        if(bits_get(br, 9, &v) < 0)
+            return -1;
+        *dod = (int64_t)v - 255;
+        return 0;
+    case 3:
+        if(bits_get(br, 12, &v) < 0)
+            return -1;
+        *dod = (int64_t)v - 2047;
+        return 0;
+    default:
+        if(bits_get(br, 64, &v) < 0)
+            return -1;
+        *dod = (int64_t)v;
+        return 0;
+    }
+}
+
+static int
+decode_value(bitreader* br, uint64_t* bits, int* lead, int* trail)
+{
+    uint64_t v, x;
+    int sig;
+
+    if(bits_get(br, 1, &v) < 0)
+        return -1;
+
+    /* Same as the last value */
+    if(v == 0)
+        return 0;
+
+    if(bits_get(br, 1, &v) < 0)
+        return -1;
+
+    /* A new window */
+    if(v)
+    {
+        if(bits_get(br, 5, &v) < 0)
+            return -1;
+        *lead = v;
+        if(bits_get(br, 6, &v) < 0)
+            return -1;
+        sig = v + 1;
+        *trail = 64 - *lead - sig;
+        if(*trail < 0)
+            return -1;
+    }
+
+    /* Or the same window as last time */
+    else if(*lead < 0)
+    {
+        return -1;
+    }
+
+    sig = 64 - *lead - *trail;
+    if(bits_get(br, sig, &x) < 0)
+        return -1;
+
+    *bits ^= x << *trail;
+    return 0;
+}
+
+static int
+decode_block(rawbin_reader* rr, rawbin_entry* entry, const char* field,
+             int64_t from, int64_t to, rawbin_callback callback, void* arg)
+{
+    const unsigned char* p;
+    rawbin_value value;
+    bitreader br;
+    uint64_t bits = 0;
+    int64_t when, delta, dod;
+    uint32_t i, rlen;
+    int lead = -1, trail = 0;
+
+    if(entry->type > RAWBIN_FLOAT ||
+       entry->offset + RECORD_LEN + BLOCK_LEN > rr->idx.end)
+        return -1;
+
+    p = rr->data + entry->offset;
+    rlen = get_u32(p + 4);
+    if(p[0] != RECORD_BLOCK || rlen < BLOCK_LEN ||
+       entry->offset + RECORD_LEN + rlen > rr->idx.end)
+        return -1;
+
+    p += RECORD_LEN;
+    br.data = p + BLOCK_LEN;
+    br.len = get_u32(p + 24);
+    br.pos = 0;
+    if(((uint64_t)br.len + 7) / 8 > rlen - BLOCK_LEN)
+        return -1;
+
+    when = entry->first;
+    delta = 0;
+
+    if(entry->type != RAWBIN_UNSET && bits_get(&br, 64, &bits) < 0)
+        return -1;
+
+    for(i = 0; i < entry->count; ++i)
+    {
+        if(i > 0)
+        {
+            if(decode_time(&br, &dod) < 0)
+                return -1;
+            delta += dod;
+            when += delta;
+
+            if(entry->type != RAWBIN_UNSET &&
+               decode_value(&br, &bits, &lead, &trail) < 0)
+                return -1;
+        }
+
+        if(when >= from && when <= to)
+        {
+            bits_value(entry->type, bits, &value);
+            (callback)(field, when, &value, arg);
+        }
+    }
+
+    return 0;
+}
+
+rawbin_reader*
+rawbin_map(const char* path, char* errbuf, size_t errlen)
+{
+    rawbin_reader* rr;
+    struct stat sb;
+    void* data;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0 || fstat(fd, &sb) < 0)
+    {
+        snprintf(errbuf, errlen, "%s", strerror(errno));
+        if(fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    if(sb.st_size == 0)
+    {
+        snprintf(errbuf, errlen, "not a binary raw file");
+        close(fd);
+        return NULL;
+    }
+
+    data = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+    {
+        snprintf(errbuf, errlen, "%s", strerror(errno));
+        return NULL;
+    }
+
+    rr = (rawbin_reader*)calloc(1, sizeof(rawbin_reader));
+    if(!rr)
+    {
+        snprintf(errbuf, errlen, "out of memory");
+        munmap(data, sb.st_size);
+        return NULL;
+    }
+
+    rr->data = (unsigned char*)data;
+    rr->len = sb.st_size;
+
+    if(parse_file(rr->data, rr->len, &rr->idx, errbuf, errlen) < 0)
+    {
+        rawbin_unmap(rr);
+        return NULL;
+    }
+
+    return rr;
+}
+
+int
+rawbin_read(rawbin_reader* rr, const char* field, int64_t from, int64_t to,
+            rawbin_callback callback, void* arg)
+{
+    rawbin_entry* entry;
+    const char* name;
+    size_t i;
+    int r = 0;
+
+    for(i = 0; i < rr->idx.n_entries; ++i)
+    {
+        entry = &rr->idx.entries[i];
+        if(entry->last < from || entry->first > to)
+            continue;
+
+        if(entry->id >= rr->idx.n_names || !rr->idx.names[entry->id])
+            continue;
+        name = rr->idx.names[entry->id];
+        if(field && strcmp(field, name) != 0)
+            continue;
+
+        if(decode_block(rr, entry, name, from, to, callback, arg) < 0)
+            r = -1;
+    }
+
+    return r;
+}
+
+void
+rawbin_unmap(rawbin_reader* rr)
+{
+    if(rr->data)
+        munmap(rr->data, rr->len);
+    index_free(&rr->idx);
+    free(rr);
+}
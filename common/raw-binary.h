@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2008, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+
+#ifndef __RAW_BINARY_H__
+#define __RAW_BINARY_H__
+
+#include <stdint.h>
+
+/*
+ * A compact binary alternative to the raw CSV files. Each file has a
+ * dictionary of field names, and the values of each field are stored
+ * in blocks, with timestamps as delta of deltas and values XORed
+ * with the previous one. An index of the blocks is kept at the end
+ * of the file. Times are in milliseconds since the epoch.
+ */
+
+#define RAWBIN_UNSET    0
+#define RAWBIN_INT      1
+#define RAWBIN_FLOAT    2
+
+typedef struct _rawbin_value
+{
+    int type;
+    union
+    {
+        int64_t i_value;
+        double f_value;
+    } v;
+}
+rawbin_value;
+
+/* Writing, from one thread at a time. Sets errno on failure */
+typedef struct _rawbin_file rawbin_file;
+
+rawbin_file* rawbin_open(const char* path, char* errbuf, size_t errlen);
+int rawbin_add(rawbin_file* rf, const char* field, int64_t when, const rawbin_value* value);
+int rawbin_flush(rawbin_file* rf, int64_t older);
+int rawbin_close(rawbin_file* rf);
+
+/* Reading, the file is mapped into memory */
+typedef struct _rawbin_reader rawbin_reader;
+
+typedef void (*rawbin_callback)(const char* field, int64_t when,
+                                const rawbin_value* value, void* arg);
+
+rawbin_reader* rawbin_map(const char* path, char* errbuf, size_t errlen);
+int rawbin_read(rawbin_reader* rr, const char* field, int64_t from, int64_t to,
+                rawbin_callback callback, void* arg);
+void rawbin_unmap(rawbin_reader* rr);
+
+#endif /* __RAW_BINARY_H__ */
@@ -405,6 +405,21 @@ server_watch(int fd, int type, server_socket_callback callback, void* arg)
     return 0;
 }
 
+/* Change what to watch for on an fd that's already watched */
+void
+server_rewatch(int fd, int type)
+{
+    ASSERT(fd != -1);
+
+    FD_CLR(fd, &ctx.read_fds);
+    FD_CLR(fd, &ctx.write_fds);
+
+    if (type & SERVER_READ)
+        FD_SET(fd, &ctx.read_fds);
+    if (type & SERVER_WRITE)
+        FD_SET(fd, &ctx.write_fds);
+}
+
 void
 server_unwatch(int fd)
 {
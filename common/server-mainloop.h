@@ -48,6 +48,7 @@ int     server_run();
 void    server_stop();
 int     server_stopped();
 int     server_watch(int fd, int type, server_socket_callback callback, void* arg);
+void    server_rewatch(int fd, int type);
 void    server_unwatch(int fd);
 int     server_timer(int length, server_timer_callback callback, void* arg);
 int     server_oneshot(int length, server_timer_callback callback, void* arg);
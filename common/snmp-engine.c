@@ -47,11 +47,14 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <unistd.h>
 #include <syslog.h>
 #include <err.h>
 #include <arpa/inet.h>
+#include <fnmatch.h>
+#include <regex.h>
 
 #include <bsnmp/asn1.h>
 #include <bsnmp/snmp.h>
@@ -372,6 +375,9 @@ struct request
 		void *arg;
 	} callbacks[SNMP_MAX_BINDINGS];
 
+	/* A GETBULK request gets all its values in one callback */
+	snmp_bulk_response bulk;
+
 	/* One flag for each binding */
 	int is_duplicate[SNMP_MAX_BINDINGS];
 
@@ -391,6 +397,9 @@ struct socket
 
 #define MAX_SNMP_REQUEST_ID 0x800000
 
+/* Shortest time between retries, for sub-second polling */
+#define MIN_RETRY_INTERVAL 20
+
 /* The number of SNMP packet retries */
 static int snmp_retries = 3;
 
@@ -534,6 +543,14 @@ request_failure (struct request *req, int code)
     /* Remember snmp_id in case req is freed by the callback */
     snmp_id = req->snmp_id;
 
+	/* A bulk request has only the one callback */
+	if (req->bulk) {
+		(req->bulk) (MAKE_REQUEST_ID (req->snmp_id, 0), code, NULL, 0,
+		             req->callbacks[0].arg);
+		if (hsh_get (snmp_processing, &snmp_id, sizeof (snmp_id)) != req)
+			return;
+	}
+
 	/* For each request SNMP value... */
 	for (j = 0; j < req->pdu.nbindings; ++j) {
 
@@ -632,7 +649,7 @@ request_get_dispatch (struct request* req, struct snmp_pdu* pdu)
 static void
 request_other_dispatch (struct request* req, struct snmp_pdu* pdu)
 {
-	int snmp_id;
+	int j, snmp_id;
 	void *val;
 
 	ASSERT (req);
@@ -642,40 +659,80 @@ request_other_dispatch (struct request* req, struct snmp_pdu* pdu)
 	ASSERT (req->pdu.type != SNMP_PDU_GET);
 
 	/* Remember snmp_id in case req is freed by the callback */
-    snmp_id = req->snmp_id;
+	snmp_id = req->snmp_id;
 
 	/*
-	 * For requests other than GET we just use the first value
-	 * that was sent. See below where we limit to one binding
-	 * per SNMP request when other than GET.
+	 * For requests other than GET the values that come back are for
+	 * other OIDs than the ones we sent, so we rely on the order of the
+	 * values. See snmp_engine_next where GETNEXT requests get more than
+	 * one binding per SNMP request.
 	 */
 
-	if (pdu->nbindings == 0) {
-		log_warn ("received response from the server without any values");
-		return;
-	}
-
-	if (pdu->nbindings > 1)
+	if (pdu->nbindings < req->pdu.nbindings)
+		log_warn ("received response from the server with missing values");
+	else if (pdu->nbindings > req->pdu.nbindings)
 		log_warn ("received response from the server with extra values");
 
-	/* Shouldn't have sent more than one binding */
-	ASSERT (req->pdu.nbindings == 1);
+	for (j = 0; j < req->pdu.nbindings; ++j) {
+
+		if (!req->callbacks[j].func)
+			continue;
+
+		if (j < pdu->nbindings)
+			(req->callbacks[j].func) (MAKE_REQUEST_ID (req->snmp_id, j), SNMP_ERR_NOERROR,
+			                          &(pdu->bindings[j]), req->callbacks[j].arg);
+		else
+			(req->callbacks[j].func) (MAKE_REQUEST_ID (req->snmp_id, j), SNMP_ERR_GENERR,
+			                          NULL, req->callbacks[j].arg);
 
-	if (req->callbacks[0].func)
-		(req->callbacks[0].func) (MAKE_REQUEST_ID (req->snmp_id, 0), SNMP_ERR_NOERROR,
-						          &(pdu->bindings[0]), req->callbacks[0].arg);
+		/*
+		 * Request could have been freed by the callback, by calling the cancel
+		 * function, check and bail if so.
+		 */
+		if (hsh_get (snmp_processing, &snmp_id, sizeof (snmp_id)) != req)
+			return;
+
+		req->callbacks[j].func = NULL;
+		req->callbacks[j].arg = NULL;
+	}
 
 	log_debug ("request #%d is complete", snmp_id);
 
+	val = hsh_rem (snmp_processing, &req->snmp_id, sizeof (req->snmp_id));
+	ASSERT (val == req);
+	request_release (req);
+}
+
+static void
+request_bulk_dispatch (struct request* req, struct snmp_pdu* pdu)
+{
+	int snmp_id;
+
+	ASSERT (req);
+	ASSERT (pdu);
+	ASSERT (req->snmp_id == pdu->request_id);
+	ASSERT (pdu->error_status == SNMP_ERR_NOERROR);
+	ASSERT (req->pdu.type == SNMP_PDU_GETBULK);
+
+	/* Remember snmp_id in case req is freed by the callback */
+	snmp_id = req->snmp_id;
+
 	/*
-	 * Request could have been freed by the callback, by calling the cancel
-	 * function, check and bail if so.
+	 * All the values that come back follow the one binding we sent,
+	 * so hand them all over at once.
 	 */
-	if (hsh_get (snmp_processing, &req->snmp_id, sizeof (req->snmp_id)) != req)
-		return;
+	if (req->bulk) {
+		(req->bulk) (MAKE_REQUEST_ID (req->snmp_id, 0), SNMP_ERR_NOERROR,
+		             pdu->bindings, pdu->nbindings, req->callbacks[0].arg);
 
-	val = hsh_rem (snmp_processing, &req->snmp_id, sizeof (req->snmp_id));
-	ASSERT (val == req);
+		/* Request could have been freed by the callback */
+		if (hsh_get (snmp_processing, &snmp_id, sizeof (snmp_id)) != req)
+			return;
+	}
+
+	log_debug ("request #%d is complete", snmp_id);
+
+	hsh_rem (snmp_processing, &req->snmp_id, sizeof (req->snmp_id));
 	request_release (req);
 }
 
@@ -737,6 +794,8 @@ request_response (int fd, int type, void* arg)
 
 		if (req->pdu.type == SNMP_PDU_GET)
 			request_get_dispatch (req, &pdu);
+		else if (req->pdu.type == SNMP_PDU_GETBULK)
+			request_bulk_dispatch (req, &pdu);
 		else
 			request_other_dispatch (req, &pdu);
 
@@ -914,8 +973,13 @@ request_prep_instance (struct host *host, mstime interval, mstime timeout,
 	req->pdu.error_index = 0;
 	req->pdu.nbindings = 0;
 
-	/* Send interval is 200 ms when poll interval is below 2 seconds */
+	/*
+	 * Send interval is 200 ms when poll interval is below 2 seconds,
+	 * and below a second all the retries fit in the poll interval.
+	 */
 	req->retry_interval = (interval <= 2000) ? 200L : 600L;
+	if (interval < 1000)
+		req->retry_interval = MAX (interval / (snmp_retries + 1), MIN_RETRY_INTERVAL);
 
 	/* Timeout is for the last packet sent, not first */
 	req->when_timeout = server_get_time () + (req->retry_interval * ((mstime)snmp_retries)) + timeout;
@@ -983,6 +1047,105 @@ snmp_engine_request (const char *hostname, const char *port,
 	return MAKE_REQUEST_ID (req->snmp_id, callback_id);
 }
 
+int
+snmp_engine_bulk (const char *hostname, const char *port,
+                  const char *community, int version,
+                  mstime interval, mstime timeout, struct asn_oid *oid,
+                  int repetitions, snmp_bulk_response func, void *arg)
+{
+	struct host *host;
+	struct request *req;
+	int is_duplicate;
+
+	ASSERT (func);
+	ASSERT (version != SNMP_V1);
+	ASSERT (repetitions > 0);
+
+	/* Lookup host for request */
+	host = host_instance (hostname, port, community, version, interval);
+	if (!host)
+		return 0;
+
+	/* Never piggy backed, see below */
+	req = request_prep_instance (host, interval, timeout, SNMP_PDU_GETBULK, oid, &is_duplicate);
+	if (!req)
+		return 0;
+
+	ASSERT (req->pdu.nbindings == 0);
+
+	/* No non-repeaters, and the one binding repeated */
+	req->pdu.error_status = 0;
+	req->pdu.error_index = repetitions;
+	req->pdu.bindings[0].var = *oid;
+	req->pdu.bindings[0].syntax = SNMP_SYNTAX_NULL;
+	req->pdu.nbindings = 1;
+	req->bulk = func;
+	req->callbacks[0].arg = arg;
+
+	/* Send it along with anything else on the idle callback */
+	request_flush (req, server_get_time ());
+	if (!snmp_flush_pending) {
+		server_oneshot (0, request_flush_cb, NULL);
+		snmp_flush_pending = 1;
+	}
+
+	return MAKE_REQUEST_ID (req->snmp_id, 0);
+}
+
+int
+snmp_engine_next (const char *hostname, const char *port,
+                  const char *community, int version,
+                  mstime interval, mstime timeout, int n_oids,
+                  struct asn_oid *oids, snmp_response *funcs,
+                  void **args, int *requests)
+{
+	struct host *host;
+	struct request *req;
+	int is_duplicate;
+	int callback_id;
+	int i;
+
+	ASSERT (n_oids > 0);
+	ASSERT (oids && funcs && args && requests);
+
+	for (i = 0; i < n_oids; ++i)
+		requests[i] = 0;
+
+	/* Lookup host for request */
+	host = host_instance (hostname, port, community, version, interval);
+	if (!host)
+		return 0;
+
+	/*
+	 * These all go out together, and nothing else piggy backs onto
+	 * them, since they're flushed below. Requests that fill up are
+	 * sent off by request_prep_instance.
+	 */
+	req = NULL;
+	for (i = 0; i < n_oids; ++i) {
+		ASSERT (funcs[i]);
+
+		req = request_prep_instance (host, interval, timeout, SNMP_PDU_GETNEXT,
+		                             &oids[i], &is_duplicate);
+		if (!req)
+			break;
+
+		callback_id = req->pdu.nbindings;
+		req->pdu.bindings[callback_id].var = oids[i];
+		req->pdu.bindings[callback_id].syntax = SNMP_SYNTAX_NULL;
+		req->callbacks[callback_id].func = funcs[i];
+		req->callbacks[callback_id].arg = args[i];
+		req->pdu.nbindings++;
+
+		requests[i] = MAKE_REQUEST_ID (req->snmp_id, callback_id);
+	}
+
+	if (host->prepared && host->prepared->pdu.type == SNMP_PDU_GETNEXT)
+		request_flush (host->prepared, server_get_time ());
+
+	return i;
+}
+
 void
 snmp_engine_remove (int id, const char *during)
 {
@@ -1009,6 +1172,7 @@ snmp_engine_remove (int id, const char *during)
 	/* Remove this callback from the request */
 	req->callbacks[callback_id].func = NULL;
 	req->callbacks[callback_id].arg = NULL;
+	req->bulk = NULL;
 
 	/* See if any other callbacks exist in the request */
 	for (i = 0; i < req->pdu.nbindings; ++i) {
@@ -1246,14 +1410,224 @@ snmp_engine_stop (void)
 	host_cleanup ();
 }
 
-int
-snmp_engine_match (const struct snmp_value *value, const char *text)
+/* -----------------------------------------------------------------------------
+ * MATCHING
+ */
+
+#define MATCH_EXACT	0
+#define MATCH_PREFIX	1
+#define MATCH_GLOB	2
+#define MATCH_REGEX	3
+#define MATCH_OID	4
+
+struct snmp_match {
+	int type;
+
+	/* The text, for exact and prefix string matches */
+	char *text;
+	size_t len;
+
+	/* The text parsed for each value syntax, when it parses */
+	unsigned int has_integer : 1;
+	unsigned int has_uint32 : 1;
+	unsigned int has_uint64 : 1;
+	unsigned int has_ipaddress : 1;
+	unsigned int has_oid : 1;
+
+	int32_t integer;
+	uint32_t uint32;
+	uint64_t uint64;
+	struct in_addr ipaddress;
+	struct asn_oid oid;
+
+	/* The compiled pattern for regex matches */
+	regex_t regex;
+};
+
+static const struct {
+	const char *prefix;
+	int type;
+} MATCH_TYPES[] = {
+	{ "exact:", MATCH_EXACT },
+	{ "prefix:", MATCH_PREFIX },
+	{ "glob:", MATCH_GLOB },
+	{ "regex:", MATCH_REGEX },
+	{ "oid:", MATCH_OID },
+};
+
+/* Only digits and dots, like 1.3.6.1, which parse without any MIBs */
+static int
+numeric_oid (const char *text)
 {
+	if (*text == '.')
+		text++;
+	if (!isdigit (*text) || !strchr (text, '.'))
+		return 0;
+	return text[strspn (text, "0123456789.")] == '\0';
+}
+
+struct snmp_match*
+snmp_engine_match_compile (const char *text, char *errbuf, size_t errlen)
+{
+	struct snmp_match *match;
+	long long num;
+	unsigned long long unum;
 	char *end;
+	int i, r;
 
-	ASSERT (value);
 	ASSERT (text);
 
+	match = calloc (1, sizeof (struct snmp_match));
+	if (!match) {
+		snprintf (errbuf, errlen, "out of memory");
+		return NULL;
+	}
+
+	match->type = MATCH_EXACT;
+	for (i = 0; i < sizeof (MATCH_TYPES) / sizeof (MATCH_TYPES[0]); ++i) {
+		if (strncmp (text, MATCH_TYPES[i].prefix, strlen (MATCH_TYPES[i].prefix)) == 0) {
+			match->type = MATCH_TYPES[i].type;
+			text += strlen (MATCH_TYPES[i].prefix);
+			break;
+		}
+	}
+
+	match->text = strdup (text);
+	if (!match->text) {
+		free (match);
+		snprintf (errbuf, errlen, "out of memory");
+		return NULL;
+	}
+	match->len = strlen (text);
+
+	/* Symbolic names may need the MIBs, so only when asked for */
+	if (match->type == MATCH_OID) {
+		if (mib_parse (text, &match->oid) < 0) {
+			snprintf (errbuf, errlen, "invalid OID");
+			free (match->text);
+			free (match);
+			return NULL;
+		}
+		match->has_oid = 1;
+		return match;
+	}
+
+	/* Patterns only ever match against strings */
+	if (match->type == MATCH_REGEX) {
+		r = regcomp (&match->regex, text, REG_EXTENDED | REG_NOSUB);
+		if (r != 0) {
+			regerror (r, &match->regex, errbuf, errlen);
+			free (match->text);
+			free (match);
+			return NULL;
+		}
+		return match;
+	}
+
+	if (match->type != MATCH_EXACT)
+		return match;
+
+	/* Parse the text once for each of the other syntaxes */
+	if (*text) {
+		errno = 0;
+		num = strtoll (text, &end, 0);
+		if (*end == '\0' && errno == 0 && num >= INT32_MIN && num <= INT32_MAX) {
+			match->has_integer = 1;
+			match->integer = num;
+		}
+
+		/* strtoull happily negates, which is not what we want */
+		errno = 0;
+		unum = strtoull (text, &end, 0);
+		if (*end == '\0' && errno == 0 && !strchr (text, '-')) {
+			match->has_uint64 = 1;
+			match->uint64 = unum;
+			if (unum <= 0xffffffff) {
+				match->has_uint32 = 1;
+				match->uint32 = unum;
+			}
+		}
+
+		if (inet_aton (text, &match->ipaddress))
+			match->has_ipaddress = 1;
+
+		if (numeric_oid (text) && mib_parse (text, &match->oid) >= 0)
+			match->has_oid = 1;
+	}
+
+	return match;
+}
+
+void
+snmp_engine_match_free (struct snmp_match *match)
+{
+	if (!match)
+		return;
+	if (match->type == MATCH_REGEX)
+		regfree (&match->regex);
+	free (match->text);
+	free (match);
+}
+
+static int
+match_string (const struct snmp_match *match, const u_char *octets, size_t len)
+{
+	char buf[256];
+	char *str;
+	int ret;
+
+	switch (match->type) {
+	case MATCH_EXACT:
+		return len == match->len && memcmp (octets, match->text, len) == 0;
+	case MATCH_PREFIX:
+		return len >= match->len && memcmp (octets, match->text, match->len) == 0;
+	case MATCH_OID:
+		return 0;
+	default:
+		break;
+	}
+
+	/* Patterns need a null terminated string, strings with nulls never match */
+	if (memchr (octets, 0, len))
+		return 0;
+	if (len < sizeof (buf)) {
+		str = buf;
+	} else {
+		str = malloc (len + 1);
+		if (!str)
+			return 0;
+	}
+	memcpy (str, octets, len);
+	str[len] = 0;
+
+	if (match->type == MATCH_GLOB)
+		ret = fnmatch (match->text, str, 0) == 0;
+	else
+		ret = regexec (&match->regex, str, 0, NULL, 0) == 0;
+
+	if (str != buf)
+		free (str);
+	return ret;
+}
+
+int
+snmp_engine_match_value (const struct snmp_value *value, const struct snmp_match *match)
+{
+	ASSERT (value);
+	ASSERT (match);
+
+	if (value->syntax == SNMP_SYNTAX_OCTETSTRING)
+		return match_string (match, value->v.octetstring.octets,
+		                     value->v.octetstring.len);
+
+	if (match->type == MATCH_OID)
+		return value->syntax == SNMP_SYNTAX_OID &&
+		       asn_compare_oid (&match->oid, &value->v.oid) == 0;
+
+	/* Everything other than strings is matched exactly */
+	if (match->type != MATCH_EXACT)
+		return 0;
+
 	switch (value->syntax) {
 
 	/* Empty string */
@@ -1261,62 +1635,42 @@ snmp_engine_match (const struct snmp_value *value, const char *text)
 	case SNMP_SYNTAX_NOSUCHOBJECT:
 	case SNMP_SYNTAX_NOSUCHINSTANCE:
 	case SNMP_SYNTAX_ENDOFMIBVIEW:
-		return *text == '\0';
+		return match->len == 0;
 
-	/* Integer value */
 	case SNMP_SYNTAX_INTEGER:
-		{
-			int num = strtoll (text, &end, 0);
-			if (*end != '\0')
-				return 0;
-			return num == value->v.integer;
-		}
-
-	/* String of bytes */
-	case SNMP_SYNTAX_OCTETSTRING:
-		{
-			int len = strlen (text);
-			if (value->v.octetstring.len != len)
-				return 0;
-			return memcmp (value->v.octetstring.octets, text, len) == 0;
-		}
-
+		return match->has_integer && match->integer == value->v.integer;
 
 	case SNMP_SYNTAX_OID:
-		{
-			struct asn_oid oid;
-			if (mib_parse (text, &oid) < 0)
-				return 0;
-			return asn_compare_oid (&oid, &value->v.oid) == 0;
-		}
+		return match->has_oid && asn_compare_oid (&match->oid, &value->v.oid) == 0;
 
 	case SNMP_SYNTAX_IPADDRESS:
-		{
-		    struct in_addr addr;
-		    if (!inet_aton (text, &addr))
-			    return 0;
-		    return memcmp (&addr, value->v.ipaddress, 4) == 0;
-		}
+		return match->has_ipaddress &&
+		       memcmp (&match->ipaddress, value->v.ipaddress, 4) == 0;
 
 	case SNMP_SYNTAX_COUNTER:
 	case SNMP_SYNTAX_GAUGE:
 	case SNMP_SYNTAX_TIMETICKS:
-		{
-			uint64_t sub = strtoull (text, &end, 0);
-			if (*end != '\0' || sub > 0xffffffff)
-				return 0;
-			return sub == value->v.uint32;
-		}
+		return match->has_uint32 && match->uint32 == value->v.uint32;
 
 	case SNMP_SYNTAX_COUNTER64:
-		{
-			uint64_t sub = strtoull (text, &end, 0);
-			if (*end != '\0' || sub > 0xffffffff)
-				return 0;
-			return sub == value->v.counter64;
-		}
+		return match->has_uint64 && match->uint64 == value->v.counter64;
 
 	default:
 		return 0;
 	};
 }
+
+int
+snmp_engine_match (const struct snmp_value *value, const char *text)
+{
+	struct snmp_match *match;
+	char errbuf[128];
+	int ret;
+
+	match = snmp_engine_match_compile (text, errbuf, sizeof (errbuf));
+	if (!match)
+		return 0;
+	ret = snmp_engine_match_value (value, match);
+	snmp_engine_match_free (match);
+	return ret;
+}
@@ -6,12 +6,25 @@
 
 typedef void (*snmp_response) (int request, int code, struct snmp_value *value, void *data);
 
+typedef void (*snmp_bulk_response) (int request, int code, struct snmp_value *values,
+                                    int n_values, void *data);
+
 void snmp_engine_init (const char **bind_addresses, int retries);
 
 int  snmp_engine_request (const char* host, const char *port, const char* community,
                           int version, uint64_t interval, uint64_t timeout, int reqtype,
                           struct asn_oid *oid, snmp_response func, void *data);
 
+int  snmp_engine_bulk (const char* host, const char *port, const char* community,
+                       int version, uint64_t interval, uint64_t timeout,
+                       struct asn_oid *oid, int repetitions,
+                       snmp_bulk_response func, void *data);
+
+int  snmp_engine_next (const char* host, const char *port, const char* community,
+                       int version, uint64_t interval, uint64_t timeout,
+                       int n_oids, struct asn_oid *oids, snmp_response *funcs,
+                       void **data, int *requests);
+
 void snmp_engine_cancel (int reqid);
 
 void snmp_engine_flush (void);
@@ -22,6 +35,14 @@ int  snmp_engine_sync (const char* host, const char *port, const char* community
 
 void snmp_engine_stop (void);
 
+struct snmp_match;
+
+struct snmp_match* snmp_engine_match_compile (const char *text, char *errbuf, size_t errlen);
+
+int  snmp_engine_match_value (const struct snmp_value *value, const struct snmp_match *match);
+
+void snmp_engine_match_free (struct snmp_match *match);
+
 int  snmp_engine_match (const struct snmp_value *value, const char *text);
 
 #endif /*SNMPENGINE_H_*/
@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2008, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+
+
+#include "usuals.h"
+
+#include "log.h"
+#include "rrdbotd.h"
+
+/*
+ * Pollers with a step collect the values polled during each step, and
+ * write out one value per field for the whole step, rather than every
+ * value polled. Steps line up with the clock, like RRD steps do, and a
+ * step is written when the first value of the next one comes in.
+ */
+
+static double value_double(const rb_value* v, int vtype)
+{
+    return (vtype == VALUE_FLOAT) ? v->f_value : (double)v->i_value;
+}
+
+static int value_less(const rb_value* a, int atype, const rb_value* b, int btype)
+{
+    if(atype == VALUE_REAL && btype == VALUE_REAL)
+        return a->i_value < b->i_value;
+    return value_double(a, atype) < value_double(b, btype);
+}
+
+static void aggregate_add(rb_item* item)
+{
+    if(item->vtype == VALUE_UNSET)
+        return;
+
+    if(!item->agg.count ||
+       value_less(&item->v, item->vtype, &item->agg.min, item->agg.min_type))
+    {
+        item->agg.min = item->v;
+        item->agg.min_type = item->vtype;
+    }
+
+    if(!item->agg.count ||
+       value_less(&item->agg.max, item->agg.max_type, &item->v, item->vtype))
+    {
+        item->agg.max = item->v;
+        item->agg.max_type = item->vtype;
+    }
+
+    /* The first value of all is where rates start from */
+    if(item->agg.base_type == VALUE_UNSET && !item->agg.count)
+    {
+        item->agg.base = item->v;
+        item->agg.base_type = item->vtype;
+        item->agg.base_at = item->last_polled;
+    }
+
+    item->agg.sum += value_double(&item->v, item->vtype);
+    item->agg.last = item->v;
+    item->agg.last_type = item->vtype;
+    item->agg.last_at = item->last_polled;
+    item->agg.count++;
+}
+
+/* Change per second since the last value of the step before */
+static void aggregate_rate(rb_item* item)
+{
+    double delta;
+
+    item->vtype = VALUE_UNSET;
+
+    if(item->agg.base_type == VALUE_UNSET || item->agg.last_at <= item->agg.base_at)
+        return;
+
+    if(item->agg.base_type == VALUE_REAL && item->agg.last_type == VALUE_REAL)
+    {
+        delta = (double)(item->agg.last.i_value - item->agg.base.i_value);
+
+        /* Counters wrap around, at 32 bits or 64 bits */
+        if(delta < 0 && item->agg.base.i_value <= 0xFFFFFFFFLL)
+            delta += 4294967296.0;
+        else if(delta < 0)
+            delta += 18446744073709551616.0;
+    }
+    else
+    {
+        delta = value_double(&item->agg.last, item->agg.last_type) -
+                value_double(&item->agg.base, item->agg.base_type);
+    }
+
+    if(delta < 0)
+        return;
+
+    item->v.f_value = delta * 1000.0 / (double)(item->agg.last_at - item->agg.base_at);
+    item->vtype = VALUE_FLOAT;
+}
+
+/* Put the value for the step in the item, and start the next step */
+static void aggregate_value(rb_item* item)
+{
+    item->vtype = VALUE_UNSET;
+
+    if(item->agg.count)
+    {
+        switch(item->aggregate)
+        {
+        case AGGREGATE_MIN:
+            item->v = item->agg.min;
+            item->vtype = item->agg.min_type;
+            break;
+        case AGGREGATE_MAX:
+            item->v = item->agg.max;
+            item->vtype = item->agg.max_type;
+            break;
+        case AGGREGATE_LAST:
+            item->v = item->agg.last;
+            item->vtype = item->agg.last_type;
+            break;
+        case AGGREGATE_RATE:
+            aggregate_rate(item);
+            break;
+        default:
+            item->v.f_value = item->agg.sum / item->agg.count;
+            item->vtype = VALUE_FLOAT;
+            break;
+        }
+
+        item->agg.base = item->agg.last;
+        item->agg.base_type = item->agg.last_type;
+        item->agg.base_at = item->agg.last_at;
+    }
+
+    item->agg.count = 0;
+    item->agg.sum = 0;
+}
+
+/* A value just polled, kept while the step before it is written */
+typedef struct _aggregate_sample
+{
+    rb_value v;
+    int vtype;
+    mstime last_polled;
+}
+aggregate_sample;
+
+static void aggregate_write(rb_poller* poll, mstime when)
+{
+    aggregate_sample* samples;
+    mstime last_polled;
+    rb_item* item;
+    int i;
+
+    samples = (aggregate_sample*)xcalloc(sizeof(aggregate_sample) * poll->n_items);
+
+    for(item = poll->items, i = 0; item; item = item->next, ++i)
+    {
+        samples[i].v = item->v;
+        samples[i].vtype = item->vtype;
+        samples[i].last_polled = item->last_polled;
+
+        aggregate_value(item);
+        item->last_polled = when;
+    }
+
+    last_polled = poll->last_polled;
+    poll->last_polled = when;
+
+    rb_rrd_update(poll, NULL);
+
+    poll->last_polled = last_polled;
+    for(item = poll->items, i = 0; item; item = item->next, ++i)
+    {
+        item->v = samples[i].v;
+        item->vtype = samples[i].vtype;
+        item->last_polled = samples[i].last_polled;
+    }
+
+    free(samples);
+}
+
+void rb_aggregate_update(rb_poller* poll)
+{
+    mstime start;
+    rb_item* item;
+
+    ASSERT(poll->step);
+    ASSERT(!poll->walks);
+
+    start = poll->last_polled - (poll->last_polled % poll->step);
+
+    /* Write out the step that just finished, as of its end */
+    if(poll->step_start && start != poll->step_start)
+        aggregate_write(poll, start);
+    poll->step_start = start;
+
+    for(item = poll->items; item; item = item->next)
+        aggregate_add(item);
+}
+
+/* Write out the step so far, as of the last cycle in it */
+void rb_aggregate_flush(rb_poller* poll)
+{
+    rb_item* item;
+
+    if(!poll->step_start)
+        return;
+
+    for(item = poll->items; item; item = item->next)
+    {
+        if(item->agg.count)
+            break;
+    }
+
+    if(item)
+        aggregate_write(poll, poll->last_polled);
+    poll->step_start = 0;
+}
@@ -42,6 +42,7 @@
 #include <syslog.h>
 #include <dirent.h>
 #include <string.h>
+#include <stdarg.h>
 #include <err.h>
 
 #include <mib/mib-parser.h>
@@ -49,11 +50,13 @@
 #include "log.h"
 #include "rrdbotd.h"
 #include "config-parser.h"
+#include "server-mainloop.h"
+#include "snmp-engine.h"
 
 /*
  * These routines parse the configuration files and setup the in memory
  * data structures. They're mostly run before becoming a daemon, and just
- * exit on error.
+ * exit on error. On a reload errors stop the reload instead.
  */
 
 typedef struct _config_ctx
@@ -61,9 +64,14 @@ typedef struct _config_ctx
     const char* confname;
     file_path* rrdlist;
     file_path* rawlist;
-    uint interval;
-    uint timeout;
+    file_path* streamlist;
+    mstime interval;                    /* In milliseconds */
+    mstime timeout;
+    mstime step;
     rb_item* items;
+    uint32_t signature;                 /* Hash of the values so far */
+    int reload;                         /* Errors don't exit */
+    int failed;                         /* An error stopped the reload */
 }
 config_ctx;
 
@@ -74,9 +82,12 @@ config_ctx;
 #define CONFIG_GENERAL "general"
 #define CONFIG_RRD "rrd"
 #define CONFIG_RAW "raw"
+#define CONFIG_STREAM "stream"
 #define CONFIG_POLL "poll"
 #define CONFIG_INTERVAL "interval"
 #define CONFIG_TIMEOUT "timeout"
+#define CONFIG_STEP "step"
+#define CONFIG_AGGREGATE "aggregate"
 #define CONFIG_SOURCE "source"
 #define CONFIG_REFERENCE "reference"
 
@@ -84,18 +95,184 @@ config_ctx;
 #define CONFIG_SNMP2 "snmp2"
 #define CONFIG_SNMP2C "snmp2c"
 
+/* Prefix of raw paths for the binary format */
+#define RAW_BINARY "binary:"
+
+/* Prefix of raw paths that only get changed values, as changes[=secs]: */
+#define RAW_CHANGES "changes"
+#define DEFAULT_HEARTBEAT 3600
+
+/* Placeholders in the paths of table fields */
+#define ROW_INDEX "{index}"
+#define ROW_VALUE "{value}"
+
 #define FIELD_VALID "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-0123456789."
 
+/* FNV-1a, for the signature of a config file */
+#define SIGNATURE_BASIS 2166136261U
+#define SIGNATURE_PRIME 16777619U
+
+/* Pollers removed by a reload are freed this long after they're done */
+#define RETIRE_DELAY 1000
+
 /* -----------------------------------------------------------------------------
  * CONFIG LOADING
  */
 
+/*
+ * Exits, unless reloading, when this returns -1 for the callers to pass
+ * back to cfg_value() to stop the reload.
+ */
+static int
+config_error(config_ctx* ctx, const char* msg, ...)
+{
+    char buf[1024];
+    va_list ap;
+
+    va_start(ap, msg);
+    vsnprintf(buf, sizeof(buf), msg, ap);
+    va_end(ap);
+
+    if(!ctx->reload)
+        errx(2, "%s", buf);
+
+    log_warnx("not reloading config: %s", buf);
+    ctx->failed = 1;
+    return -1;
+}
+
+static int
+same_table(rb_item* one, rb_item* two)
+{
+    int i;
+
+    if(asn_compare_oid(&one->query_oid, &two->query_oid) != 0 ||
+       one->version != two->version ||
+       strcmp(one->community, two->community) != 0 ||
+       strcmp(one->portnum, two->portnum) != 0 ||
+       one->n_hostnames != two->n_hostnames)
+        return 0;
+
+    for(i = 0; i < one->n_hostnames; ++i)
+    {
+        if(strcmp(one->hostnames[i], two->hostnames[i]) != 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+static int
+check_row_path(file_path* path, config_ctx* ctx)
+{
+    for(; path; path = path->next)
+    {
+        if(!strstr(path->path, ROW_INDEX) && !strstr(path->path, ROW_VALUE))
+            return config_error(ctx, "%s: path for table fields must contain " ROW_INDEX " or " ROW_VALUE ": %s",
+                                ctx->confname, path->path);
+    }
+
+    return 0;
+}
+
+/*
+ * A config with wildcard fields walks a whole table, and writes
+ * a separate rrd for each row. All fields must come from the same
+ * table on the same agent. Returns -1 on errors.
+ */
+static int
+config_table(config_ctx* ctx)
+{
+    rb_item* it;
+    int wildcards = 0;
+
+    for(it = ctx->items; it; it = it->next)
+    {
+        if(it->wildcard)
+            wildcards++;
+    }
+
+    if(!wildcards)
+        return 0;
+
+    for(it = ctx->items; it; it = it->next)
+    {
+        if(!it->wildcard)
+            return config_error(ctx, "%s: all fields must query the table with a wildcard: %s",
+                                ctx->confname, it->field);
+        if(!same_table(it, ctx->items))
+            return config_error(ctx, "%s: all fields must query the same table on the same agent: %s",
+                                ctx->confname, it->field);
+    }
+
+    if(check_row_path(ctx->rrdlist, ctx) == -1 ||
+       check_row_path(ctx->rawlist, ctx) == -1)
+        return -1;
+    return 1;
+}
+
+/* The config file name without .conf, with dots rather than slashes */
+static char*
+config_name(const char* confname)
+{
+    char* name;
+    char* t;
+    size_t len;
+
+    name = strdup(confname);
+    if(!name)
+        errx(1, "out of memory");
+
+    len = strlen(name);
+    if(len > 5 && strcmp(name + len - 5, ".conf") == 0)
+        name[len - 5] = 0;
+
+    for(t = name; *t; ++t)
+    {
+        if(*t == '/')
+            *t = '.';
+    }
+
+    return name;
+}
+
+static uint32_t
+config_signature(uint32_t hash, const char* value)
+{
+    /* Including the terminator, so that values don't run together */
+    do
+    {
+        hash ^= (unsigned char)*value;
+        hash *= SIGNATURE_PRIME;
+    }
+    while(*(value++));
+
+    return hash;
+}
+
 static void
-config_done(config_ctx* ctx)
+free_paths(file_path* path)
+{
+    file_path* next;
+
+    for(; path; path = next)
+    {
+        next = path->next;
+        free(path);
+    }
+}
+
+/*
+ * Returns 1 as the poller takes over the memory of the file, in which
+ * all the strings are, or it's freed. Returns -1 on errors.
+ */
+static int
+config_done(config_ctx* ctx, char* memory)
 {
     char key[MAXPATHLEN];
     rb_item* it;
     rb_poller* poll;
+    int table;
     char *t;
 
     /* No polling specified */
@@ -103,10 +280,18 @@ config_done(config_ctx* ctx)
     {
         /* Make sure we found an interval */
         if(ctx->interval == 0)
-            errx(2, "%s: no interval specified", ctx->confname);
+            return config_error(ctx, "%s: no interval specified", ctx->confname);
 
+        /*
+         * The default timeout would be too many cycles in flight for
+         * a short interval, so then it's as long as we can keep.
+         */
         if(ctx->timeout == 0)
-            ctx->timeout = g_state.timeout;
+        {
+            ctx->timeout = (mstime)g_state.timeout * 1000;
+            if(ctx->timeout > ctx->interval * MAX_CYCLES)
+                ctx->timeout = ctx->interval * MAX_CYCLES;
+        }
 
         /* And a nice key for lookups 
          * The key uses the configuration file name if 1 or more rrd files
@@ -117,74 +302,123 @@ config_done(config_ctx* ctx)
          * These changes mean that configuration files using the same 
          * rrd files are no longer merged into a single poll.
          */
+        table = config_table(ctx);
+        if(table == -1)
+            return -1;
+
         if(ctx->rrdlist)
-            snprintf(key, sizeof(key), "%d-%d:%s", ctx->timeout, ctx->interval,
-                     ctx->confname);
+            snprintf(key, sizeof(key), "%" PRIu64 "-%" PRIu64 ":%s", ctx->timeout,
+                     ctx->interval, ctx->confname);
         else
-            snprintf(key, sizeof(key), "%d-%d:%s/%s.rrd", ctx->timeout,
-                     ctx->interval, g_state.rrddir, ctx->confname);
+            snprintf(key, sizeof(key), "%" PRIu64 "-%" PRIu64 ":%s/%s%s.rrd", ctx->timeout,
+                     ctx->interval, g_state.rrddir, ctx->confname,
+                     table ? "-" ROW_INDEX : "");
         key[sizeof(key) - 1] = 0;
 
-        /* See if we have one of these pollers already */
-        poll = (rb_poller*)hsh_get(g_state.poll_by_key, key, -1);
-        if(!poll)
-        {
-            poll = (rb_poller*)xcalloc(sizeof(*poll));
+        if(ctx->step && table)
+            return config_error(ctx, "%s: table fields can't be aggregated over a " CONFIG_STEP, ctx->confname);
+        if(ctx->step && ctx->step < ctx->interval)
+            return config_error(ctx, "%s: " CONFIG_STEP " is shorter than the " CONFIG_INTERVAL, ctx->confname);
 
-            strcpy(poll->key, key);
+        /* The key has the file name in it, so only table rrds can clash */
+        if(hsh_get(g_state.poll_by_key, key, -1))
+            return config_error(ctx, "%s: table fields can't share an rrd with other fields", ctx->confname);
 
-            if(!ctx->rrdlist)
-            {
-                /* Use default location */
-                /* Point path into the key */
-                t = strchr(poll->key, ':');
-                ASSERT(t);
-                ctx->rrdlist = (file_path*)xcalloc(sizeof(*ctx->rrdlist));
-                /* Skip the ':' */
-                ctx->rrdlist->path = t + 1;
-                ctx->rrdlist->next = NULL;
-            }
+        poll = (rb_poller*)xcalloc(sizeof(*poll));
 
-            poll->rawlist = ctx->rawlist;
-            poll->rrdlist = ctx->rrdlist;
+        strcpy(poll->key, key);
 
-            poll->interval = ctx->interval * 1000;
-            poll->timeout = ctx->timeout * 1000;
+        if(!ctx->rrdlist)
+        {
+            /* Use default location */
+            /* Point path into the key */
+            t = strchr(poll->key, ':');
+            ASSERT(t);
+            ctx->rrdlist = (file_path*)xcalloc(sizeof(*ctx->rrdlist));
+            /* Skip the ':' */
+            ctx->rrdlist->path = t + 1;
+            ctx->rrdlist->next = NULL;
+        }
 
-            /* Add it to the main lists */
-            poll->next = g_state.polls;
-            g_state.polls = poll;
+        poll->rawlist = ctx->rawlist;
+        poll->rrdlist = ctx->rrdlist;
+        poll->streamlist = ctx->streamlist;
+        poll->name = config_name(ctx->confname);
 
-            /* And into the hashtable */
-            if(!hsh_set(g_state.poll_by_key, poll->key, -1, poll))
-                errx(1, "out of memory");
+        poll->interval = ctx->interval;
+        poll->timeout = ctx->timeout;
+        poll->step = ctx->step;
+
+        /*
+         * When the timeout is longer than the interval, then polling
+         * cycles overlap, and we keep enough of them in flight.
+         */
+        poll->n_cycles = 1 + (poll->timeout - 1) / poll->interval;
+        if(poll->n_cycles > MAX_CYCLES)
+        {
+            log_warnx("%s: timeout is too long for the interval, limiting to %d cycles",
+                      ctx->confname, MAX_CYCLES);
+            poll->n_cycles = MAX_CYCLES;
         }
 
+        /* Add it to the main lists */
+        poll->next = g_state.polls;
+        g_state.polls = poll;
+
+        /* And into the hashtable */
+        if(!hsh_set(g_state.poll_by_key, poll->key, -1, poll))
+            errx(1, "out of memory");
+
         /* Get the last item and add to the list */
-        for(it = ctx->items; it->next; it = it->next)
+        for(it = ctx->items; ; it = it->next)
+        {
             it->poller = poll;
+            it->fetches = (rb_fetch*)xcalloc(sizeof(rb_fetch) * poll->n_cycles);
+            poll->n_items++;
+            if(!it->next)
+                break;
+        }
 
         ASSERT(it);
-        it->poller = poll;
 
         /* Add the items to this poller */
-        it->next = poll->items;
         poll->items = ctx->items;
+
+        /* Table pollers walk the table in each cycle */
+        if(table)
+            poll->walks = (rb_walk*)xcalloc(sizeof(rb_walk) * poll->n_cycles);
+
+        /* A reload compares this to see if the config changed */
+        poll->signature = config_signature(ctx->signature, ctx->confname);
+
+        /*
+         * This remains allocated for the life of the poller as
+         * all the configuration strings are in this memory.
+         * This allows all the users of these strings not to worry
+         * about reallocating or freeing them
+         */
+        poll->memory = memory;
     }
 
-    /*
-     * This remains allocated for the life of the program as
-     * All the configuration strings are in this memory.
-     * This allows all the users of these strings not to worry
-     * about reallocating or freeing them
-     */
+    /* Nothing refers to the paths or strings without a poller */
+    else
+    {
+        free_paths(ctx->rrdlist);
+        free_paths(ctx->rawlist);
+        free_paths(ctx->streamlist);
+        free(memory);
+    }
 
     /* Clear current config and get ready for next */
     ctx->items = NULL;
     ctx->rrdlist = NULL;
     ctx->rawlist = NULL;
+    ctx->streamlist = NULL;
     ctx->interval = 0;
     ctx->timeout = 0;
+    ctx->step = 0;
+
+    return 1;
 }
 
 static void
@@ -223,19 +457,20 @@ parse_hosts (rb_item *item, char *host, config_ctx *ctx)
 	item->hostindex = 0;
 }
 
-static void
+static int
 parse_query (rb_item *item, char *query, config_ctx *ctx)
 {
 	char *name, *value;
+	char errbuf[128];
 	const char *msg;
 
 	/* Parse the query if it exists */
 	if (!query)
-		return;
+		return 0;
 
 	msg = cfg_parse_query (query, &name, &value, &query);
 	if (msg)
-		errx (2, "%s: %s", ctx->confname, msg);
+		return config_error (ctx, "%s: %s", ctx->confname, msg);
 
 	if (query && *query)
 		log_warnx ("%s: only using first query argument in snmp URI", ctx->confname);
@@ -243,45 +478,55 @@ parse_query (rb_item *item, char *query, config_ctx *ctx)
 	/* And parse the query OID */
 	if (mib_parse (name, &(item->query_oid)) == -1) {
 		log_warnx ("%s: ignorning invalid MIB: %s", ctx->confname, name);
-		return;
+		return 0;
 	}
 	if (item->query_oid.len >= ASN_MAXOIDLEN) {
 		log_warnx ("%s: ignoring OID that is too long: %s", ctx->confname, name);
-		return;
+		return 0;
 	}
 
 	log_debug ("parsed MIB into oid: %s -> %s", name,
 	           asn_oid2str (&item->query_oid));
 
+	/* A wildcard queries every row in the table */
+	if (value && strcmp (value, "*") == 0) {
+		item->wildcard = 1;
+
+	/* Compile the match value, no value matches anything */
+	} else if (value) {
+		item->query_matcher = snmp_engine_match_compile (value, errbuf, sizeof (errbuf));
+		if (!item->query_matcher)
+			return config_error (ctx, "%s: invalid query match: %s: %s", ctx->confname, value, errbuf);
+	}
+
 	item->has_query = 1;
 	item->query_match = value;
 	memset (&item->query_last, 0, sizeof (item->query_last));
-	item->query_matched = 0;
 	item->query_searched = 0;
+	return 0;
 }
 
-static rb_item*
+static int
 parse_item (const char *field, char *uri, config_ctx *ctx)
 {
 	rb_item *item;
 	enum snmp_version version;
 	const char *msg;
-	char *copy;
+	char copy[MAXPATHLEN];
 	char *scheme, *host, *user, *path, *query, *port;
 
 	/* Parse the SNMP URI */
-	copy = strdup (uri);
+	strlcpy (copy, uri, sizeof (copy));
 	msg = cfg_parse_uri (uri, &scheme, &host, &port, &user, &path, &query);
 	if (msg)
-		errx(2, "%s: %s: %s", ctx->confname, msg, copy);
-	free (copy);
+		return config_error (ctx, "%s: %s: %s", ctx->confname, msg, copy);
 
 	ASSERT (host && path);
 
 	/* Currently we only support SNMP pollers */
 	msg = cfg_parse_scheme (scheme, &version);
 	if (msg)
-		errx (2, "%s: %s: %s", ctx->confname, msg, scheme);
+		return config_error (ctx, "%s: %s: %s", ctx->confname, msg, scheme);
 
 	/* Make a new item */
 	item = (rb_item*)xcalloc (sizeof (*item));
@@ -290,13 +535,13 @@ parse_item (const char *field, char *uri, config_ctx *ctx)
 	if (mib_parse (path, &(item->field_oid)) == -1) {
 		log_warnx ("%s: ignorning invalid MIB: %s", ctx->confname, path);
 		free (item);
-		return NULL;
+		return 0;
 	}
 
 	if (item->field_oid.len >= ASN_MAXOIDLEN) {
 		log_warnx ("%s: ignoring OID that is too long: %s", ctx->confname, path);
 		free (item);
-		return NULL;
+		return 0;
 	}
 
 	/* Setup the basics */
@@ -306,20 +551,22 @@ parse_item (const char *field, char *uri, config_ctx *ctx)
 
 	item->poller = NULL; /* Set later in config_done */
 	item->vtype = VALUE_UNSET;
+	item->latest = -1;
 	item->portnum = port ? port : "161";
 
+	/* Add it to the list, which is freed if the query is no good */
+	item->next = ctx->items;
+	ctx->items = item;
+
 	/* Parse the hosts, query */
 	parse_hosts (item, host, ctx);
-	parse_query (item, query, ctx);
+	if (parse_query (item, query, ctx) == -1)
+		return -1;
 
 	log_debug ("parsed MIB into oid: %s -> %s", path,
 	           asn_oid2str (&item->field_oid));
 
-	/* And add it to the list */
-	item->next = ctx->items;
-	ctx->items = item;
-
-	return item;
+	return 0;
 }
 
 static rb_item*
@@ -338,10 +585,104 @@ parse_item_reference (const char *field, char *reference, config_ctx *ctx)
     return NULL;
 }
 
-static void
+/* The prefixes of a raw path, in any order, returning the path itself or NULL */
+static const char*
+config_raw_prefixes(char* value, file_path* p, config_ctx* ctx)
+{
+    char* t;
+    int secs;
+
+    for(;;)
+    {
+        if(strncmp(value, RAW_BINARY, strlen(RAW_BINARY)) == 0)
+        {
+            p->binary = 1;
+            value += strlen(RAW_BINARY);
+        }
+        else if(strncmp(value, RAW_CHANGES ":", strlen(RAW_CHANGES) + 1) == 0)
+        {
+            p->heartbeat = (mstime)DEFAULT_HEARTBEAT * 1000;
+            value += strlen(RAW_CHANGES) + 1;
+        }
+        else if(strncmp(value, RAW_CHANGES "=", strlen(RAW_CHANGES) + 1) == 0)
+        {
+            secs = strtol(value + strlen(RAW_CHANGES) + 1, &t, 10);
+            if(*t != ':' || secs <= 0)
+            {
+                config_error(ctx, "%s: invalid raw prefix (must be " RAW_CHANGES "[=seconds]:): %s",
+                             ctx->confname, value);
+                return NULL;
+            }
+            p->heartbeat = (mstime)secs * 1000;
+            value = t + 1;
+        }
+        else
+        {
+            return value;
+        }
+    }
+}
+
+static int
+parse_item_aggregate(const char* field, const char* value, config_ctx* ctx)
+{
+    rb_item* item;
+
+    for(item = ctx->items; item; item = item->next)
+    {
+        if(strcmp(field, item->field) == 0)
+            break;
+    }
+
+    if(!item)
+    {
+        log_warnx("%s: field %s not found", ctx->confname, field);
+        return 0;
+    }
+
+    /* Table walks are never aggregated, see config_done() */
+    if(item->wildcard)
+        return config_error(ctx, "%s: table fields can't be aggregated: %s", ctx->confname, field);
+
+    if(strcasecmp(value, "avg") == 0 || strcasecmp(value, "average") == 0)
+        item->aggregate = AGGREGATE_AVG;
+    else if(strcasecmp(value, "min") == 0)
+        item->aggregate = AGGREGATE_MIN;
+    else if(strcasecmp(value, "max") == 0)
+        item->aggregate = AGGREGATE_MAX;
+    else if(strcasecmp(value, "last") == 0)
+        item->aggregate = AGGREGATE_LAST;
+    else if(strcasecmp(value, "rate") == 0)
+        item->aggregate = AGGREGATE_RATE;
+    else
+        return config_error(ctx, "%s: %s." CONFIG_AGGREGATE " must be avg, min, max, last or rate: %s",
+                            ctx->confname, field, value);
+    return 0;
+}
+
+/* A time in seconds, or with an 'ms' suffix in milliseconds, or zero if invalid */
+static mstime
+config_time(const char* value)
+{
+    char* t;
+    long i;
+
+    i = strtol(value, &t, 10);
+    if(i < 1 || t == value)
+        return 0;
+
+    if(strcmp(t, "ms") == 0)
+        return (mstime)i;
+    if(strcmp(t, "s") == 0 || !*t)
+        return (mstime)i * 1000;
+    return 0;
+}
+
+static int
 config_value(const char* header, const char* name, char* value,
              config_ctx* ctx)
 {
+    const char* msg;
     char* suffix;
 
     if(strcmp(header, CONFIG_GENERAL) == 0)
@@ -358,57 +699,75 @@ config_value(const char* header, const char* name, char* value,
         if(strcmp(name, CONFIG_RAW) == 0)
         {
             file_path *p = (file_path*)xcalloc(sizeof(*p));
-            p->path = value;
             /* Add the new path to the raw list */
             p->next = ctx->rawlist;
             ctx->rawlist = p;
+            p->path = config_raw_prefixes(value, p, ctx);
+            if(!p->path)
+                return -1;
+        }
+
+        if(strcmp(name, CONFIG_STREAM) == 0)
+        {
+            file_path *p;
+
+            msg = rb_stream_invalid(value);
+            if(msg)
+                return config_error(ctx, "%s: %s: %s", ctx->confname, msg, value);
+
+            p = (file_path*)xcalloc(sizeof(*p));
+            p->path = value;
+            p->next = ctx->streamlist;
+            ctx->streamlist = p;
         }
 
         /* Ignore other [general] options */
-        return;
+        return 0;
     }
 
     if(strcmp(header, CONFIG_POLL) != 0)
-        return;
+        return 0;
 
     if(strcmp(name, CONFIG_INTERVAL) == 0)
     {
-        char* t;
-        int i;
-
         if(ctx->interval > 0)
-            errx(2, "%s: " CONFIG_INTERVAL " specified twice: %s", ctx->confname, value);
+            return config_error(ctx, "%s: " CONFIG_INTERVAL " specified twice: %s", ctx->confname, value);
 
-        i = strtol(value, &t, 10);
-        if(i < 1 || *t)
-            errx(2, "%s: " CONFIG_INTERVAL " must be a number (seconds) greater than zero: %s",
+        ctx->interval = config_time(value);
+        if(!ctx->interval)
+            return config_error(ctx, "%s: " CONFIG_INTERVAL " must be a number (seconds, or milliseconds with 'ms') greater than zero: %s",
                 ctx->confname, value);
-
-        ctx->interval = (uint32_t)i;
-        return;
+        return 0;
     }
 
     if(strcmp(name, CONFIG_TIMEOUT) == 0)
     {
-        char* t;
-        int i;
-
         if(ctx->timeout > 0)
-            errx(2, "%s: " CONFIG_TIMEOUT " specified twice: %s", ctx->confname, value);
+            return config_error(ctx, "%s: " CONFIG_TIMEOUT " specified twice: %s", ctx->confname, value);
 
-        i = strtol(value, &t, 10);
-        if(i < 1 || *t)
-            errx(2, "%s: " CONFIG_TIMEOUT " must be a a number (seconds) greater than zero: %s",
+        ctx->timeout = config_time(value);
+        if(!ctx->timeout)
+            return config_error(ctx, "%s: " CONFIG_TIMEOUT " must be a number (seconds, or milliseconds with 'ms') greater than zero: %s",
                 ctx->confname, value);
+        return 0;
+    }
 
-        ctx->timeout = (uint32_t)i;
-        return;
+    if(strcmp(name, CONFIG_STEP) == 0)
+    {
+        if(ctx->step > 0)
+            return config_error(ctx, "%s: " CONFIG_STEP " specified twice: %s", ctx->confname, value);
+
+        ctx->step = config_time(value);
+        if(!ctx->step)
+            return config_error(ctx, "%s: " CONFIG_STEP " must be a number (seconds, or milliseconds with 'ms') greater than zero: %s",
+                ctx->confname, value);
+        return 0;
     }
 
     /* Parse out suffix */
     suffix = strchr(name, '.');
     if(!suffix) /* Ignore unknown options */
-        return;
+        return 0;
 
     *suffix = 0;
     suffix++;
@@ -421,11 +780,11 @@ config_value(const char* header, const char* name, char* value,
         /* Check the name */
         t = name + strspn(name, FIELD_VALID);
         if(*t)
-            errx(2, "%s: the '%s' field name must only contain characters, digits, underscore and dash",
-                 ctx->confname, name);
+            return config_error(ctx, "%s: the '%s' field name must only contain characters, digits, underscore and dash",
+                                ctx->confname, name);
 
         /* Parse out the field */
-        parse_item(name, value, ctx);
+        return parse_item(name, value, ctx);
     }
 
     /* If it starts with "field.reference" */
@@ -434,23 +793,403 @@ config_value(const char* header, const char* name, char* value,
         /* Parse out the field */
         parse_item_reference(name, value, ctx);
     }
+
+    /* If it starts with "field.aggregate" */
+    if(strcmp(suffix, CONFIG_AGGREGATE) == 0)
+        return parse_item_aggregate(name, value, ctx);
+
+    return 0;
 }
 
-void
-rb_config_parse()
+/* -----------------------------------------------------------------------------
+ * SHARED SOURCES
+ */
+
+static int
+share_key(rb_item* item, char* key, size_t len)
+{
+    char oid[ASN_OIDSTRLEN];
+    int i;
+
+    /* Table walks are never shared */
+    if(item->wildcard)
+        return 0;
+
+    /*
+     * Items can only share a fetch when everything about the request
+     * is identical, including the timeout and the order of the alternate
+     * hosts. Retries are global, so they're always the same.
+     */
+    snprintf(key, len, "%" PRIu64 "-%" PRIu64 ":%d:%s:%s:%s", item->poller->interval,
+             item->poller->timeout, item->version, item->community, item->portnum,
+             asn_oid2str_r(&item->field_oid, oid));
+
+    for(i = 0; i < item->n_hostnames; ++i)
+    {
+        strlcat(key, i == 0 ? "@" : ",", len);
+        strlcat(key, item->hostnames[i], len);
+    }
+
+    if(item->has_query)
+    {
+        strlcat(key, "?", len);
+        strlcat(key, asn_oid2str_r(&item->query_oid, oid), len);
+        if(item->query_match)
+        {
+            strlcat(key, "=", len);
+            strlcat(key, item->query_match, len);
+        }
+    }
+
+    /* Too long to be a reliable key, just don't share */
+    return strlen(key) < len - 1;
+}
+
+static rb_poller*
+group_leader(rb_poller* poll)
+{
+    return poll->group ? poll->group : poll;
+}
+
+static void
+group_pollers(rb_poller* one, rb_poller* two)
+{
+    rb_poller* p;
+
+    one = group_leader(one);
+    two = group_leader(two);
+
+    if(one == two)
+        return;
+
+    ASSERT(one->interval == two->interval);
+
+    /* Move the second group onto the end of the first */
+    for(p = one; p->group_next; p = p->group_next)
+        ;
+    p->group_next = two;
+
+    for(p = two; p; p = p->group_next)
+        p->group = one;
+}
+
+static void
+config_share_items()
+{
+    char key[MAXPATHLEN * 2];
+    hsh_index_t* hi;
+    hsh_t* by_key;
+    rb_poller* poll;
+    rb_item* item;
+    rb_item* source;
+    const void* k;
+    char* copy;
+
+    by_key = hsh_create();
+    if(!by_key)
+        errx(1, "out of memory");
+
+    for(poll = g_state.polls; poll; poll = poll->next)
+    {
+        for(item = poll->items; item; item = item->next)
+        {
+            if(!share_key(item, key, sizeof(key)))
+                continue;
+
+            source = (rb_item*)hsh_get(by_key, key, -1);
+            if(!source)
+            {
+                copy = strdup(key);
+                if(!copy || !hsh_set(by_key, copy, -1, item))
+                    errx(1, "out of memory");
+                continue;
+            }
+
+            log_debug("field '%s' shares its source with field '%s'",
+                      item->field, source->field);
+
+            item->shared = source;
+            item->next_subscriber = source->subscribers;
+            source->subscribers = item;
+
+            group_pollers(source->poller, poll);
+        }
+    }
+
+    /* The keys were allocated above */
+    for(hi = hsh_first(by_key); hi; hi = hsh_next(hi))
+    {
+        hsh_this(hi, &k, NULL);
+        free((void*)k);
+    }
+
+    hsh_free(by_key);
+}
+
+static void free_items(rb_item* item);
+
+/* Loads the config into new pollers. On a reload problems are logged */
+static int
+config_load(int reload)
 {
     config_ctx ctx;
 
     /* Setup the hash tables properly */
+    g_state.polls = NULL;
     g_state.poll_by_key = hsh_create();
+    if(!g_state.poll_by_key)
+        errx(1, "out of memory");
 
     memset(&ctx, 0, sizeof(ctx));
+    ctx.reload = reload;
 
     if(cfg_parse_dir(g_state.confdir, &ctx) == -1)
-        exit(2); /* message already printed */
+    {
+        if(!reload)
+            exit(2); /* message already printed */
+
+        /* What was left of the file the error was in */
+        free_items(ctx.items);
+        free_paths(ctx.rrdlist);
+        free_paths(ctx.rawlist);
+        free_paths(ctx.streamlist);
+        return -1;
+    }
 
     if(!g_state.polls)
-        errx(1, "no config files found in config directory: %s", g_state.confdir);
+    {
+        if(!reload)
+            errx(1, "no config files found in config directory: %s", g_state.confdir);
+        log_warnx("not reloading config: no config files found in config directory: %s",
+                  g_state.confdir);
+        return -1;
+    }
+
+    config_share_items();
+    return 0;
+}
+
+void
+rb_config_parse()
+{
+    rb_poller* poll;
+
+    config_load(0);
+
+    for(poll = g_state.polls; poll; poll = poll->next)
+        rb_rrd_prepare(poll);
+}
+
+/* -----------------------------------------------------------------------------
+ * RELOADING
+ */
+
+/*
+ * A reload parses the config into new pollers, and those which are
+ * the same as before are swapped for the old ones, with their timers
+ * and state. Only pollers whose config changed are stopped and started
+ * again. When there's a problem with the config, the new pollers are
+ * thrown away, and the old ones carry on.
+ */
+
+/* Pollers removed by a reload, freed once their timers are done */
+typedef struct _retired_pollers
+{
+    rb_poller* polls;
+    struct _retired_pollers* next;
+}
+retired_pollers;
+
+static retired_pollers* retired = NULL;
+
+static void free_pollers(rb_poller* poll);
+
+/* The poller from before a reload, if its config is the same */
+static rb_poller*
+reload_match(rb_poller* poll, hsh_t* old_by_key)
+{
+    rb_poller* old;
+
+    old = (rb_poller*)hsh_get(old_by_key, poll->key, -1);
+    if(old && old->signature == poll->signature)
+        return old;
+    return NULL;
+}
+
+/* Whether the group of this leader is the same as a group before */
+static int
+reload_same_group(rb_poller* leader, hsh_t* old_by_key)
+{
+    rb_poller* old;
+    rb_poller* p;
+    rb_poller* m;
+    int count = 0;
+
+    old = reload_match(leader, old_by_key);
+    if(!old)
+        return 0;
+
+    for(p = leader; p; p = p->group_next)
+    {
+        m = reload_match(p, old_by_key);
+        if(!m || group_leader(m) != group_leader(old))
+            return 0;
+        count++;
+    }
+
+    for(p = group_leader(old); p; p = p->group_next)
+        count--;
+
+    return count == 0;
+}
+
+static int
+retired_timer(mstime when, void* arg)
+{
+    retired_pollers* rp = (retired_pollers*)arg;
+    retired_pollers** at;
+
+    for(at = &retired; *at; at = &(*at)->next)
+    {
+        if(*at == rp)
+        {
+            *at = rp->next;
+            break;
+        }
+    }
+
+    free_pollers(rp->polls);
+    free(rp);
+    return 0;
+}
+
+void
+rb_config_reload()
+{
+    rb_poller* old_polls = g_state.polls;
+    hsh_t* old_by_key = g_state.poll_by_key;
+    retired_pollers* rp;
+    rb_poller* polls = NULL;
+    rb_poller* poll;
+    rb_poller* next;
+    rb_poller* old;
+    rb_poller* p;
+    hsh_t* by_key;
+    hsh_t* keep;
+    mstime delay = 0;
+    int kept = 0, added = 0, removed = 0;
+    int r;
+
+    log_info("reloading config");
+
+    r = config_load(1);
+
+    /* As an optimization we unload the MIB processing data here */
+    mib_uninit();
+
+    /* The old pollers carry on */
+    if(r < 0)
+    {
+        free_pollers(g_state.polls);
+        hsh_free(g_state.poll_by_key);
+        g_state.polls = old_polls;
+        g_state.poll_by_key = old_by_key;
+        return;
+    }
+
+    by_key = hsh_create();
+    keep = hsh_create();
+    if(!by_key || !keep)
+        errx(1, "out of memory");
+
+    /* Whole groups are kept, as their items share values */
+    for(poll = g_state.polls; poll; poll = poll->next)
+    {
+        if(poll->group || !reload_same_group(poll, old_by_key))
+            continue;
+
+        for(p = poll; p; p = p->group_next)
+        {
+            old = reload_match(p, old_by_key);
+            if(!hsh_set(keep, old->key, -1, old))
+                errx(1, "out of memory");
+        }
+    }
+
+    /* The rest of the old pollers stop, and are freed later */
+    rp = (retired_pollers*)xcalloc(sizeof(retired_pollers));
+    for(poll = old_polls; poll; poll = next)
+    {
+        next = poll->next;
+        if(hsh_get(keep, poll->key, -1) == poll)
+            continue;
+
+        if(!poll->group)
+            rb_poll_engine_stop(poll);
+
+        /* After the timers and any hedged requests are done */
+        if(poll->interval + poll->timeout > delay)
+            delay = poll->interval + poll->timeout;
+
+        poll->next = rp->polls;
+        rp->polls = poll;
+        removed++;
+    }
+
+    /* The new list, with the old pollers that are kept */
+    for(poll = g_state.polls; poll; poll = next)
+    {
+        next = poll->next;
+        old = reload_match(poll, old_by_key);
+
+        /* The same as before, the new copy isn't needed */
+        if(old && hsh_get(keep, old->key, -1) == old)
+        {
+            poll->next = NULL;
+            free_pollers(poll);
+            poll = old;
+            kept++;
+        }
+        else
+        {
+            rb_rrd_prepare(poll);
+            if(rb_poll_engine_start(poll) == -1)
+                log_error("couldn't setup timer");
+            added++;
+        }
+
+        poll->next = polls;
+        polls = poll;
+
+        if(!hsh_set(by_key, poll->key, -1, poll))
+            errx(1, "out of memory");
+    }
+
+    if(rp->polls)
+    {
+        rp->next = retired;
+        retired = rp;
+        if(server_oneshot(delay + RETIRE_DELAY, retired_timer, rp) == -1)
+            log_error("couldn't setup timer");
+    }
+    else
+    {
+        free(rp);
+    }
+
+    hsh_free(keep);
+    hsh_free(old_by_key);
+    hsh_free(g_state.poll_by_key);
+    g_state.polls = polls;
+    g_state.poll_by_key = by_key;
+
+    /* The other users of the pollers catch up */
+    rb_stream_init();
+    rb_latest_reload();
+    rb_history_reload();
+
+    log_info("reloaded config: %d pollers unchanged, %d added, %d removed",
+             kept, added, removed);
 }
 
 /* -----------------------------------------------------------------------------
@@ -466,16 +1205,25 @@ cfg_value(const char* filename, const char* header, const char* name,
     ASSERT(filename);
     ASSERT(ctx);
 
+    int ret;
+
     /* A little setup where necessary */
     if(!ctx->confname)
+    {
         ctx->confname = filename;
+        ctx->signature = SIGNATURE_BASIS;
+    }
+
+    /* Nothing more once a reload has failed */
+    if(ctx->failed)
+        return -1;
 
-    /* Called like this after each file */
+    /* Called like this after each file, with the file's memory */
     if(!header)
     {
-        config_done(ctx);
+        ret = config_done(ctx, value);
         ctx->confname = NULL;
-        return 0;
+        return ret;
     }
 
     ASSERT(ctx->confname);
@@ -483,7 +1231,17 @@ cfg_value(const char* filename, const char* header, const char* name,
 
     log_debug("config: %s: [%s] %s = %s", ctx->confname, header, name, value);
 
-    config_value(header, name, value, ctx);
+    /* Before the name is split up below */
+    ctx->signature = config_signature(ctx->signature, header);
+    ctx->signature = config_signature(ctx->signature, name);
+    ctx->signature = config_signature(ctx->signature, value);
+
+    /* Problems with the config stop a reload */
+    if(config_value(header, name, value, ctx) == -1)
+    {
+        ctx->confname = NULL;
+        return -1;
+    }
 
     return 0;
 }
@@ -491,9 +1249,15 @@ cfg_value(const char* filename, const char* header, const char* name,
 int
 cfg_error(const char* filename, const char* errmsg, void* data)
 {
-    /* Just exit on errors */
-    errx(2, "%s", errmsg);
-    return 0;
+    config_ctx* ctx = (config_ctx*)data;
+
+    /* Just exit on errors, or stop a reload */
+    if(!ctx->reload)
+        errx(2, "%s", errmsg);
+
+    log_warnx("not reloading config: %s", errmsg);
+    ctx->failed = 1;
+    return -1;
 }
 
 /* -----------------------------------------------------------------------------
@@ -507,6 +1271,8 @@ free_items(rb_item* item)
     for(; item; item = next)
     {
         next = item->next;
+        snmp_engine_match_free(item->query_matcher);
+        free(item->fetches);
         free(item);
     }
 }
@@ -516,6 +1282,8 @@ free_pollers(rb_poller* poll)
 {
     rb_poller* next;
     file_path* fp;
+    int i;
+
     for(; poll; poll = next)
     {
         free_items(poll->items);
@@ -523,18 +1291,33 @@ free_pollers(rb_poller* poll)
         next = poll->next;
 
         /* Free the associated file paths */
-        while(poll->rrdlist) {
-            fp = poll->rrdlist->next;
-            free(poll->rrdlist);
-            poll->rrdlist = fp;
-        }
+        free_paths(poll->rrdlist);
 
         while(poll->rawlist) {
             fp = poll->rawlist->next;
+            rb_rrd_forget(poll->rawlist);
             free(poll->rawlist);
             poll->rawlist = fp;
         }
 
+        free_paths(poll->streamlist);
+
+        if(poll->walks)
+        {
+            for(i = 0; i < poll->n_cycles; ++i)
+            {
+                free(poll->walks[i].rows);
+                free(poll->walks[i].values);
+                free(poll->walks[i].vtypes);
+                free(poll->walks[i].requests);
+            }
+            free(poll->walks);
+        }
+
+        free(poll->template);
+        free(poll->values);
+        free(poll->name);
+        free(poll->memory);
         free(poll);
     }
 
@@ -543,8 +1326,18 @@ free_pollers(rb_poller* poll)
 void
 rb_config_free()
 {
+    retired_pollers* rp;
+
     hsh_free(g_state.poll_by_key);
 
     /* Note that rb_item's are owned by pollers */
     free_pollers(g_state.polls);
+
+    while(retired)
+    {
+        rp = retired;
+        retired = rp->next;
+        free_pollers(rp->polls);
+        free(rp);
+    }
 }
@@ -0,0 +1,644 @@
+/*
+ * Copyright (c) 2008, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+
+
+#include "usuals.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "rrdbotd.h"
+#include "server-mainloop.h"
+
+/*
+ * Keeps the last few samples of each field in memory, and answers
+ * queries for them on a unix socket, so that recent graphs don't need
+ * to read the RRD files. As with the latest values, fields of table
+ * walks aren't kept.
+ *
+ * Each field has a ring of samples, and all the rings are in one
+ * block. The protocol is a line at a time:
+ *
+ *   FETCH config field [start [end]]
+ *   LIST
+ *
+ * Answered by "OK count" and that many lines, or "ERROR message".
+ * Samples are sent as time and value, separated by a tab.
+ */
+
+#define MAX_LINE            1024
+
+/* More clients than this are turned away */
+#define MAX_CLIENTS         64
+
+typedef struct _history_sample
+{
+    mstime when;
+    rb_value v;
+}
+history_sample;
+
+typedef struct _history_ring
+{
+    const char* name;               /* Poller name, config memory */
+    const char* field;
+    int head;                       /* Where the next sample goes */
+    int count;
+}
+history_ring;
+
+typedef struct _history_client
+{
+    int fd;
+    int eof;                        /* Client is done sending */
+    int skip;                       /* Skipping the rest of a long line */
+    int closing;
+
+    char in[MAX_LINE];
+    size_t in_len;
+
+    char* out;
+    size_t out_start;
+    size_t out_len;
+    size_t out_alloc;
+
+    struct _history_client* next;
+}
+history_client;
+
+static history_ring* rings = NULL;
+static int n_rings = 0;
+static int n_samples = 0;
+
+/* n_samples for each ring, one after the other */
+static history_sample* samples = NULL;
+static unsigned char* vtypes = NULL;
+
+static const char* socket_path = NULL;
+static int listen_fd = -1;
+static history_client* clients = NULL;
+static int n_clients = 0;
+
+/* -----------------------------------------------------------------------------
+ * SAMPLES
+ */
+
+static int compare_ring(const history_ring* one, const char* name, const char* field)
+{
+    int r = strcmp(one->name, name);
+    return r ? r : strcmp(one->field, field);
+}
+
+static int compare_rings(const void* a, const void* b)
+{
+    const history_ring* two = (const history_ring*)b;
+    return compare_ring((const history_ring*)a, two->name, two->field);
+}
+
+static history_ring* find_ring(const char* name, const char* field)
+{
+    int lo = 0;
+    int hi = n_rings - 1;
+    int mid, r;
+
+    while(lo <= hi)
+    {
+        mid = (lo + hi) / 2;
+        r = compare_ring(&rings[mid], name, field);
+        if(r == 0)
+            return &rings[mid];
+        if(r < 0)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return NULL;
+}
+
+void rb_history_update(rb_poller* poll)
+{
+    history_ring* ring;
+    history_sample* sample;
+    rb_item* item;
+    int at;
+
+    if(!rings || poll->walks)
+        return;
+
+    for(item = poll->items; item; item = item->next)
+    {
+        if(item->history < 0)
+            continue;
+
+        ring = &rings[item->history];
+        at = item->history * n_samples + ring->head;
+
+        sample = &samples[at];
+        sample->when = item->last_polled;
+        sample->v = item->v;
+        vtypes[at] = item->vtype;
+
+        ring->head = (ring->head + 1) % n_samples;
+        if(ring->count < n_samples)
+            ring->count++;
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ * CLIENTS
+ */
+
+static void client_add(history_client* client, const char* data, size_t len)
+{
+    if(client->out_len + len > client->out_alloc)
+    {
+        client->out_alloc = MAX(client->out_alloc * 2, client->out_len + len);
+        client->out = (char*)xrealloc(client->out, client->out_alloc);
+    }
+
+    memcpy(client->out + client->out_len, data, len);
+    client->out_len += len;
+}
+
+static void client_printf(history_client* client, const char* fmt, ...)
+{
+    char buf[MAX_LINE];
+    va_list va;
+    int len;
+
+    va_start(va, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, va);
+    va_end(va);
+
+    if(len >= (int)sizeof(buf))
+        len = sizeof(buf) - 1;
+    if(len > 0)
+        client_add(client, buf, len);
+}
+
+static void client_fetch(history_client* client, char* args)
+{
+    history_ring* ring;
+    history_sample* sample;
+    const char* name;
+    const char* field;
+    char* t;
+    mstime start = 0;
+    mstime end = (mstime)-1;
+    int first, i, at;
+    int count = 0;
+    int vtype;
+
+    name = strsep(&args, " ");
+    field = args ? strsep(&args, " ") : NULL;
+    if(!name || !*name || !field || !*field)
+    {
+        client_printf(client, "ERROR usage: FETCH config field [start [end]]\n");
+        return;
+    }
+
+    /* Times are in seconds since the epoch */
+    if(args && *args)
+    {
+        start = (mstime)strtoull(args, &t, 10) * 1000;
+        if(*t == ' ')
+            end = (mstime)strtoull(t + 1, &t, 10) * 1000 + 999;
+        if(*t)
+        {
+            client_printf(client, "ERROR invalid time: %s\n", args);
+            return;
+        }
+    }
+
+    ring = find_ring(name, field);
+    if(!ring)
+    {
+        client_printf(client, "ERROR no such field: %s %s\n", name, field);
+        return;
+    }
+
+    first = (ring->head - ring->count + n_samples) % n_samples;
+    at = (ring - rings) * n_samples;
+
+    for(i = 0; i < ring->count; ++i)
+    {
+        sample = &samples[at + (first + i) % n_samples];
+        if(sample->when >= start && sample->when <= end)
+            count++;
+    }
+
+    client_printf(client, "OK %d\n", count);
+
+    for(i = 0; i < ring->count; ++i)
+    {
+        sample = &samples[at + (first + i) % n_samples];
+        if(sample->when < start || sample->when > end)
+            continue;
+
+        vtype = vtypes[at + (first + i) % n_samples];
+        if(vtype == VALUE_REAL)
+            client_printf(client, "%" PRIu64 ".%03u\t%" PRId64 "\n",
+                          sample->when / 1000, (unsigned int)(sample->when % 1000),
+                          sample->v.i_value);
+        else if(vtype == VALUE_FLOAT)
+            client_printf(client, "%" PRIu64 ".%03u\t%.4lf\n",
+                          sample->when / 1000, (unsigned int)(sample->when % 1000),
+                          sample->v.f_value);
+        else
+            client_printf(client, "%" PRIu64 ".%03u\tU\n",
+                          sample->when / 1000, (unsigned int)(sample->when % 1000));
+    }
+}
+
+static void client_list(history_client* client)
+{
+    int i;
+
+    client_printf(client, "OK %d\n", n_rings);
+    for(i = 0; i < n_rings; ++i)
+        client_printf(client, "%s\t%s\n", rings[i].name, rings[i].field);
+}
+
+static void client_command(history_client* client, char* line)
+{
+    char* command;
+
+    command = strsep(&line, " ");
+    if(strcasecmp(command, "FETCH") == 0)
+        client_fetch(client, line);
+    else if(strcasecmp(command, "LIST") == 0 && !line)
+        client_list(client);
+    else
+        client_printf(client, "ERROR unknown command: %s\n", command);
+}
+
+/* Closing is left to the timer, as we may be in a callback for the fd */
+static int client_close(mstime when, void* arg)
+{
+    history_client* client = (history_client*)arg;
+    history_client** at;
+
+    for(at = &clients; *at; at = &(*at)->next)
+    {
+        if(*at == client)
+        {
+            *at = client->next;
+            break;
+        }
+    }
+
+    server_unwatch(client->fd);
+    close(client->fd);
+    free(client->out);
+    free(client);
+    n_clients--;
+    return 0;
+}
+
+static void client_done(history_client* client)
+{
+    if(client->closing)
+        return;
+
+    client->closing = 1;
+    server_rewatch(client->fd, 0);
+    if(server_oneshot(0, client_close, client) == -1)
+        log_errorx("couldn't setup history client close timer");
+}
+
+static void client_io(int fd, int type, void* arg)
+{
+    history_client* client = (history_client*)arg;
+    char* line;
+    char* t;
+    ssize_t r;
+
+    ASSERT(fd == client->fd);
+
+    if(client->closing)
+        return;
+
+    if(type == SERVER_READ)
+    {
+        r = recv(fd, client->in + client->in_len, sizeof(client->in) - client->in_len, 0);
+        if(r < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if(r <= 0)
+            client->eof = 1;
+        else
+            client->in_len += r;
+
+        line = client->in;
+        while((t = memchr(line, '\n', client->in + client->in_len - line)) != NULL)
+        {
+            *t = 0;
+            if(t > line && t[-1] == '\r')
+                t[-1] = 0;
+            if(!client->skip)
+                client_command(client, line);
+            client->skip = 0;
+            line = t + 1;
+        }
+
+        client->in_len -= line - client->in;
+        memmove(client->in, line, client->in_len);
+
+        if(client->in_len == sizeof(client->in))
+        {
+            if(!client->skip)
+                client_printf(client, "ERROR line too long\n");
+            client->skip = 1;
+            client->in_len = 0;
+        }
+
+        /* The last line without a newline */
+        if(client->eof && client->in_len && !client->skip)
+        {
+            client->in[client->in_len] = 0;
+            client_command(client, client->in);
+            client->in_len = 0;
+        }
+    }
+
+    while(client->out_start < client->out_len)
+    {
+        r = send(fd, client->out + client->out_start,
+                 client->out_len - client->out_start, 0);
+        if(r < 0)
+        {
+            if(errno == EAGAIN || errno == EINTR)
+                break;
+            client_done(client);
+            return;
+        }
+        client->out_start += r;
+    }
+
+    /* Don't read more commands until the answers are out */
+    if(client->out_start < client->out_len)
+    {
+        server_rewatch(fd, SERVER_WRITE);
+        return;
+    }
+
+    client->out_start = client->out_len = 0;
+    if(client->eof)
+        client_done(client);
+    else
+        server_rewatch(fd, SERVER_READ);
+}
+
+static void history_accept(int fd, int type, void* arg)
+{
+    history_client* client;
+    int cfd;
+
+    cfd = accept(fd, NULL, NULL);
+    if(cfd < 0)
+    {
+        if(errno != EAGAIN && errno != EINTR)
+            log_error("couldn't accept history client");
+        return;
+    }
+
+    if(n_clients >= MAX_CLIENTS)
+    {
+        log_warnx("too many history clients, turning one away");
+        close(cfd);
+        return;
+    }
+
+    fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(cfd, F_SETFD, FD_CLOEXEC);
+
+    client = (history_client*)xcalloc(sizeof(history_client));
+    client->fd = cfd;
+
+    if(server_watch(cfd, SERVER_READ, client_io, client) == -1)
+    {
+        log_error("couldn't watch history client");
+        close(cfd);
+        free(client);
+        return;
+    }
+
+    client->next = clients;
+    clients = client;
+    n_clients++;
+}
+
+/* -----------------------------------------------------------------------------
+ * SETUP
+ */
+
+static void history_listen(const char* path)
+{
+    struct sockaddr_un sun;
+
+    memset(&sun, 0, sizeof(sun));
+    if(strlen(path) >= sizeof(sun.sun_path))
+        errx(2, "history socket path is too long: %s", path);
+    sun.sun_family = AF_UNIX;
+    strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd < 0)
+        err(1, "couldn't create history socket");
+
+    /* Left over from last time */
+    unlink(path);
+
+    if(bind(listen_fd, (struct sockaddr*)&sun, sizeof(sun)) < 0)
+        err(1, "couldn't bind history socket: %s", path);
+    if(listen(listen_fd, 16) < 0)
+        err(1, "couldn't listen on history socket: %s", path);
+
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+
+    if(server_watch(listen_fd, SERVER_READ, history_accept, NULL) == -1)
+        err(1, "couldn't watch history socket");
+
+    socket_path = path;
+}
+
+static void history_build(int count)
+{
+    rb_poller* poll;
+    rb_item* item;
+    int i, j;
+
+    n_rings = 0;
+    for(poll = g_state.polls; poll; poll = poll->next)
+    {
+        if(!poll->walks)
+            n_rings += poll->n_items;
+    }
+
+    rings = (history_ring*)xcalloc(sizeof(history_ring) * (n_rings + 1));
+    n_rings = 0;
+
+    for(poll = g_state.polls; poll; poll = poll->next)
+    {
+        if(poll->walks)
+            continue;
+
+        for(item = poll->items; item; item = item->next)
+        {
+            rings[n_rings].name = poll->name;
+            rings[n_rings].field = item->field;
+            n_rings++;
+        }
+    }
+
+    /* Sorted for lookups, with fields of pollers with the same name merged */
+    qsort(rings, n_rings, sizeof(history_ring), compare_rings);
+    for(i = 0, j = 0; i < n_rings; ++i)
+    {
+        if(j == 0 || compare_rings(&rings[j - 1], &rings[i]) != 0)
+            rings[j++] = rings[i];
+    }
+    n_rings = j;
+
+    n_samples = count;
+    samples = (history_sample*)xcalloc(sizeof(history_sample) * n_rings * n_samples + 1);
+    vtypes = (unsigned char*)xcalloc(n_rings * n_samples + 1);
+
+    for(poll = g_state.polls; poll; poll = poll->next)
+    {
+        for(item = poll->items; item; item = item->next)
+        {
+            item->history = -1;
+            if(!poll->walks)
+                item->history = find_ring(poll->name, item->field) - rings;
+        }
+    }
+}
+
+void rb_history_init(const char* path, int count)
+{
+    if(!path)
+        return;
+
+    history_build(count);
+    history_listen(path);
+
+    log_debug("keeping %d samples of %d fields for history queries on: %s",
+              n_samples, n_rings, path);
+}
+
+/*
+ * After a config reload the rings are made again for the new fields.
+ * Fields that are still polled keep their samples, even when their
+ * config changed.
+ */
+void rb_history_reload()
+{
+    history_ring* old_rings = rings;
+    history_sample* old_samples = samples;
+    unsigned char* old_vtypes = vtypes;
+    int old_n_rings = n_rings;
+    history_ring* ring;
+    int i;
+
+    if(!rings)
+        return;
+
+    /* The old ring names are still valid, the old pollers aren't freed yet */
+    history_build(n_samples);
+
+    for(i = 0; i < old_n_rings; ++i)
+    {
+        ring = find_ring(old_rings[i].name, old_rings[i].field);
+        if(!ring)
+            continue;
+
+        ring->head = old_rings[i].head;
+        ring->count = old_rings[i].count;
+        memcpy(&samples[(ring - rings) * n_samples], &old_samples[i * n_samples],
+               sizeof(history_sample) * n_samples);
+        memcpy(&vtypes[(ring - rings) * n_samples], &old_vtypes[i * n_samples], n_samples);
+    }
+
+    free(old_rings);
+    free(old_samples);
+    free(old_vtypes);
+
+    log_debug("keeping %d samples of %d fields for history queries", n_samples, n_rings);
+}
+
+void rb_history_uninit()
+{
+    history_client* client;
+
+    while(clients)
+    {
+        client = clients;
+        clients = client->next;
+        server_unwatch(client->fd);
+        close(client->fd);
+        free(client->out);
+        free(client);
+    }
+    n_clients = 0;
+
+    if(listen_fd != -1)
+    {
+        server_unwatch(listen_fd);
+        close(listen_fd);
+        listen_fd = -1;
+    }
+
+    if(socket_path)
+        unlink(socket_path);
+    socket_path = NULL;
+
+    free(rings);
+    free(samples);
+    free(vtypes);
+    rings = NULL;
+    samples = NULL;
+    vtypes = NULL;
+    n_rings = 0;
+}
@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2008, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+
+
+#include "usuals.h"
+#include <err.h>
+
+#include "latest-values.h"
+#include "log.h"
+#include "rrdbotd.h"
+
+/*
+ * Publishes the last value of each field in a shared memory file, so
+ * that local tools can read them without going through the RRD files.
+ * Only plain fields are published, the rows of walked tables come and
+ * go, and don't get a fixed place in the file.
+ */
+
+static latest_writer* latest = NULL;
+static const char* latest_path = NULL;
+
+typedef struct _latest_slot
+{
+    const char* name;
+    rb_item* item;
+}
+latest_slot;
+
+static int
+compare_slot(const void* a, const void* b)
+{
+    const latest_slot* one = (const latest_slot*)a;
+    const latest_slot* two = (const latest_slot*)b;
+    int r = strcmp(one->name, two->name);
+    return r ? r : strcmp(one->item->field, two->item->field);
+}
+
+static void
+latest_item(latest_writer* lw, int index, rb_item* item)
+{
+    latest_value value;
+
+    value.when = item->last_polled;
+    if(item->vtype == VALUE_FLOAT)
+    {
+        value.type = LATEST_FLOAT;
+        value.v.f_value = item->v.f_value;
+    }
+    else if(item->vtype == VALUE_REAL)
+    {
+        value.type = LATEST_INT;
+        value.v.i_value = item->v.i_value;
+    }
+    else
+    {
+        value.type = LATEST_UNSET;
+        value.v.i_value = 0;
+    }
+
+    latest_set(lw, index, &value);
+}
+
+/*
+ * Makes and publishes a file for the current pollers, with the values
+ * they have so far. The items only refer to it once it's published.
+ */
+static latest_writer*
+latest_build(const char* path, char* errbuf, size_t errlen)
+{
+    latest_writer* lw;
+    latest_slot* slots;
+    rb_poller* poll;
+    rb_item* item;
+    int n_slots = 0;
+    int count = 0;
+    int i;
+
+    for(poll = g_state.polls; poll; poll = poll->next)
+    {
+        if(!poll->walks)
+            n_slots += poll->n_items;
+    }
+
+    slots = (latest_slot*)xcalloc(sizeof(latest_slot) * (n_slots + 1));
+    n_slots = 0;
+
+    for(poll = g_state.polls; poll; poll = poll->next)
+    {
+        if(poll->walks)
+            continue;
+
+        for(item = poll->items; item; item = item->next)
+        {
+            if(strlen(poll->name) >= LATEST_NAME || strlen(item->field) >= LATEST_FIELD)
+            {
+                log_warnx("name too long for latest values file: %s.%s",
+                          poll->name, item->field);
+                continue;
+            }
+
+            slots[n_slots].name = poll->name;
+            slots[n_slots].item = item;
+            n_slots++;
+        }
+    }
+
+    qsort(slots, n_slots, sizeof(latest_slot), compare_slot);
+
+    /* Count the entries, fields of pollers with the same name are the same */
+    for(i = 0; i < n_slots; ++i)
+    {
+        if(i == 0 || compare_slot(&slots[i - 1], &slots[i]) != 0)
+            count++;
+    }
+
+    lw = latest_create(path, count, errbuf, errlen);
+    if(!lw)
+    {
+        free(slots);
+        return NULL;
+    }
+
+    for(i = 0, count = -1; i < n_slots; ++i)
+    {
+        if(i == 0 || compare_slot(&slots[i - 1], &slots[i]) != 0)
+            latest_name(lw, ++count, slots[i].name, slots[i].item->field);
+        if(slots[i].item->poller->last_polled)
+            latest_item(lw, count, slots[i].item);
+    }
+
+    if(latest_publish(lw, errbuf, errlen) < 0)
+    {
+        latest_destroy(lw);
+        free(slots);
+        return NULL;
+    }
+
+    for(poll = g_state.polls; poll; poll = poll->next)
+    {
+        for(item = poll->items; item; item = item->next)
+            item->latest = -1;
+    }
+
+    for(i = 0, count = -1; i < n_slots; ++i)
+    {
+        if(i == 0 || compare_slot(&slots[i - 1], &slots[i]) != 0)
+            count++;
+        slots[i].item->latest = count;
+    }
+
+    free(slots);
+
+    log_debug("publishing %d latest values in: %s", count + 1, path);
+    return lw;
+}
+
+void
+rb_latest_init(const char* path)
+{
+    char errbuf[256];
+
+    if(!path)
+        return;
+
+    latest_path = path;
+    latest = latest_build(path, errbuf, sizeof(errbuf));
+    if(!latest)
+        errx(1, "%s", errbuf);
+}
+
+/*
+ * After a config reload the file is made again with the new fields,
+ * and replaces the old one. Fields that are still polled keep the
+ * values they had. If that fails the old file stays, for the fields
+ * it has.
+ */
+void
+rb_latest_reload()
+{
+    latest_writer* lw;
+    char errbuf[256];
+
+    if(!latest_path)
+        return;
+
+    lw = latest_build(latest_path, errbuf, sizeof(errbuf));
+    if(!lw)
+    {
+        log_warnx("not reloading latest values: %s", errbuf);
+        return;
+    }
+
+    latest_destroy(latest);
+    latest = lw;
+}
+
+void
+rb_latest_uninit()
+{
+    latest_destroy(latest);
+    latest = NULL;
+}
+
+void
+rb_latest_update(rb_poller* poll)
+{
+    rb_item* item;
+
+    if(!latest || poll->walks)
+        return;
+
+    for(item = poll->items; item; item = item->next)
+    {
+        if(item->latest >= 0)
+            latest_item(latest, item->latest, item);
+    }
+}
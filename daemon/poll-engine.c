@@ -53,139 +53,272 @@
 #include "snmp-engine.h"
 
 /* -----------------------------------------------------------------------------
- * PACKET HANDLING
+ * POLLING CYCLES
  */
 
 static void
-complete_requests (rb_item *item, int code)
+write_rows (rb_poller *poll, rb_walk *walk)
 {
-	int host;
-
-	ASSERT (item);
+	rb_item *item;
+	int r, i;
 
-	if (item->field_request)
-		snmp_engine_cancel (item->field_request);
-	item->field_request = 0;
-	if (item->query_request)
-		snmp_engine_cancel (item->query_request);
-	item->query_request = 0;
+	log_debug ("writing %d table rows", walk->n_rows);
 
-	/* If we have multiple host names then try the next host */
-	if (code != SNMP_ERR_NOERROR) {
-		host = (item->hostindex + 1) % item->n_hostnames;
-		if (host != item->hostindex) {
-			log_debug ("request failed, trying new host: %s", item->hostnames[host]);
-			item->hostindex = host;
+	/* Each row of the table is written separately */
+	for (r = 0; r < walk->n_rows; ++r) {
+		for (item = poll->items, i = 0; item; item = item->next, ++i) {
+			item->v = walk->values[r * poll->n_items + i];
+			item->vtype = walk->vtypes[r * poll->n_items + i];
+			item->last_polled = poll->last_polled;
 		}
+
+		rb_rrd_update (poll, &walk->rows[r]);
 	}
 }
 
 static void
-cancel_requests (rb_item *item, mstime when, const char *reason)
+write_cycle (rb_poller *poll, int cycle)
 {
-	ASSERT (item);
-	ASSERT (reason);
-	ASSERT (item->field_request || item->query_request);
+	rb_fetch *fetch;
+	rb_item *item;
+	mstime unit;
 
-	log_debug ("value for field '%s': %s", item->field, reason);
+	ASSERT (poll->cycles[cycle].polling);
+	ASSERT (!poll->cycles[cycle].outstanding);
 
 	/*
-	 * We note the failure has having taken place halfway between
-	 * the request and the current time.
+	 * Updates have to go forward in time, even when this cycle
+	 * finished before an earlier one did. Times are written in
+	 * whole seconds unless the interval isn't.
 	 */
-	item->last_polled = item->last_request + ((when - item->last_request) / 2);
-	item->vtype = VALUE_UNSET;
+	unit = (poll->interval % 1000) ? 1 : 1000;
+	if (poll->cycles[cycle].last_polled / unit <= poll->last_polled / unit)
+		poll->cycles[cycle].last_polled = (poll->last_polled / unit + 1) * unit;
 
-	complete_requests (item, -1);
+	poll->last_request = poll->cycles[cycle].last_request;
+	poll->last_polled = poll->cycles[cycle].last_polled;
+
+	if (poll->walks) {
+		write_rows (poll, &poll->walks[cycle]);
+
+	} else {
+		/* The writers use the values in the items */
+		for (item = poll->items; item; item = item->next) {
+			fetch = &item->fetches[cycle];
+			item->v = fetch->v;
+			item->vtype = fetch->vtype;
+			item->last_polled = fetch->last_polled;
+		}
+
+		/* Every value is seen here, even when aggregated for writing */
+		rb_latest_update (poll);
+		rb_history_update (poll);
+
+		/* And send off our collection of values */
+		if (poll->step)
+			rb_aggregate_update (poll);
+		else
+			rb_rrd_update (poll, NULL);
+	}
+
+	/* This polling cycle is no longer active */
+	poll->cycles[cycle].polling = 0;
 }
 
 static void
-force_poll (rb_poller *poll, mstime when, const char *reason)
+flush_cycles (rb_poller *poll)
 {
-	rb_item *item;
-	int forced = 0;
+	/* Completed cycles are written in the order they were started */
+	while (poll->cycles[poll->oldest].polling &&
+	       !poll->cycles[poll->oldest].outstanding) {
+		write_cycle (poll, poll->oldest);
+		if (poll->oldest == poll->current)
+			break;
+		poll->oldest = (poll->oldest + 1) % poll->n_cycles;
+	}
+}
 
+static void
+finish_cycle (rb_poller *poll, int cycle, mstime when)
+{
 	ASSERT (poll);
-	ASSERT (reason);
+	ASSERT (cycle >= 0 && cycle < poll->n_cycles);
 
-	/* Now see if the all the requests are done */
-	for (item = poll->items; item; item = item->next) {
-		if (item->field_request || item->query_request) {
-			cancel_requests (item, when, reason);
-			forced = 1;
+	/* See if the all the requests are done */
+	if (!poll->cycles[cycle].polling || poll->cycles[cycle].outstanding)
+		return;
+
+	/* Update the book-keeping */
+	poll->cycles[cycle].last_polled = when;
+
+	flush_cycles (poll);
+}
+
+/* -----------------------------------------------------------------------------
+ * PACKET HANDLING
+ */
+
+static void
+share_value (rb_fetch *fetch, mstime when)
+{
+	rb_item *sub;
+	rb_fetch *sf;
+	int i;
+
+	ASSERT (fetch);
+	ASSERT (!fetch->item->shared);
+
+	/* Hand our value to all the items waiting on it in this cycle */
+	for (sub = fetch->item->subscribers; sub; sub = sub->next_subscriber) {
+		for (i = 0; i < sub->poller->n_cycles; ++i) {
+			sf = &sub->fetches[i];
+			if (!sf->waiting || sf->last_request != fetch->last_request)
+				continue;
+
+			sf->waiting = 0;
+			sf->v = fetch->v;
+			sf->vtype = fetch->vtype;
+			sf->query_matched = fetch->query_matched;
+			sf->last_polled = when;
+
+			ASSERT (sub->poller->cycles[i].outstanding > 0);
+			sub->poller->cycles[i].outstanding--;
+
+			finish_cycle (sub->poller, i, when);
 		}
-		ASSERT (!item->field_request);
-		ASSERT (!item->query_request);
 	}
+}
 
-	if (!forced && !poll->polling)
-		return;
+static void
+complete_requests (rb_fetch *fetch, int code, mstime when)
+{
+	rb_item *item = fetch->item;
+	rb_poller *poll = item->poller;
+	int host;
 
-	/* Mark any non-matched queries as unset */
-	for (item = poll->items; item; item = item->next) {
-		if (item->has_query && !item->query_matched)
-			/*
-			 * We note the failure has having taken place halfway between
-			 * the request and the current time.
-			 */
-			item->last_polled = item->last_request + ((when - item->last_request) / 2);
-			item->vtype = VALUE_UNSET;
+	ASSERT (fetch);
+
+	if (fetch->field_request)
+		snmp_engine_cancel (fetch->field_request);
+	fetch->field_request = 0;
+	if (fetch->hedge_request)
+		snmp_engine_cancel (fetch->hedge_request);
+	fetch->hedge_request = 0;
+	fetch->hedge_at = 0;
+	if (fetch->query_request)
+		snmp_engine_cancel (fetch->query_request);
+	fetch->query_request = 0;
+
+	/* If we have multiple host names then try the next host */
+	if (code != SNMP_ERR_NOERROR) {
+		host = (item->hostindex + 1) % item->n_hostnames;
+		if (host != item->hostindex) {
+			log_debug ("request failed, trying new host: %s", item->hostnames[host]);
+			item->hostindex = host;
+		}
+	}
+
+	/* Any table search we were doing is over */
+	if (item->query_searcher == fetch)
+		item->query_searcher = NULL;
+
+	/* A query that never matched a table row has no value */
+	if (item->has_query && !fetch->query_matched) {
+		fetch->last_polled = when;
+		fetch->vtype = VALUE_UNSET;
 	}
 
+	/* This item is no longer outstanding in its cycle */
+	ASSERT (poll->cycles[fetch->cycle].outstanding > 0);
+	poll->cycles[fetch->cycle].outstanding--;
+
+	share_value (fetch, when);
+}
+
+static void
+cancel_requests (rb_fetch *fetch, mstime when, const char *reason)
+{
+	ASSERT (fetch);
+	ASSERT (reason);
+	ASSERT (fetch->field_request || fetch->hedge_request || fetch->query_request);
+
+	log_debug ("value for field '%s': %s", fetch->item->field, reason);
+
 	/*
 	 * We note the failure has having taken place halfway between
 	 * the request and the current time.
 	 */
-	poll->last_polled = poll->last_request + ((when - poll->last_request) / 2);
+	fetch->last_polled = fetch->last_request + ((when - fetch->last_request) / 2);
+	fetch->vtype = VALUE_UNSET;
 
-	/* And send off our collection of values */
-	rb_rrd_update (poll);
-
-	/* This polling cycle is no longer active */
-	poll->polling = 0;
+	complete_requests (fetch, -1, fetch->last_polled);
 }
 
+/* Forward declaration */
+static void walk_cancel (rb_poller *poll, int cycle);
+
 static void
-finish_poll (rb_poller *poll, mstime when)
+force_cycle (rb_poller *poll, int cycle, mstime when, const char *reason)
 {
+	rb_fetch *fetch;
 	rb_item *item;
+	mstime last_request;
 
 	ASSERT (poll);
-	ASSERT (poll->polling);
+	ASSERT (reason);
 
-	/* See if the all the requests are done */
-	for (item = poll->items; item; item = item->next) {
-		if (item->field_request || item->query_request)
-			return;
-	}
+	if (!poll->cycles[cycle].polling)
+		return;
 
-	/* Mark any non-matched queries as unset */
-	for (item = poll->items; item; item = item->next) {
-		if (item->has_query && !item->query_matched) {
-			item->last_polled = when;
-			item->vtype = VALUE_UNSET;
+	/* Cancel anything that is still outstanding */
+	if (poll->cycles[cycle].outstanding && poll->walks) {
+		log_debug ("table walk: %s", reason);
+		walk_cancel (poll, cycle);
+
+	} else if (poll->cycles[cycle].outstanding) {
+		for (item = poll->items; item; item = item->next) {
+			fetch = &item->fetches[cycle];
+			if (fetch->field_request || fetch->hedge_request || fetch->query_request) {
+				cancel_requests (fetch, when, reason);
+
+			/* Still waiting on a shared value */
+			} else if (fetch->waiting) {
+				log_debug ("value for field '%s': %s", item->field, reason);
+				fetch->last_polled = fetch->last_request + ((when - fetch->last_request) / 2);
+				fetch->vtype = VALUE_UNSET;
+				fetch->waiting = 0;
+			}
+			ASSERT (!fetch->field_request);
+			ASSERT (!fetch->hedge_request);
+			ASSERT (!fetch->query_request);
 		}
 	}
 
-	/* Update the book-keeping */
-	poll->last_polled = when;
+	if (poll->cycles[cycle].outstanding) {
 
-	/* And send off our collection of values */
-	rb_rrd_update (poll);
+		/* Also covers items whose requests couldn't be sent */
+		poll->cycles[cycle].outstanding = 0;
 
-	/* This polling cycle is no longer active */
-	poll->polling = 0;
+		/*
+		 * We note the failure has having taken place halfway between
+		 * the request and the current time.
+		 */
+		last_request = poll->cycles[cycle].last_request;
+		poll->cycles[cycle].last_polled = last_request + ((when - last_request) / 2);
+	}
+
+	flush_cycles (poll);
 }
 
 static int
-parse_string_value (struct snmp_value *value, rb_item *item)
+parse_string_value (struct snmp_value *value, rb_fetch *fetch)
 {
 	char buf[256];
 	char *t, *b;
 
 	ASSERT (value);
 	ASSERT (value->syntax == SNMP_SYNTAX_OCTETSTRING);
-	ASSERT (item);
+	ASSERT (fetch);
 
 	if(value->v.octetstring.len >= sizeof(buf))
 		return 0;
@@ -203,133 +336,253 @@ parse_string_value (struct snmp_value *value, rb_item *item)
 		return 0;
 
 	/* Try to parse the string into an integer */
-	item->v.i_value = strtoll(b, &t, 10);
+	fetch->v.i_value = strtoll(b, &t, 10);
 	if(!*t || isspace(*t)) {
-		item->vtype = VALUE_REAL;
+		fetch->vtype = VALUE_REAL;
 		return 1;
 	}
 
 	/* Try to parse the string into a floating point */
-	item->v.f_value = strtod(b, &t);
+	fetch->v.f_value = strtod(b, &t);
 	if(!*t || isspace(*t)) {
-		item->vtype = VALUE_FLOAT;
+		fetch->vtype = VALUE_FLOAT;
 		return 1;
 	}
 
 	return 0;
 }
 
+static const char*
+parse_field_value (struct snmp_value *value, rb_fetch *fetch)
+{
+	const char *msg = NULL;
+
+	fetch->vtype = VALUE_UNSET;
+
+	switch(value->syntax)
+	{
+	case SNMP_SYNTAX_NULL:
+		break;
+	case SNMP_SYNTAX_INTEGER:
+		fetch->v.i_value = value->v.integer;
+		fetch->vtype = VALUE_REAL;
+		break;
+	case SNMP_SYNTAX_COUNTER:
+	case SNMP_SYNTAX_GAUGE:
+	case SNMP_SYNTAX_TIMETICKS:
+		fetch->v.i_value = value->v.uint32;
+		fetch->vtype = VALUE_REAL;
+		break;
+	case SNMP_SYNTAX_COUNTER64:
+		fetch->v.i_value = value->v.counter64;
+		fetch->vtype = VALUE_REAL;
+		break;
+	case SNMP_SYNTAX_OCTETSTRING:
+		if (!parse_string_value(value, fetch))
+			msg = "snmp server returned non numeric value for field: %s";
+		break;
+	case SNMP_SYNTAX_OID:
+		msg = "snmp server returned a oid value for field: %s";
+		break;
+	case SNMP_SYNTAX_IPADDRESS:
+		msg = "snmp server returned a ip address value for field: %s";
+		break;
+	case SNMP_SYNTAX_NOSUCHOBJECT:
+	case SNMP_SYNTAX_NOSUCHINSTANCE:
+	case SNMP_SYNTAX_ENDOFMIBVIEW:
+		msg = "field not available on snmp server: %s";
+		break;
+	default:
+		msg = "snmp server returned invalid or unsupported value for field: %s";
+		break;
+	};
+
+	return msg;
+}
+
+/* Only hedge once a host has answered a few times */
+#define HEDGE_SAMPLES 4
+
+static void
+note_rtt (rb_item *item, int host, mstime rtt)
+{
+	mstime diff;
+
+	ASSERT (host >= 0 && host < item->n_hostnames);
+
+	/* Smoothed like TCP does for its retransmit timeout */
+	if (!item->rtts[host].samples) {
+		item->rtts[host].srtt = rtt;
+		item->rtts[host].rttvar = rtt / 2;
+	} else {
+		diff = rtt > item->rtts[host].srtt ? rtt - item->rtts[host].srtt :
+		                                     item->rtts[host].srtt - rtt;
+		item->rtts[host].rttvar = (3 * item->rtts[host].rttvar + diff) / 4;
+		item->rtts[host].srtt = (7 * item->rtts[host].srtt + rtt) / 8;
+	}
+
+	if (item->rtts[host].samples < HEDGE_SAMPLES)
+		item->rtts[host].samples++;
+}
+
+/* Forward declaration */
+static void field_response (int request, int code, struct snmp_value *value, void *arg);
+
+static int
+hedge_timer (mstime when, void *arg)
+{
+	rb_fetch *fetch = arg;
+	rb_item *item = fetch->item;
+	int host;
+
+	/* Already answered, or the timer is from an earlier cycle */
+	if (!fetch->field_request || fetch->hedge_request ||
+	    !fetch->hedge_at || when < fetch->hedge_at)
+		return 0;
+
+	fetch->hedge_at = 0;
+	fetch->hedge_sent = when;
+	host = (fetch->host + 1) % item->n_hostnames;
+
+	log_debug ("response for field '%s' is slow, also asking: %s",
+	           item->field, item->hostnames[host]);
+
+	/* Whichever host answers first is used */
+	fetch->hedge_request = snmp_engine_request (item->hostnames[host], item->portnum, item->community,
+	                                            item->version, item->poller->interval, item->poller->timeout,
+	                                            SNMP_PDU_GET, &item->field_oid, field_response, fetch);
+	return 0;
+}
+
+static void
+hedge_schedule (rb_fetch *fetch)
+{
+	rb_item *item = fetch->item;
+	mstime delay;
+
+	if (item->n_hostnames < 2 || item->rtts[fetch->host].samples < HEDGE_SAMPLES)
+		return;
+
+	/*
+	 * A response later than this is in the tail for the host, so
+	 * we send the same request to the next host as well.
+	 */
+	delay = item->rtts[fetch->host].srtt + 4 * item->rtts[fetch->host].rttvar;
+	if (delay < 1)
+		delay = 1;
+
+	/* No point when the request times out first */
+	if (delay >= item->poller->timeout)
+		return;
+
+	fetch->hedge_at = server_get_time () + delay;
+	if (server_oneshot (delay, hedge_timer, fetch) == -1) {
+		log_error ("couldn't setup hedge timer");
+		fetch->hedge_at = 0;
+	}
+}
+
 static void
 field_response (int request, int code, struct snmp_value *value, void *arg)
 {
-	rb_item *item = arg;
+	rb_fetch *fetch = arg;
+	rb_item *item = fetch->item;
 	const char *msg = NULL;
-	mstime when;
+	mstime when, sent;
+	int host;
+
+	ASSERT (request == fetch->field_request || request == fetch->hedge_request);
 
-	ASSERT (request == item->field_request);
+	/* Mark this request as done, noting which host answered and when we asked */
+	if (request == fetch->hedge_request) {
+		fetch->hedge_request = 0;
+		host = (fetch->host + 1) % item->n_hostnames;
+		sent = fetch->hedge_sent;
+	} else {
+		fetch->field_request = 0;
+		host = fetch->host;
+		sent = fetch->last_request;
+	}
+
+	/* When one of two hosts fails, the other may still answer */
+	if (code != SNMP_ERR_NOERROR && (fetch->field_request || fetch->hedge_request))
+		return;
 
 	/* Note when the response for this item arrived */
 	when = server_get_time ();
-	item->last_polled = when;
+	fetch->last_polled = when;
 
-	/* Mark this item as done */
-	item->field_request = 0;
+	if (code == SNMP_ERR_NOERROR && !item->has_query) {
+		note_rtt (item, host, when - sent);
+		if (host != fetch->host)
+			log_debug ("hedged request for field '%s' answered first by: %s",
+			           item->field, item->hostnames[host]);
+	}
 
 	/* Errors result in us writing U */
 	if (code != SNMP_ERR_NOERROR) {
-		item->vtype = VALUE_UNSET;
+		fetch->vtype = VALUE_UNSET;
 
 	/* Parse the value from server */
 	} else {
-		switch(value->syntax)
-		{
-		case SNMP_SYNTAX_NULL:
-			item->vtype = VALUE_UNSET;
-			break;
-		case SNMP_SYNTAX_INTEGER:
-			item->v.i_value = value->v.integer;
-			item->vtype = VALUE_REAL;
-			break;
-		case SNMP_SYNTAX_COUNTER:
-		case SNMP_SYNTAX_GAUGE:
-		case SNMP_SYNTAX_TIMETICKS:
-			item->v.i_value = value->v.uint32;
-			item->vtype = VALUE_REAL;
-			break;
-		case SNMP_SYNTAX_COUNTER64:
-			item->v.i_value = value->v.counter64;
-			item->vtype = VALUE_REAL;
-			break;
-		case SNMP_SYNTAX_OCTETSTRING:
-			if (!parse_string_value(value, item))
-				msg = "snmp server returned non numeric value for field: %s";
-			break;
-		case SNMP_SYNTAX_OID:
-			msg = "snmp server returned a oid value for field: %s";
-			break;
-		case SNMP_SYNTAX_IPADDRESS:
-			msg = "snmp server returned a ip address value for field: %s";
-			break;
-		case SNMP_SYNTAX_NOSUCHOBJECT:
-		case SNMP_SYNTAX_NOSUCHINSTANCE:
-		case SNMP_SYNTAX_ENDOFMIBVIEW:
-			msg = "field not available on snmp server: %s";
-			break;
-		default:
-			msg = "snmp server returned invalid or unsupported value for field: %s";
-			break;
-		};
+		msg = parse_field_value (value, fetch);
 
 		if (msg)
 			log_warnx (msg, item->field);
-		else if (item->vtype == VALUE_REAL)
+		else if (fetch->vtype == VALUE_REAL)
 			log_debug ("got value for field '%s': %lld",
-			           item->field, item->v.i_value);
-		else if (item->vtype == VALUE_FLOAT)
+			           item->field, fetch->v.i_value);
+		else if (fetch->vtype == VALUE_FLOAT)
 			log_debug ("got value for field '%s': %.4lf",
-			           item->field, item->v.f_value);
+			           item->field, fetch->v.f_value);
 		else
 			log_debug ("got value for field '%s': U",
 			           item->field);
 	}
 
-	complete_requests (item, code);
+	complete_requests (fetch, code, when);
 
-	/* If the entire poll is done, then complete it */
-	finish_poll (item->poller, when);
+	/* If the entire cycle is done, then complete it */
+	finish_cycle (item->poller, fetch->cycle, when);
 }
 
 static void
-field_request (rb_item *item)
+field_request (rb_fetch *fetch)
 {
+	rb_item *item = fetch->item;
 	int req;
 
-	ASSERT (item);
-	ASSERT (!item->field_request);
+	ASSERT (fetch);
+	ASSERT (!fetch->field_request);
 
-	item->vtype = VALUE_UNSET;
+	fetch->vtype = VALUE_UNSET;
+	fetch->host = item->hostindex;
 
 	req = snmp_engine_request (item->hostnames[item->hostindex], item->portnum, item->community,
 	                           item->version, item->poller->interval, item->poller->timeout,
-	                           SNMP_PDU_GET, &item->field_oid, field_response, item);
-	item->field_request = req;
+	                           SNMP_PDU_GET, &item->field_oid, field_response, fetch);
+	fetch->field_request = req;
+
+	if (req)
+		hedge_schedule (fetch);
 }
 
 /* Forward declaration */
-static void query_search_request (rb_item *item);
+static void query_search_request (rb_fetch *fetch);
 
 static void
-query_value_request (rb_item *item, asn_subid_t subid)
+query_value_request (rb_fetch *fetch, asn_subid_t subid)
 {
+	rb_item *item = fetch->item;
 	struct asn_oid oid;
 	int req;
 
-	ASSERT (item);
+	ASSERT (fetch);
 	ASSERT (item->has_query);
-	ASSERT (!item->query_request);
-	ASSERT (!item->field_request);
+	ASSERT (!fetch->query_request);
+	ASSERT (!fetch->field_request);
 
-	item->vtype = VALUE_UNSET;
+	fetch->vtype = VALUE_UNSET;
 
 	/* OID for the actual value */
 	oid = item->field_oid;
@@ -341,28 +594,31 @@ query_value_request (rb_item *item, asn_subid_t subid)
 
 	req = snmp_engine_request (item->hostnames[item->hostindex], item->portnum, item->community,
 	                           item->version, item->poller->interval, item->poller->timeout,
-	                           SNMP_PDU_GET, &oid, field_response, item);
+	                           SNMP_PDU_GET, &oid, field_response, fetch);
 
 	/* Value retrieval is active */
-	item->field_request = req;
+	fetch->field_request = req;
 }
 
 static void
 query_next_response (int request, int code, struct snmp_value *value, void *arg)
 {
-	rb_item *item = arg;
+	rb_fetch *fetch = arg;
+	rb_item *item = fetch->item;
 	asn_subid_t subid;
+	mstime when;
 	int matched;
 
 	/*
 	 * Called when we get the next OID in a table
 	 */
 
-	ASSERT (request == item->query_request);
-	ASSERT (!item->field_request);
+	ASSERT (request == fetch->query_request);
+	ASSERT (!fetch->field_request);
+	ASSERT (item->query_searcher == fetch);
 
 	/* Mark this item as done */
-	item->query_request = 0;
+	fetch->query_request = 0;
 
 	if (code == SNMP_ERR_NOERROR) {
 		ASSERT (value);
@@ -396,7 +652,9 @@ query_next_response (int request, int code, struct snmp_value *value, void *arg)
 	/* Problems communicating with the server, or not found */
 	if (code != SNMP_ERR_NOERROR) {
 		memset (&item->query_last, 0, sizeof (item->query_last));
-		complete_requests (item, code);
+		when = server_get_time ();
+		complete_requests (fetch, code, when);
+		finish_cycle (item->poller, fetch->cycle, when);
 		return;
 	}
 
@@ -407,39 +665,45 @@ query_next_response (int request, int code, struct snmp_value *value, void *arg)
 	ASSERT (value);
 
 	/* Match the query value received */
-	if (item->query_match)
-		matched = snmp_engine_match (value, item->query_match);
+	if (item->query_matcher)
+		matched = snmp_engine_match_value (value, item->query_matcher);
 
 	/* When query match is null, anything matches */
 	else
 		matched = 1;
 
-	item->query_matched = matched;
-	item->vtype = VALUE_UNSET;
+	fetch->query_matched = matched;
+	fetch->vtype = VALUE_UNSET;
 
 	if (matched) {
-		/* Do a query for the field value with this sub id */
+		/* The search is over, do a query for the field value with this sub id */
+		item->query_searcher = NULL;
 		subid = value->var.subs[value->var.len - 1];
-		query_value_request (item, subid);
+		query_value_request (fetch, subid);
 	} else {
 		/* Look for the next table index */
-		query_search_request (item);
+		query_search_request (fetch);
 	}
 }
 
 static void
-query_search_request (rb_item *item)
+query_search_request (rb_fetch *fetch)
 {
+	rb_item *item = fetch->item;
 	struct asn_oid *oid;
 	int req;
 
-	ASSERT (item);
+	ASSERT (fetch);
 	ASSERT (item->has_query);
-	ASSERT (!item->query_request);
-	ASSERT (!item->field_request);
+	ASSERT (!fetch->query_request);
+	ASSERT (!fetch->field_request);
+	ASSERT (!item->query_searcher || item->query_searcher == fetch);
 
-	item->query_matched = 0;
-	item->vtype = VALUE_UNSET;
+	fetch->query_matched = 0;
+	fetch->vtype = VALUE_UNSET;
+
+	/* Only one search per item at a time, as they share query_last */
+	item->query_searcher = fetch;
 
 	/* Start with the OID without any table index */
 	if (!item->query_searched) {
@@ -456,15 +720,17 @@ query_search_request (rb_item *item)
 
 	req = snmp_engine_request (item->hostnames[item->hostindex], item->portnum, item->community,
 	                           item->version, item->poller->interval, item->poller->timeout,
-	                           SNMP_PDU_GETNEXT, oid, query_next_response, item);
+	                           SNMP_PDU_GETNEXT, oid, query_next_response, fetch);
 
-	item->query_request = req;
+	fetch->query_request = req;
 }
 
 static void
 query_match_response (int request, int code, struct snmp_value *value, void *arg)
 {
-	rb_item *item = arg;
+	rb_fetch *fetch = arg;
+	rb_item *item = fetch->item;
+	mstime when;
 	int matched;
 
 	/*
@@ -474,11 +740,13 @@ query_match_response (int request, int code, struct snmp_value *value, void *arg
 	 * whenever we queried it directly (without the search).
 	 */
 
-	ASSERT (request == item->query_request);
+	ASSERT (request == fetch->query_request);
 
 	/* Problems communicating with the server? */
 	if (code != SNMP_ERR_NOERROR && code != SNMP_ERR_NOSUCHNAME) {
-		complete_requests (item, code);
+		when = server_get_time ();
+		complete_requests (fetch, code, when);
+		finish_cycle (item->poller, fetch->cycle, when);
 		return;
 	}
 
@@ -486,7 +754,7 @@ query_match_response (int request, int code, struct snmp_value *value, void *arg
 	 * Mark this item as done after the possible call to complete_requests
 	 * otherwise complete_requests won't free everything.
 	 */
-	item->query_request = 0;
+	fetch->query_request = 0;
 
 	matched = 0;
 
@@ -502,8 +770,8 @@ query_match_response (int request, int code, struct snmp_value *value, void *arg
 
 		/* See if we have a match */
 		default:
-			if (item->query_match)
-				matched = snmp_engine_match (value, item->query_match);
+			if (item->query_matcher)
+				matched = snmp_engine_match_value (value, item->query_matcher);
 
 			/* When query match is null, anything matches */
 			else
@@ -512,7 +780,7 @@ query_match_response (int request, int code, struct snmp_value *value, void *arg
 		};
 	}
 
-	item->query_matched = matched;
+	fetch->query_matched = matched;
 	if (matched)
 		return;
 
@@ -521,29 +789,39 @@ query_match_response (int request, int code, struct snmp_value *value, void *arg
 
 	/*
 	 * When it doesn't match cancel any pending value request, and
-	 * start a search for a match.
+	 * start a search for a match. If an overlapping cycle is already
+	 * searching, then this cycle has no value.
 	 */
-	if (item->field_request)
-		snmp_engine_cancel (item->field_request);
-	item->field_request = 0;
-	query_search_request (item);
+	if (item->query_searcher) {
+		when = server_get_time ();
+		complete_requests (fetch, SNMP_ERR_NOERROR, when);
+		finish_cycle (item->poller, fetch->cycle, when);
+		return;
+	}
+
+	if (fetch->field_request)
+		snmp_engine_cancel (fetch->field_request);
+	fetch->field_request = 0;
+	item->query_searched = 0;
+	query_search_request (fetch);
 }
 
 static void
-query_pair_request (rb_item *item, asn_subid_t subid)
+query_pair_request (rb_fetch *fetch, asn_subid_t subid)
 {
+	rb_item *item = fetch->item;
 	struct asn_oid oid;
 	int req;
 
-	ASSERT (item);
+	ASSERT (fetch);
 	ASSERT (item->has_query);
-	ASSERT (!item->query_request);
-	ASSERT (!item->field_request);
+	ASSERT (!fetch->query_request);
+	ASSERT (!fetch->field_request);
 
 	log_debug ("query requesting match and value pair for index: %u", subid);
 
-	item->vtype = VALUE_UNSET;
-	item->query_matched = 0;
+	fetch->vtype = VALUE_UNSET;
+	fetch->query_matched = 0;
 
 	/* OID for the value to match */
 	oid = item->query_oid;
@@ -553,10 +831,10 @@ query_pair_request (rb_item *item, asn_subid_t subid)
 
 	req = snmp_engine_request (item->hostnames[item->hostindex], item->portnum, item->community,
 	                           item->version, item->poller->interval, item->poller->timeout,
-	                           SNMP_PDU_GET, &oid, query_match_response, item);
+	                           SNMP_PDU_GET, &oid, query_match_response, fetch);
 
 	/* Query is active */
-	item->query_request = req;
+	fetch->query_request = req;
 
 	/* OID for the actual value */
 	oid = item->field_oid;
@@ -566,22 +844,31 @@ query_pair_request (rb_item *item, asn_subid_t subid)
 
 	req = snmp_engine_request (item->hostnames[item->hostindex], item->portnum, item->community,
 	                           item->version, item->poller->interval, item->poller->timeout,
-	                           SNMP_PDU_GET, &oid, field_response, item);
+	                           SNMP_PDU_GET, &oid, field_response, fetch);
 
 	/* Value retrieval is active */
-	item->field_request = req;
+	fetch->field_request = req;
 }
 
 static void
-query_request (rb_item *item)
+query_request (rb_fetch *fetch)
 {
-	ASSERT (item);
-	ASSERT (!item->query_request);
-	ASSERT (!item->field_request);
+	rb_item *item = fetch->item;
+
+	ASSERT (fetch);
+	ASSERT (!fetch->query_request);
+	ASSERT (!fetch->field_request);
+
+	fetch->query_matched = 0;
+	fetch->vtype = VALUE_UNSET;
+
+	/* An overlapping cycle is still searching the table */
+	if (item->query_searcher) {
+		log_debug ("query for field '%s' still searching table", item->field);
+		return;
+	}
 
 	item->query_searched = 0;
-	item->query_matched = 0;
-	item->vtype = VALUE_UNSET;
 
 	if (item->query_last.len) {
 
@@ -593,7 +880,7 @@ query_request (rb_item *item)
 		 * Doing this in one request is more efficient, then we check if the
 		 * match value matches the query in the response.
 		 */
-		query_pair_request (item, item->query_last.subs[item->query_last.len - 1]);
+		query_pair_request (fetch, item->query_last.subs[item->query_last.len - 1]);
 
 	} else {
 
@@ -602,38 +889,704 @@ query_request (rb_item *item)
 		 * For indexes. We'll then query each of those indexes with the two
 		 * part request, as above.
 		 */
-		query_search_request (item);
+		query_search_request (fetch);
 	}
 }
 
+/* -----------------------------------------------------------------------------
+ * TABLE WALKS
+ */
+
+/* Protects against agents that return rows forever */
+#define MAX_ROWS 65536
+
+/* Rows asked for in one GETBULK, more values than this can't be decoded */
+#define WALK_REPETITIONS SNMP_MAX_BINDINGS
+
+/* Forward declarations */
+static int walk_step (rb_poller *poll, int cycle);
+static void walk_next (rb_poller *poll, int cycle);
+
 static int
-poller_timer (mstime when, void *arg)
+table_oid (struct asn_oid *column, struct asn_oid *index, struct asn_oid *oid)
 {
-	rb_poller *poll = (rb_poller*)arg;
+	/* The column OID, followed by the table index */
+	if (column->len + index->len > ASN_MAXOIDLEN)
+		return 0;
+
+	*oid = *column;
+	memcpy (oid->subs + oid->len, index->subs, index->len * sizeof (asn_subid_t));
+	oid->len += index->len;
+	return 1;
+}
+
+static int
+table_index (struct asn_oid *column, struct snmp_value *value, struct asn_oid *index)
+{
+	switch (value->syntax) {
+	case SNMP_SYNTAX_NOSUCHOBJECT:
+	case SNMP_SYNTAX_NOSUCHINSTANCE:
+	case SNMP_SYNTAX_ENDOFMIBVIEW:
+		return 0;
+	default:
+		break;
+	};
+
+	/* Past the end of the column */
+	if (value->var.len <= column->len || !asn_is_suboid (column, &value->var))
+		return 0;
+
+	index->len = value->var.len - column->len;
+	memcpy (index->subs, value->var.subs + column->len, index->len * sizeof (asn_subid_t));
+	return 1;
+}
+
+static void
+format_row_value (struct snmp_value *value, char *buf, size_t len)
+{
+	char oid[ASN_OIDSTRLEN];
+	size_t n;
+	char *p;
+
+	buf[0] = 0;
+
+	switch (value->syntax) {
+	case SNMP_SYNTAX_OCTETSTRING:
+		n = value->v.octetstring.len;
+		if (n >= len)
+			n = len - 1;
+		memcpy (buf, value->v.octetstring.octets, n);
+		buf[n] = 0;
+		break;
+	case SNMP_SYNTAX_INTEGER:
+		snprintf (buf, len, "%d", value->v.integer);
+		break;
+	case SNMP_SYNTAX_COUNTER:
+	case SNMP_SYNTAX_GAUGE:
+	case SNMP_SYNTAX_TIMETICKS:
+		snprintf (buf, len, "%u", value->v.uint32);
+		break;
+	case SNMP_SYNTAX_COUNTER64:
+		snprintf (buf, len, "%" PRIu64, value->v.counter64);
+		break;
+	case SNMP_SYNTAX_IPADDRESS:
+		snprintf (buf, len, "%u.%u.%u.%u", value->v.ipaddress[0], value->v.ipaddress[1],
+		          value->v.ipaddress[2], value->v.ipaddress[3]);
+		break;
+	case SNMP_SYNTAX_OID:
+		strlcpy (buf, asn_oid2str_r (&value->v.oid, oid), len);
+		break;
+	default:
+		break;
+	};
+
+	/* The value becomes part of a file name */
+	for (p = buf; *p; ++p) {
+		if (!isalnum (*p) && !strchr ("-_.", *p))
+			*p = '_';
+	}
+	if (strcmp (buf, ".") == 0 || strcmp (buf, "..") == 0)
+		memset (buf, '_', strlen (buf));
+}
+
+static int
+walk_add_row (rb_poller *poll, rb_walk *walk)
+{
+	rb_row *rows;
+	rb_value *values;
+	int *vtypes;
+	int max;
+
+	if (walk->n_rows < walk->max_rows)
+		return 1;
+
+	max = walk->max_rows ? walk->max_rows * 2 : 16;
+
+	rows = realloc (walk->rows, sizeof (rb_row) * max);
+	if (rows)
+		walk->rows = rows;
+	values = realloc (walk->values, sizeof (rb_value) * max * poll->n_items);
+	if (values)
+		walk->values = values;
+	vtypes = realloc (walk->vtypes, sizeof (int) * max * poll->n_items);
+	if (vtypes)
+		walk->vtypes = vtypes;
+
+	if (!rows || !values || !vtypes) {
+		log_errorx ("out of memory");
+		return 0;
+	}
+
+	walk->max_rows = max;
+	return 1;
+}
+
+static void
+walk_cancel (rb_poller *poll, int cycle)
+{
+	rb_walk *walk = &poll->walks[cycle];
+	rb_fetch *fetch;
 	rb_item *item;
+	int i;
+
+	for (i = 0; i < walk->n_requests; ++i) {
+		if (walk->requests[i])
+			snmp_engine_cancel (walk->requests[i]);
+	}
+	walk->n_requests = 0;
+
+	for (item = poll->items; item; item = item->next) {
+		fetch = &item->fetches[cycle];
+		if (fetch->query_request)
+			snmp_engine_cancel (fetch->query_request);
+		fetch->query_request = 0;
+		if (fetch->field_request)
+			snmp_engine_cancel (fetch->field_request);
+		fetch->field_request = 0;
+	}
+
+	poll->walks[cycle].pending = 0;
+}
+
+static void
+walk_finish (rb_poller *poll, int cycle, int code, mstime when)
+{
+	rb_item *item;
+	int host;
+
+	walk_cancel (poll, cycle);
+
+	/* All the fields are on the same hosts, so fail over together */
+	if (code != SNMP_ERR_NOERROR) {
+		host = (poll->items->hostindex + 1) % poll->items->n_hostnames;
+		if (host != poll->items->hostindex) {
+			log_debug ("request failed, trying new host: %s", poll->items->hostnames[host]);
+			for (item = poll->items; item; item = item->next)
+				item->hostindex = host;
+		}
+	}
+
+	log_debug ("table walk found %d rows", poll->walks[cycle].n_rows);
+
+	ASSERT (poll->cycles[cycle].outstanding > 0);
+	poll->cycles[cycle].outstanding--;
+
+	finish_cycle (poll, cycle, when);
+}
+
+static void
+walk_step_done (rb_poller *poll, int cycle)
+{
+	rb_walk *walk = &poll->walks[cycle];
+	rb_fetch *fetch;
+	rb_item *item;
+	int row, i;
+
+	if (walk->pending)
+		return;
+
+	/* Problems communicating with the server */
+	if (walk->code != SNMP_ERR_NOERROR) {
+		walk_finish (poll, cycle, walk->code, server_get_time ());
+		return;
+	}
+
+	/* A bulk step has already added its rows */
+	if (poll->items->version != SNMP_V1) {
+		if (walk->done)
+			walk_finish (poll, cycle, SNMP_ERR_NOERROR, server_get_time ());
+		else
+			walk_next (poll, cycle);
+		return;
+	}
+
+	/* The end of the table */
+	if (!walk->found || !walk_add_row (poll, walk)) {
+		walk_finish (poll, cycle, SNMP_ERR_NOERROR, server_get_time ());
+		return;
+	}
+
+	row = walk->n_rows++;
+	walk->rows[row] = walk->next;
+
+	/* A column without this row has no value for it */
+	for (item = poll->items, i = 0; item; item = item->next, ++i) {
+		fetch = &item->fetches[cycle];
+		if (asn_compare_oid (&fetch->row, &walk->next.index) == 0) {
+			walk->values[row * poll->n_items + i] = fetch->v;
+			walk->vtypes[row * poll->n_items + i] = fetch->vtype;
+		} else {
+			walk->vtypes[row * poll->n_items + i] = VALUE_UNSET;
+		}
+	}
+
+	/* On to the next row */
+	walk->last = walk->next.index;
+	walk_next (poll, cycle);
+}
+
+static void
+walk_next (rb_poller *poll, int cycle)
+{
+	int ret;
+
+	/* Nothing left to ask for is the end of the table */
+	ret = walk_step (poll, cycle);
+	if (ret <= 0)
+		walk_finish (poll, cycle, ret < 0 ? -1 : SNMP_ERR_NOERROR, server_get_time ());
+}
+
+static void
+walk_query_response (int request, int code, struct snmp_value *value, void *arg)
+{
+	rb_fetch *fetch = arg;
+	rb_item *item = fetch->item;
+	rb_poller *poll = item->poller;
+	rb_walk *walk = &poll->walks[fetch->cycle];
+
+	ASSERT (request == fetch->query_request);
+	ASSERT (walk->pending > 0);
+
+	fetch->query_request = 0;
+	walk->pending--;
+
+	/* Version 1 agents signal the end of the MIB this way */
+	if (code == SNMP_ERR_NOSUCHNAME)
+		walk->found = 0;
+	else if (code != SNMP_ERR_NOERROR)
+		walk->code = code;
+
+	/* Rows must come in order, or the agent is walking in circles */
+	else if (table_index (&item->query_oid, value, &walk->next.index) &&
+	         (!walk->last.len || asn_compare_oid (&walk->next.index, &walk->last) > 0) &&
+	         walk->n_rows < MAX_ROWS) {
+		format_row_value (value, walk->next.value, sizeof (walk->next.value));
+		walk->found = 1;
+	}
+
+	walk_step_done (poll, fetch->cycle);
+}
+
+static void
+walk_field_response (int request, int code, struct snmp_value *value, void *arg)
+{
+	rb_fetch *fetch = arg;
+	rb_item *item = fetch->item;
+	rb_poller *poll = item->poller;
+	rb_walk *walk = &poll->walks[fetch->cycle];
+	const char *msg;
+
+	ASSERT (request == fetch->field_request);
+	ASSERT (walk->pending > 0);
+
+	fetch->field_request = 0;
+	walk->pending--;
+
+	fetch->vtype = VALUE_UNSET;
+	fetch->row.len = 0;
+
+	if (code != SNMP_ERR_NOERROR && code != SNMP_ERR_NOSUCHNAME) {
+		walk->code = code;
+
+	/* The value is matched up with the row when the step is done */
+	} else if (code == SNMP_ERR_NOERROR &&
+	           table_index (&item->field_oid, value, &fetch->row)) {
+		msg = parse_field_value (value, fetch);
+		if (msg)
+			log_warnx (msg, item->field);
+	}
+
+	walk_step_done (poll, fetch->cycle);
+}
+
+static int
+walk_find_row (rb_walk *walk, struct asn_oid *index)
+{
+	int row;
+
+	for (row = walk->first; row < walk->n_rows; ++row) {
+		if (asn_compare_oid (&walk->rows[row].index, index) == 0)
+			return row;
+	}
+
+	return -1;
+}
+
+static void
+walk_get_response (int request, int code, struct snmp_value *value, void *arg)
+{
+	rb_fetch *fetch = arg;
+	rb_item *item = fetch->item;
+	rb_poller *poll = item->poller;
+	rb_walk *walk = &poll->walks[fetch->cycle];
+	struct asn_oid index;
+	const char *msg;
+	rb_item *it;
+	int row, i;
+
+	ASSERT (walk->pending > 0);
+
+	for (i = 0; i < walk->n_requests; ++i) {
+		if (walk->requests[i] == request)
+			walk->requests[i] = 0;
+	}
+	walk->pending--;
+
+	if (code != SNMP_ERR_NOERROR) {
+		walk->code = code;
+
+	/* A row without this field has no value for it */
+	} else if (table_index (&item->field_oid, value, &index) &&
+	           (row = walk_find_row (walk, &index)) >= 0) {
+		msg = parse_field_value (value, fetch);
+		if (msg)
+			log_warnx (msg, item->field);
+
+		for (it = poll->items, i = 0; it != item; it = it->next)
+			++i;
+		walk->values[row * poll->n_items + i] = fetch->v;
+		walk->vtypes[row * poll->n_items + i] = fetch->vtype;
+	}
+
+	walk_step_done (poll, fetch->cycle);
+}
+
+static void
+walk_bulk_fields (rb_poller *poll, int cycle)
+{
+	rb_walk *walk = &poll->walks[cycle];
+	struct asn_oid oid;
+	rb_fetch *fetch;
+	rb_item *item;
+	int *requests;
+	int max, row, id;
+
+	max = (walk->n_rows - walk->first) * poll->n_items;
+	if (max > walk->max_requests) {
+		requests = realloc (walk->requests, sizeof (int) * max);
+		if (!requests) {
+			log_errorx ("out of memory");
+			walk->code = SNMP_ERR_GENERR;
+			return;
+		}
+		walk->requests = requests;
+		walk->max_requests = max;
+	}
+
+	/* These are all for the same host, and go out together */
+	for (row = walk->first; row < walk->n_rows; ++row) {
+		for (item = poll->items; item; item = item->next) {
+			fetch = &item->fetches[cycle];
+			if (!table_oid (&item->field_oid, &walk->rows[row].index, &oid))
+				continue;
+
+			id = snmp_engine_request (item->hostnames[item->hostindex], item->portnum,
+			                          item->community, item->version, poll->interval,
+			                          poll->timeout, SNMP_PDU_GET, &oid,
+			                          walk_get_response, fetch);
+			if (id) {
+				walk->requests[walk->n_requests++] = id;
+				walk->pending++;
+			}
+		}
+	}
+}
+
+static void
+walk_bulk_response (int request, int code, struct snmp_value *values, int n_values, void *arg)
+{
+	rb_fetch *fetch = arg;
+	rb_item *item = fetch->item;
+	rb_poller *poll = item->poller;
+	rb_walk *walk = &poll->walks[fetch->cycle];
+	int row, i, j;
+
+	ASSERT (request == fetch->query_request);
+	ASSERT (walk->pending > 0);
+
+	fetch->query_request = 0;
+	walk->pending--;
+
+	/* Ask for fewer rows when they don't fit in a response */
+	if (code == SNMP_ERR_TOOBIG && walk->repetitions > 1) {
+		walk->repetitions /= 2;
+		walk_next (poll, fetch->cycle);
+		return;
+	}
+
+	if (code != SNMP_ERR_NOERROR) {
+		walk->code = code;
+		walk_step_done (poll, fetch->cycle);
+		return;
+	}
+
+	walk->first = walk->n_rows;
+	walk->done = (n_values == 0);
+
+	for (j = 0; j < n_values; ++j) {
+
+		/* Rows must come in order, or the agent is walking in circles */
+		if (!table_index (&item->query_oid, &values[j], &walk->next.index) ||
+		    (walk->last.len && asn_compare_oid (&walk->next.index, &walk->last) <= 0) ||
+		    walk->n_rows >= MAX_ROWS || !walk_add_row (poll, walk)) {
+			walk->done = 1;
+			break;
+		}
+
+		format_row_value (&values[j], walk->next.value, sizeof (walk->next.value));
+		row = walk->n_rows++;
+		walk->rows[row] = walk->next;
+		for (i = 0; i < poll->n_items; ++i)
+			walk->vtypes[row * poll->n_items + i] = VALUE_UNSET;
+		walk->last = walk->next.index;
+	}
+
+	/* Then the fields for each of those rows */
+	walk_bulk_fields (poll, fetch->cycle);
+	walk_step_done (poll, fetch->cycle);
+}
+
+/*
+ * Returns 1 when requests went out, zero when there's nothing left
+ * to ask for, and -1 when the requests couldn't be sent.
+ */
+static int
+walk_step (rb_poller *poll, int cycle)
+{
+	rb_walk *walk = &poll->walks[cycle];
+	rb_item *item = poll->items;
+	rb_fetch *fetch;
+	struct asn_oid oid;
+	struct asn_oid *oids = NULL;
+	snmp_response *funcs = NULL;
+	void **args = NULL;
+	int *ids = NULL;
+	int i, n, ret;
+
+	walk->pending = 0;
+	walk->found = 0;
+	walk->done = 0;
+	walk->code = SNMP_ERR_NOERROR;
+	walk->n_requests = 0;
+
+	fetch = &item->fetches[cycle];
+	if (!table_oid (&item->query_oid, &walk->last, &oid))
+		return 0;
+
+	/* Version 2 agents send a run of rows of the query column at once */
+	if (item->version != SNMP_V1) {
+		fetch->query_request = snmp_engine_bulk (item->hostnames[item->hostindex], item->portnum,
+		                                         item->community, item->version, poll->interval,
+		                                         poll->timeout, &oid, walk->repetitions,
+		                                         walk_bulk_response, fetch);
+		if (!fetch->query_request)
+			return -1;
+		walk->pending++;
+		return 1;
+	}
 
 	/*
-	 * If the previous poll has not completed, then we count it
-	 * as a timeout.
+	 * The next row of the query column, and all the field columns. These
+	 * all go to the same host, and so go out together in one request.
 	 */
-	force_poll (poll, when, "timed out");
+	n = poll->n_items + 1;
+	oids = calloc (n, sizeof (struct asn_oid));
+	funcs = calloc (n, sizeof (snmp_response));
+	args = calloc (n, sizeof (void*));
+	ids = calloc (n, sizeof (int));
+	if (!oids || !funcs || !args || !ids) {
+		log_errorx ("out of memory");
+		ret = -1;
+		goto done;
+	}
+
+	oids[0] = oid;
+	funcs[0] = walk_query_response;
+	args[0] = fetch;
+	n = 1;
+
+	for (item = poll->items; item; item = item->next) {
+		fetch = &item->fetches[cycle];
+		fetch->vtype = VALUE_UNSET;
+		fetch->row.len = 0;
+
+		if (!table_oid (&item->field_oid, &walk->last, &oids[n]))
+			continue;
+		funcs[n] = walk_field_response;
+		args[n] = fetch;
+		++n;
+	}
+
+	item = poll->items;
+	snmp_engine_next (item->hostnames[item->hostindex], item->portnum,
+	                  item->community, item->version, poll->interval,
+	                  poll->timeout, n, oids, funcs, args, ids);
+
+	/* Nothing went out when the query didn't */
+	if (!ids[0]) {
+		ret = -1;
+		goto done;
+	}
+
+	for (i = 0; i < n; ++i) {
+		fetch = args[i];
+		if (i == 0)
+			fetch->query_request = ids[i];
+		else
+			fetch->field_request = ids[i];
+		if (ids[i])
+			walk->pending++;
+	}
+
+	ret = 1;
+
+done:
+	free (oids);
+	free (funcs);
+	free (args);
+	free (ids);
+	return ret;
+}
+
+static void
+walk_start (rb_poller *poll, int cycle, mstime when)
+{
+	rb_walk *walk = &poll->walks[cycle];
+	rb_fetch *fetch;
+	rb_item *item;
+
+	for (item = poll->items; item; item = item->next) {
+		fetch = &item->fetches[cycle];
+		memset (fetch, 0, sizeof (*fetch));
+		fetch->item = item;
+		fetch->cycle = cycle;
+		fetch->last_request = when;
+		fetch->last_polled = when;
+	}
+
+	walk->n_rows = 0;
+	walk->last.len = 0;
+	if (!walk->repetitions)
+		walk->repetitions = WALK_REPETITIONS;
+
+	log_debug ("walking table for fields in: %s", poll->key);
+
+	if (walk_step (poll, cycle) > 0)
+		poll->cycles[cycle].outstanding++;
+	else
+		walk_cancel (poll, cycle);
+}
+
+static void
+shared_request (rb_fetch *fetch)
+{
+	rb_item *source = fetch->item->shared;
+	rb_fetch *sf;
+	int i;
+
+	ASSERT (fetch);
+	ASSERT (source);
+
+	fetch->vtype = VALUE_UNSET;
+	fetch->query_matched = 0;
+
+	/* See if the source already has the value for this cycle */
+	for (i = 0; i < source->poller->n_cycles; ++i) {
+		sf = &source->fetches[i];
+		if (sf->last_request == fetch->last_request &&
+		    !sf->field_request && !sf->hedge_request && !sf->query_request) {
+			fetch->v = sf->v;
+			fetch->vtype = sf->vtype;
+			fetch->query_matched = sf->query_matched;
+			fetch->last_polled = sf->last_polled;
+			return;
+		}
+	}
+
+	/* The value arrives via share_value() */
+	fetch->waiting = 1;
+}
+
+static void
+poller_start (rb_poller *poll, mstime when)
+{
+	rb_fetch *fetch;
+	rb_item *item;
+	int cycle;
+
+	/* The next cycle, which must have been written out */
+	cycle = (poll->current + 1) % poll->n_cycles;
+	ASSERT (!poll->cycles[cycle].polling);
+
+	if (!poll->cycles[poll->oldest].polling)
+		poll->oldest = cycle;
+	poll->current = cycle;
+
+	/* Mark this cycle as starting requests now */
+	poll->cycles[cycle].polling = 1;
+	poll->cycles[cycle].outstanding = 0;
+	poll->cycles[cycle].last_request = when;
+	poll->cycles[cycle].last_polled = 0;
+
+	/* Table pollers walk the whole table instead */
+	if (poll->walks) {
+		walk_start (poll, cycle, when);
+		finish_cycle (poll, cycle, when);
+		return;
+	}
+
+	for (item = poll->items; item; item = item->next) {
+		fetch = &item->fetches[cycle];
+		memset (fetch, 0, sizeof (*fetch));
+		fetch->item = item;
+		fetch->cycle = cycle;
+		fetch->last_request = when;
+		fetch->last_polled = when;
+
+		if (item->shared)
+			shared_request (fetch);
+		else if (item->has_query)
+			query_request (fetch);
+		else
+			field_request (fetch);
+
+		/* Requests that couldn't be sent are not outstanding */
+		if (fetch->field_request || fetch->query_request || fetch->waiting)
+			poll->cycles[cycle].outstanding++;
+		else if (item->subscribers)
+			share_value (fetch, when);
+	}
+
+	/* Nothing could be sent, so we're done */
+	finish_cycle (poll, cycle, when);
+}
 
-	/* Mark this poller as starting requests now */
-	poll->last_request = when;
-	ASSERT (!poll->polling);
-	poll->polling = 1;
+static int
+poller_timer (mstime when, void *arg)
+{
+	rb_poller *poll = (rb_poller*)arg;
+	rb_poller *p;
+
+	ASSERT (!poll->group);
+
+	/* Removed by a config reload, the timer goes away */
+	if (poll->retired)
+		return 0;
+
+	/*
+	 * If the cycle we're about to reuse has not completed, then
+	 * we count it as a timeout. All pollers in a group are run
+	 * together.
+	 */
+	for (p = poll; p; p = p->group_next)
+		force_cycle (p, (p->current + 1) % p->n_cycles, when, "timed out");
 
 	/*
 	 * Send off the next query. This needs to be done after
 	 * all the timeouts above, as the above could write to RRD.
 	 */
-	for (item = poll->items; item; item = item->next) {
-		item->last_request = when;
-		if (item->has_query)
-			query_request (item);
-		else
-			field_request (item);
-	}
+	for (p = poll; p; p = p->group_next)
+		poller_start (p, when);
 
 	snmp_engine_flush ();
 
@@ -646,6 +1599,9 @@ prep_timer (mstime when, void* arg)
 	rb_poller* poll;
 
 	poll = (rb_poller*)arg;
+	if (poll->retired)
+		return 0;
+
 	if (server_timer (poll->interval, poller_timer, poll) == -1)
 		log_error ("couldn't setup poller timer");
 
@@ -656,39 +1612,97 @@ prep_timer (mstime when, void* arg)
 }
 
 
-void
-rb_poll_engine_init (void)
+int
+rb_poll_engine_start (rb_poller *poll)
 {
+	/* Grouped pollers are run from the group leader's timer */
+	if (poll->group)
+		return 0;
+
 	/*
-	 * Randomly start all timers with a small random offset of between
+	 * Randomly start the timer with a small random offset of between
 	 * 0-interval time. This spreads the polls out over a few seconds.
 	 */
-	rb_poller * poll;
-	int rand_delay;
+	return server_oneshot (rand () % poll->interval, prep_timer, poll);
+}
+
+void
+rb_poll_engine_init (void)
+{
+	rb_poller *poll;
 
 	for (poll = g_state.polls; poll != NULL; poll = poll->next) {
-		rand_delay = rand() % poll->interval;
-		if (server_oneshot(rand_delay, prep_timer, poll) == -1)
-		    err(1, "couldn't setup timer");
+		if (rb_poll_engine_start (poll) == -1)
+		    err (1, "couldn't setup timer");
+	}
+}
+
+static void
+stop_requests (rb_poller *poll, mstime when, const char *reason)
+{
+	rb_fetch *fetch;
+	rb_item *item;
+	int i;
+
+	for (i = 0; poll->walks && i < poll->n_cycles; ++i)
+		walk_cancel (poll, i);
+	for (item = poll->items; item; item = item->next) {
+		for (i = 0; i < poll->n_cycles; ++i) {
+			fetch = &item->fetches[i];
+			if (fetch->field_request || fetch->hedge_request || fetch->query_request)
+				cancel_requests (fetch, when, reason);
+			ASSERT (!fetch->field_request);
+			ASSERT (!fetch->hedge_request);
+			ASSERT (!fetch->query_request);
+		}
+	}
+
+	/* Whatever was polled of the current step */
+	if (poll->step)
+		rb_aggregate_flush (poll);
+}
+
+void
+rb_poll_engine_stop (rb_poller *poll)
+{
+	rb_poller *p;
+	mstime when;
+	int i;
+
+	ASSERT (!poll->group);
+
+	when = server_get_time ();
+
+	/*
+	 * The whole group stops together, as its items share values.
+	 * No more values get written for the current cycles, and the
+	 * timers go away the next time they fire.
+	 */
+	for (p = poll; p; p = p->group_next) {
+		p->retired = 1;
+		for (i = 0; i < p->n_cycles; ++i)
+			p->cycles[i].polling = 0;
 	}
+
+	for (p = poll; p; p = p->group_next)
+		stop_requests (p, when, "removed");
 }
 
 void
 rb_poll_engine_uninit (void)
 {
-	rb_poller * poll = g_state.polls;
-	rb_item *item;
+	rb_poller *poll;
 	mstime when;
+	int i;
 
-	if (poll != NULL) {
-		/* Now see if the all the requests are done */
-		when = server_get_time ();
-		for (item = poll->items; item; item = item->next) {
-			if (item->field_request || item->query_request) {
-				cancel_requests (item, when, "shutdown");
-			}
-			ASSERT (!item->field_request);
-			ASSERT (!item->query_request);
-		}
+	when = server_get_time ();
+
+	/* No more values get written for the current cycles */
+	for (poll = g_state.polls; poll != NULL; poll = poll->next) {
+		for (i = 0; i < poll->n_cycles; ++i)
+			poll->cycles[i].polling = 0;
 	}
+
+	for (poll = g_state.polls; poll != NULL; poll = poll->next)
+		stop_requests (poll, when, "shutdown");
 }
@@ -0,0 +1,848 @@
+/*
+ * Copyright (c) 2008, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+#include "usuals.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <err.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "log.h"
+#include "rrdbotd.h"
+
+/*
+ * Sends RRD updates to rrdcached with its text protocol, rather than
+ * writing the RRD files ourselves. Updates from all the pollers are
+ * queued to one thread, which sends them off together in a BATCH.
+ *
+ * rrdcached doesn't accept templates with updates, so we ask it for
+ * the data sources in each RRD, and send the values in that order.
+ * INFO needs rrdcached 1.5 or later.
+ *
+ * Updates that rrdcached can't take, because it's down, doesn't know
+ * the file, or refuses the update, are handed back to the writer
+ * threads, which write them with librrd. When rrdcached is up, the
+ * file is flushed through it first, so that what it has cached for
+ * the file isn't written after us. If that can't be sent, the updates
+ * stay queued here to try again.
+ */
+
+#define CACHED_PORT     "42217"
+
+/* Most updates sent in one batch, and queued before we wait */
+#define MAX_BATCH       1024
+#define MAX_QUEUED      (MAX_BATCH * 4)
+
+/* Seconds to wait before connecting again, and for responses */
+#define CACHED_RETRY    10
+#define CACHED_TIMEOUT  30
+
+typedef struct _cached_update
+{
+    char* path;
+    char* template;
+    char* values;
+    uint64_t seq;                   /* Sequence in the spool, or zero */
+    int requeued;                   /* Given back to the writers */
+    int failed;                     /* Refused, to flush and give back */
+    int retry;                      /* Stays queued, to send again */
+    struct _cached_update* next;
+}
+cached_update;
+
+/* The data sources of an RRD in order */
+typedef struct _cached_file
+{
+    char* path;
+    int n_ds;
+    char** names;
+}
+cached_file;
+
+/* Shared with the main thread */
+static pthread_mutex_t cached_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cached_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t cached_space = PTHREAD_COND_INITIALIZER;
+static cached_update* cached_first = NULL;
+static cached_update* cached_last = NULL;
+static int cached_depth = 0;
+static uint64_t cached_busy = 0;    /* First spooled update being sent */
+static int cached_quit = 0;
+static pthread_t cached_thread;
+static int cached_running = 0;
+
+/* Only used on the rrdcached thread */
+static const char* cached_address = NULL;
+static FILE* cached_in = NULL;
+static FILE* cached_out = NULL;
+static time_t cached_retry = 0;
+static hsh_t* cached_files = NULL;
+
+/* -----------------------------------------------------------------------------
+ * CONNECTION
+ */
+
+static int cached_connect_unix(const char* path)
+{
+    struct sockaddr_un sun;
+    int fd;
+
+    if(strlen(path) >= sizeof(sun.sun_path))
+    {
+        log_errorx("rrdcached socket path is too long: %s", path);
+        return -1;
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+        return -1;
+
+    if(connect(fd, (struct sockaddr*)&sun, sizeof(sun)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int cached_connect_tcp(const char* address)
+{
+    struct addrinfo hints, *res, *ai;
+    char host[MAXPATHLEN];
+    const char* port = CACHED_PORT;
+    char* t;
+    int fd = -1;
+    int r;
+
+    strlcpy(host, address, sizeof(host));
+
+    /* A port after the host name, or after an [ipv6] address */
+    if(host[0] == '[')
+    {
+        t = strchr(host, ']');
+        if(t)
+        {
+            *t = 0;
+            if(t[1] == ':')
+                port = t + 2;
+        }
+        memmove(host, host + 1, strlen(host));
+    }
+    else
+    {
+        t = strchr(host, ':');
+        if(t && !strchr(t + 1, ':'))
+        {
+            *t = 0;
+            port = t + 1;
+        }
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    r = getaddrinfo(host, port, &hints, &res);
+    if(r != 0)
+    {
+        log_errorx("couldn't resolve rrdcached address: %s: %s", address, gai_strerror(r));
+        return -1;
+    }
+
+    for(ai = res; ai; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(fd < 0)
+            continue;
+        if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(res);
+    return fd;
+}
+
+static void cached_disconnect()
+{
+    if(cached_in)
+        fclose(cached_in);
+    if(cached_out)
+        fclose(cached_out);
+    cached_in = cached_out = NULL;
+}
+
+static int cached_connect()
+{
+    struct timeval tv;
+    int fd, fd2;
+
+    if(cached_in)
+        return 0;
+
+    /* Don't keep trying to connect on every update */
+    if(time(NULL) < cached_retry)
+        return -1;
+    cached_retry = time(NULL) + CACHED_RETRY;
+
+    if(strncmp(cached_address, "unix:", 5) == 0)
+        fd = cached_connect_unix(cached_address + 5);
+    else if(cached_address[0] == '/')
+        fd = cached_connect_unix(cached_address);
+    else
+        fd = cached_connect_tcp(cached_address);
+
+    if(fd < 0)
+    {
+        log_error("couldn't connect to rrdcached: %s", cached_address);
+        return -1;
+    }
+
+    /* Don't hang forever on a stuck daemon */
+    tv.tv_sec = CACHED_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    fd2 = dup(fd);
+    cached_in = fdopen(fd, "r");
+    cached_out = fd2 < 0 ? NULL : fdopen(fd2, "w");
+    if(!cached_in || !cached_out)
+    {
+        log_error("couldn't setup rrdcached connection");
+        if(!cached_in)
+            close(fd);
+        if(!cached_out && fd2 >= 0)
+            close(fd2);
+        cached_disconnect();
+        return -1;
+    }
+
+    log_info("connected to rrdcached: %s", cached_address);
+    return 0;
+}
+
+/* Reads a whole line, dropping anything that doesn't fit */
+static int cached_line(char* line, size_t len)
+{
+    char rest[256];
+    size_t n;
+
+    if(!fgets(line, len, cached_in))
+        return -1;
+
+    n = strlen(line);
+    while(n && line[n - 1] != '\n')
+    {
+        if(!fgets(rest, sizeof(rest), cached_in))
+            return -1;
+        n = strlen(rest);
+        if(n && rest[n - 1] == '\n')
+            break;
+    }
+
+    n = strlen(line);
+    while(n && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+        line[--n] = 0;
+
+    return 0;
+}
+
+/* The status is the first thing in every response */
+static int cached_response(int* status, char* line, size_t len)
+{
+    char* t;
+
+    if(fflush(cached_out) != 0 || cached_line(line, len) < 0)
+    {
+        log_error("couldn't talk to rrdcached: %s", cached_address);
+        cached_disconnect();
+        return -1;
+    }
+
+    *status = strtol(line, &t, 10);
+    if(t == line)
+    {
+        log_errorx("invalid response from rrdcached: %s", line);
+        cached_disconnect();
+        return -1;
+    }
+
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * UPDATES
+ */
+
+static void cached_file_free(cached_file* file)
+{
+    int i;
+
+    for(i = 0; i < file->n_ds; ++i)
+        free(file->names[i]);
+    free(file->names);
+    free(file->path);
+    free(file);
+}
+
+/* Ask rrdcached which data sources are in the RRD, and in which order */
+static cached_file* cached_file_info(const char* path, int* failed)
+{
+    cached_file* file;
+    char line[1024];
+    char* name;
+    char* t;
+    char** names;
+    int status, i, index;
+
+    file = (cached_file*)hsh_get(cached_files, path, -1);
+    if(file)
+        return file;
+
+    fprintf(cached_out, "INFO %s\n", path);
+    if(cached_response(&status, line, sizeof(line)) < 0)
+    {
+        *failed = 1;
+        return NULL;
+    }
+
+    /* Not remembered, the file may show up later */
+    if(status < 0)
+    {
+        log_warnx("rrdcached has no info for rrd file: %s: %s", path, line);
+        return NULL;
+    }
+
+    file = (cached_file*)xcalloc(sizeof(cached_file));
+
+    /* Lines look like: ds[name].index 1 0 */
+    for(i = 0; i < status; ++i)
+    {
+        if(cached_line(line, sizeof(line)) < 0)
+        {
+            log_error("couldn't talk to rrdcached: %s", cached_address);
+            cached_disconnect();
+            cached_file_free(file);
+            *failed = 1;
+            return NULL;
+        }
+
+        if(strncmp(line, "ds[", 3) != 0)
+            continue;
+        name = line + 3;
+        t = strstr(name, "].index ");
+        if(!t)
+            continue;
+        *t = 0;
+        t = strrchr(t + 1, ' ');
+        if(!t)
+            continue;
+        index = strtol(t + 1, NULL, 10);
+        if(index < 0 || index > 0xFFFF)
+            continue;
+
+        if(index >= file->n_ds)
+        {
+            names = (char**)realloc(file->names, sizeof(char*) * (index + 1));
+            if(!names)
+                continue;
+            memset(names + file->n_ds, 0, sizeof(char*) * (index + 1 - file->n_ds));
+            file->names = names;
+            file->n_ds = index + 1;
+        }
+
+        free(file->names[index]);
+        file->names[index] = strdup(name);
+    }
+
+    file->path = strdup(path);
+    if(!file->path || !hsh_set(cached_files, file->path, -1, file))
+    {
+        cached_file_free(file);
+        log_errorx("out of memory");
+        return NULL;
+    }
+
+    return file;
+}
+
+/* The file may have been replaced, so look it up again next time */
+static void cached_file_forget(const char* path)
+{
+    cached_file* file;
+
+    file = (cached_file*)hsh_rem(cached_files, path, -1);
+    if(file)
+        cached_file_free(file);
+}
+
+static int cached_split(char* str, char** parts, int max)
+{
+    int n;
+    for(n = 0; str && n < max; ++n)
+        parts[n] = strsep(&str, ":");
+    return str ? -1 : n;
+}
+
+/* Put the values in the order of the data sources in the file */
+static char* cached_order(cached_file* file, cached_update* up)
+{
+    char** fields = NULL;
+    char** values = NULL;
+    char* copy = NULL;
+    char* ret = NULL;
+    size_t len;
+    int max, n_fields, i, j;
+
+    /* Enough for the values, plus a "U:" for every data source */
+    len = strlen(up->values) + (file->n_ds * 2) + 1;
+    max = strlen(up->values) + 1;
+
+    copy = (char*)malloc(strlen(up->template) + strlen(up->values) + 2);
+    fields = (char**)calloc(max, sizeof(char*));
+    values = (char**)calloc(max + 1, sizeof(char*));
+    ret = (char*)malloc(len);
+    if(!copy || !fields || !values || !ret)
+    {
+        log_errorx("out of memory");
+        goto failed;
+    }
+
+    strcpy(copy, up->template);
+    strcpy(copy + strlen(up->template) + 1, up->values);
+
+    /* The timestamp, and then one value for each field */
+    n_fields = cached_split(copy, fields, max);
+    if(n_fields < 0 || cached_split(copy + strlen(up->template) + 1,
+                                    values, max + 1) != n_fields + 1)
+        goto failed;
+
+    /* Fields that aren't in the file are an error, like with rrd_update */
+    for(j = 0; j < n_fields; ++j)
+    {
+        for(i = 0; i < file->n_ds; ++i)
+        {
+            if(file->names[i] && strcmp(file->names[i], fields[j]) == 0)
+                break;
+        }
+
+        if(i == file->n_ds)
+        {
+            log_errorx("couldn't update rrd file: %s: unknown data source: %s",
+                       up->path, fields[j]);
+            goto failed;
+        }
+    }
+
+    strlcpy(ret, values[0], len);
+
+    for(i = 0; i < file->n_ds; ++i)
+    {
+        for(j = 0; j < n_fields; ++j)
+        {
+            if(file->names[i] && strcmp(file->names[i], fields[j]) == 0)
+                break;
+        }
+
+        strlcat(ret, ":", len);
+        strlcat(ret, j < n_fields ? values[j + 1] : "U", len);
+    }
+
+    free(copy);
+    free(fields);
+    free(values);
+    return ret;
+
+failed:
+    free(copy);
+    free(fields);
+    free(values);
+    free(ret);
+    return NULL;
+}
+
+/* Give an update back to the writers */
+static void cached_requeue(cached_update* up)
+{
+    if(!up->requeued)
+        rb_rrd_requeue(up->path, up->template, up->values, up->seq);
+    up->requeued = 1;
+}
+
+/*
+ * Writes out what rrdcached has cached for the files of the refused
+ * updates, before giving those back to the writers. Returns -1 when
+ * rrdcached can't be talked to, and the rest are left to send again.
+ */
+static int cached_flush(cached_update* ups)
+{
+    char line[1024];
+    cached_update* up;
+    cached_update* same;
+    int status;
+
+    for(up = ups; up; up = up->next)
+    {
+        if(!up->failed || up->requeued)
+            continue;
+
+        fprintf(cached_out, "FLUSH %s\n", up->path);
+        if(cached_response(&status, line, sizeof(line)) < 0)
+        {
+            for(; up; up = up->next)
+            {
+                if(up->failed && !up->requeued)
+                    up->retry = 1;
+            }
+            return -1;
+        }
+
+        /* It couldn't write the file either, so nothing more to wait for */
+        if(status != 0)
+            log_warnx("rrdcached couldn't flush rrd file: %s: %s", up->path, line);
+
+        for(same = up; same; same = same->next)
+        {
+            if(same->failed && strcmp(same->path, up->path) == 0)
+                cached_requeue(same);
+        }
+    }
+
+    return 0;
+}
+
+static void cached_send(cached_update* ups)
+{
+    cached_file* files[MAX_BATCH];
+    cached_update* sent[MAX_BATCH];
+    char line[1024];
+    char* values;
+    cached_update* up;
+    int failed = 0;
+    int status, i, n, n_sent;
+
+    if(cached_connect() < 0)
+        goto requeue;
+
+    /* Look up the files before the batch, as info doesn't work in one */
+    for(up = ups, n = 0; up && !failed; up = up->next, ++n)
+        files[n] = cached_file_info(up->path, &failed);
+    if(failed)
+        goto requeue;
+
+    fprintf(cached_out, "BATCH\n");
+    if(cached_response(&status, line, sizeof(line)) < 0)
+        goto requeue;
+    if(status != 0)
+    {
+        log_errorx("rrdcached won't accept a batch: %s", line);
+        goto requeue;
+    }
+
+    for(up = ups, i = 0, n_sent = 0; up; up = up->next, ++i)
+    {
+        values = files[i] ? cached_order(files[i], up) : NULL;
+        if(!values)
+        {
+            up->failed = 1;
+            continue;
+        }
+
+        log_debug("rrdcached update: %s %s", up->path, values);
+        fprintf(cached_out, "UPDATE %s %s\n", up->path, values);
+        free(values);
+        sent[n_sent++] = up;
+    }
+
+    /* The response lists each update that failed */
+    fprintf(cached_out, ".\n");
+    if(cached_response(&status, line, sizeof(line)) < 0)
+        goto requeue;
+
+    for(i = 0; i < status; ++i)
+    {
+        if(cached_line(line, sizeof(line)) < 0)
+        {
+            log_error("couldn't talk to rrdcached: %s", cached_address);
+            cached_disconnect();
+            return;
+        }
+
+        log_warnx("rrdcached couldn't update rrd file: %s", line);
+
+        /* Each line starts with the number of the update in the batch */
+        n = strtol(line, NULL, 10);
+        if(n >= 1 && n <= n_sent)
+        {
+            cached_file_forget(sent[n - 1]->path);
+            sent[n - 1]->failed = 1;
+        }
+    }
+
+    cached_flush(ups);
+    return;
+
+requeue:
+    /*
+     * The writers handle what rrdcached couldn't be reached for. If
+     * some of these went through anyway, rrd_update refuses the same
+     * time again.
+     */
+    for(up = ups; up; up = up->next)
+        cached_requeue(up);
+}
+
+static void* cached_thread_main(void* arg)
+{
+    cached_update* ups;
+    cached_update* up;
+    cached_update* last;
+    int n;
+
+    for(;;)
+    {
+        pthread_mutex_lock(&cached_mutex);
+
+            /* Send the queue before quitting */
+            while(!cached_first && !cached_quit)
+                pthread_cond_wait(&cached_queued, &cached_mutex);
+
+            /* Take a batch off the front of the queue */
+            ups = cached_first;
+            cached_busy = 0;
+            for(last = NULL, up = ups, n = 0; up && n < MAX_BATCH; up = up->next, ++n)
+            {
+                if(up->seq && (!cached_busy || up->seq < cached_busy))
+                    cached_busy = up->seq;
+                last = up;
+            }
+            if(last)
+            {
+                cached_first = last->next;
+                last->next = NULL;
+                if(!cached_first)
+                    cached_last = NULL;
+                cached_depth -= n;
+                pthread_cond_signal(&cached_space);
+            }
+
+        pthread_mutex_unlock(&cached_mutex);
+
+        if(!ups)
+            break;
+
+        cached_send(ups);
+
+        /* Sent, given back to the writers, or back on the queue */
+        pthread_mutex_lock(&cached_mutex);
+
+            for(last = NULL; ups; ups = up)
+            {
+                up = ups->next;
+                if(!ups->retry)
+                {
+                    free(ups);
+                    continue;
+                }
+
+                ups->retry = ups->failed = 0;
+                if(last)
+                {
+                    ups->next = last->next;
+                    last->next = ups;
+                }
+                else
+                {
+                    ups->next = cached_first;
+                    cached_first = ups;
+                }
+                if(!ups->next)
+                    cached_last = ups;
+                last = ups;
+                cached_depth++;
+            }
+
+            cached_busy = 0;
+
+        pthread_mutex_unlock(&cached_mutex);
+    }
+
+    return NULL;
+}
+
+/* -----------------------------------------------------------------------------
+ * PUBLIC
+ */
+
+int rb_cached_update(const char* path, const char* template, const char* values,
+                     uint64_t seq)
+{
+    cached_update* up;
+    size_t plen, tlen, vlen;
+
+    if(!cached_running)
+        return -1;
+
+    plen = strlen(path) + 1;
+    tlen = strlen(template) + 1;
+    vlen = strlen(values) + 1;
+
+    /* The update and its strings in one block */
+    up = (cached_update*)calloc(1, sizeof(cached_update) + plen + tlen + vlen);
+    if(!up)
+    {
+        log_errorx("out of memory");
+        return 0;
+    }
+
+    up->path = (char*)(up + 1);
+    memcpy(up->path, path, plen);
+    up->template = up->path + plen;
+    memcpy(up->template, template, tlen);
+    up->values = up->template + tlen;
+    memcpy(up->values, values, vlen);
+    up->seq = seq;
+
+    pthread_mutex_lock(&cached_mutex);
+
+        /* rrdcached is behind, wait for it to catch up */
+        while(cached_depth >= MAX_QUEUED)
+            pthread_cond_wait(&cached_space, &cached_mutex);
+
+        if(cached_last)
+            cached_last->next = up;
+        else
+            cached_first = up;
+        cached_last = up;
+        cached_depth++;
+
+        pthread_cond_signal(&cached_queued);
+
+    pthread_mutex_unlock(&cached_mutex);
+
+    return 0;
+}
+
+/* The first spooled update that rrdcached hasn't taken */
+uint64_t rb_cached_pending()
+{
+    uint64_t pending = UINT64_MAX;
+    cached_update* up;
+
+    if(!cached_running)
+        return pending;
+
+    pthread_mutex_lock(&cached_mutex);
+
+        if(cached_busy)
+            pending = cached_busy;
+        for(up = cached_first; up; up = up->next)
+        {
+            if(up->seq && up->seq < pending)
+                pending = up->seq;
+        }
+
+    pthread_mutex_unlock(&cached_mutex);
+
+    return pending;
+}
+
+void rb_cached_init(const char* address)
+{
+    int r;
+
+    ASSERT(!cached_running);
+
+    if(!address)
+        return;
+
+    cached_address = address;
+    cached_files = hsh_create();
+    if(!cached_files)
+        errx(1, "out of memory");
+
+    r = pthread_create(&cached_thread, NULL, cached_thread_main, NULL);
+    if(r != 0)
+    {
+        log_errorx("couldn't start rrdcached thread: %s", strerror(r));
+        return;
+    }
+
+    cached_running = 1;
+}
+
+void rb_cached_uninit()
+{
+    hsh_index_t* hi;
+    cached_file* file;
+
+    if(!cached_running)
+        return;
+
+    /* Send off everything queued, and then quit */
+    pthread_mutex_lock(&cached_mutex);
+        cached_quit = 1;
+        pthread_cond_signal(&cached_queued);
+    pthread_mutex_unlock(&cached_mutex);
+
+    pthread_join(cached_thread, NULL);
+    cached_running = 0;
+
+    cached_disconnect();
+
+    for(hi = hsh_first(cached_files); hi; hi = hsh_next(hi))
+    {
+        file = (cached_file*)hsh_this(hi, NULL, NULL);
+        cached_file_free(file);
+    }
+
+    hsh_free(cached_files);
+    cached_files = NULL;
+}
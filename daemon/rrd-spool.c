@@ -0,0 +1,666 @@
+/*
+ * Copyright (c) 2008, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+
+#include "usuals.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "rrdbotd.h"
+
+/*
+ * The spool is an append only log of the writes for the RRD and raw
+ * files. Each write is put in the spool before it's queued, and given
+ * a sequence number. Writers that can't keep up, or whose storage is
+ * failing, replay their writes from the spool later on, in order. So
+ * do all the writers on startup, for writes that weren't done when
+ * the daemon last stopped.
+ *
+ * The spool is split into segment files named after the sequence
+ * number of their first record. A segment is removed once all of its
+ * writes are done. The sequence number of the last done write is kept
+ * in a separate file.
+ */
+
+/* Size at which we start a new segment */
+#define SEGMENT_SIZE    (1024 * 1024)
+
+/* Anything bigger is a corrupted record */
+#define MAX_RECORD      (16 * 1024 * 1024)
+
+#define SEGMENT_PREFIX  "spool-"
+#define DONE_FILE       "spool-done"
+
+typedef struct _spool_header
+{
+    uint32_t len;                   /* Length of the strings after this */
+    uint32_t sum;                   /* Checksum of the record */
+    uint64_t seq;
+    uint32_t type;
+    uint32_t pad;
+}
+spool_header;
+
+typedef struct _spool_segment
+{
+    uint64_t first;                 /* Sequence of first record */
+    off_t size;
+}
+spool_segment;
+
+struct _rb_spool_reader
+{
+    int fd;
+    uint64_t segment;               /* First sequence of open segment */
+    off_t offset;
+    uint64_t next;                  /* Next sequence we want */
+    char* buf;
+    size_t alloc;
+};
+
+/* Protects the segment list, the rest is only used on the main thread */
+static pthread_mutex_t spool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static spool_segment* segments = NULL;
+static int n_segments = 0;
+
+static char* spool_dir = NULL;
+static off_t spool_max = 0;
+static int spool_sync = SPOOL_SYNC_SECOND;
+static int spool_fd = -1;
+static int spool_dirty = 0;         /* Appended since last sync */
+static uint64_t spool_seq = 0;      /* Last sequence appended */
+static uint64_t spool_done = 0;     /* Last sequence written to done file */
+static char* spool_buf = NULL;
+static size_t spool_alloc = 0;
+
+static uint32_t spool_sum(const spool_header* hdr, const char* data)
+{
+    uint32_t h = 2166136261U;
+    size_t i;
+
+    for(i = 0; i < sizeof(hdr->seq); ++i)
+        h = (h ^ ((hdr->seq >> (i * 8)) & 0xFF)) * 16777619U;
+    h = (h ^ hdr->type) * 16777619U;
+    for(i = 0; i < hdr->len; ++i)
+        h = (h ^ (unsigned char)data[i]) * 16777619U;
+
+    return h;
+}
+
+static void segment_path(uint64_t first, char* buf, size_t len)
+{
+    snprintf(buf, len, "%s/" SEGMENT_PREFIX "%016llx", spool_dir,
+             (unsigned long long)first);
+}
+
+static int segment_add(uint64_t first)
+{
+    spool_segment* segs;
+    char path[MAXPATHLEN];
+    int fd;
+
+    segment_path(first, path, sizeof(path));
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(fd < 0)
+    {
+        log_error("couldn't open spool file: %s", path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&spool_mutex);
+
+        segs = (spool_segment*)realloc(segments, sizeof(spool_segment) * (n_segments + 1));
+        if(segs)
+        {
+            segments = segs;
+            segments[n_segments].first = first;
+            segments[n_segments].size = 0;
+            n_segments++;
+        }
+
+    pthread_mutex_unlock(&spool_mutex);
+
+    if(!segs)
+    {
+        log_errorx("out of memory");
+        close(fd);
+        return -1;
+    }
+
+    if(spool_fd != -1)
+        close(spool_fd);
+    spool_fd = fd;
+    return 0;
+}
+
+/* Remove the oldest segment, which mustn't be the one we append to */
+static void segment_remove()
+{
+    char path[MAXPATHLEN];
+
+    ASSERT(n_segments > 1);
+    segment_path(segments[0].first, path, sizeof(path));
+
+    pthread_mutex_lock(&spool_mutex);
+
+        memmove(segments, segments + 1, sizeof(spool_segment) * (n_segments - 1));
+        n_segments--;
+
+    pthread_mutex_unlock(&spool_mutex);
+
+    if(unlink(path) < 0 && errno != ENOENT)
+        log_error("couldn't remove spool file: %s", path);
+}
+
+static void spool_sync_now()
+{
+    if(spool_dirty && spool_fd != -1 && fdatasync(spool_fd) < 0)
+        log_error("couldn't sync spool file");
+    spool_dirty = 0;
+}
+
+/* Keep the spool under its size limit, dropping the oldest writes */
+static void spool_limit()
+{
+    off_t total = 0;
+    int i;
+
+    for(i = 0; i < n_segments; ++i)
+        total += segments[i].size;
+
+    while(total > spool_max && n_segments > 1)
+    {
+        log_warnx("spool is full, dropping writes %llu to %llu",
+                  (unsigned long long)segments[0].first,
+                  (unsigned long long)segments[1].first - 1);
+        total -= segments[0].size;
+        segment_remove();
+    }
+}
+
+uint64_t rb_spool_append(int type, const char* path, const char* template,
+                         const char* data)
+{
+    spool_segment* seg;
+    spool_header hdr;
+    size_t plen, tlen, dlen, len;
+    char* buf;
+    ssize_t r;
+
+    ASSERT(spool_dir);
+
+    if(spool_fd == -1 && segment_add(spool_seq + 1) < 0)
+        return 0;
+
+    plen = strlen(path) + 1;
+    tlen = template ? strlen(template) + 1 : 1;
+    dlen = strlen(data) + 1;
+    len = sizeof(hdr) + plen + tlen + dlen;
+
+    if(len > spool_alloc)
+    {
+        buf = (char*)realloc(spool_buf, len);
+        if(!buf)
+        {
+            log_errorx("out of memory");
+            return 0;
+        }
+        spool_buf = buf;
+        spool_alloc = len;
+    }
+
+    buf = spool_buf + sizeof(hdr);
+    memcpy(buf, path, plen);
+    if(template)
+        memcpy(buf + plen, template, tlen);
+    else
+        buf[plen] = 0;
+    memcpy(buf + plen + tlen, data, dlen);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.len = plen + tlen + dlen;
+    hdr.seq = spool_seq + 1;
+    hdr.type = type;
+    hdr.sum = spool_sum(&hdr, buf);
+    memcpy(spool_buf, &hdr, sizeof(hdr));
+
+    seg = &segments[n_segments - 1];
+    r = write(spool_fd, spool_buf, len);
+    if(r != (ssize_t)len)
+    {
+        if(r < 0)
+            log_error("couldn't write to spool");
+        else
+            log_errorx("couldn't write to spool: short write");
+
+        /* Don't leave half a record behind for the readers */
+        if(r > 0 && ftruncate(spool_fd, seg->size) < 0)
+        {
+            log_error("couldn't truncate spool");
+            close(spool_fd);
+            spool_fd = -1;
+
+            /* So the next segment gets a name of its own */
+            spool_seq++;
+        }
+        return 0;
+    }
+
+    spool_seq++;
+    spool_dirty = 1;
+
+    pthread_mutex_lock(&spool_mutex);
+        seg->size += len;
+    pthread_mutex_unlock(&spool_mutex);
+
+    if(spool_sync == SPOOL_SYNC_ALWAYS)
+        spool_sync_now();
+
+    /* Move on to a new segment once this one is big enough */
+    if(seg->size >= SEGMENT_SIZE)
+    {
+        if(spool_sync != SPOOL_SYNC_NEVER)
+            spool_sync_now();
+        close(spool_fd);
+        spool_fd = -1;
+        segment_add(spool_seq + 1);
+        spool_limit();
+    }
+
+    return spool_seq;
+}
+
+uint64_t rb_spool_last()
+{
+    return spool_seq;
+}
+
+static void done_write(uint64_t done)
+{
+    char path[MAXPATHLEN];
+    char temp[MAXPATHLEN];
+    FILE* f;
+
+    snprintf(path, sizeof(path), "%s/" DONE_FILE, spool_dir);
+    snprintf(temp, sizeof(temp), "%s/" DONE_FILE ".tmp", spool_dir);
+
+    f = fopen(temp, "w");
+    if(!f)
+    {
+        log_error("couldn't open spool file: %s", temp);
+        return;
+    }
+
+    fprintf(f, "%llu\n", (unsigned long long)done);
+    if(fclose(f) == EOF)
+        log_error("couldn't write spool file: %s", temp);
+    else if(rename(temp, path) < 0)
+        log_error("couldn't rename spool file: %s", temp);
+    else
+        spool_done = done;
+}
+
+void rb_spool_done(uint64_t done)
+{
+    if(!spool_dir)
+        return;
+
+    if(spool_sync == SPOOL_SYNC_SECOND)
+        spool_sync_now();
+
+    if(done == spool_done)
+        return;
+
+    done_write(done);
+
+    /* Segments where all the writes are done */
+    while(n_segments > 1 && segments[1].first - 1 <= done)
+        segment_remove();
+}
+
+/* -----------------------------------------------------------------------------
+ * READING
+ */
+
+/* The segment that holds a sequence, or the oldest one if it's gone */
+static int segment_find(uint64_t seq, uint64_t* first, uint64_t* next)
+{
+    int i, ret = -1;
+
+    pthread_mutex_lock(&spool_mutex);
+
+        for(i = n_segments - 1; i >= 0; --i)
+        {
+            if(segments[i].first <= seq || i == 0)
+            {
+                *first = segments[i].first;
+                *next = (i + 1 < n_segments) ? segments[i + 1].first : 0;
+                ret = 0;
+                break;
+            }
+        }
+
+    pthread_mutex_unlock(&spool_mutex);
+
+    return ret;
+}
+
+rb_spool_reader* rb_spool_open(uint64_t from)
+{
+    rb_spool_reader* rd;
+
+    rd = (rb_spool_reader*)calloc(1, sizeof(rb_spool_reader));
+    if(!rd)
+        return NULL;
+
+    rd->fd = -1;
+    rd->next = from;
+    return rd;
+}
+
+void rb_spool_close(rb_spool_reader* rd)
+{
+    if(!rd)
+        return;
+    if(rd->fd != -1)
+        close(rd->fd);
+    free(rd->buf);
+    free(rd);
+}
+
+/* Move on when the segment ends, unless it's the one being appended to */
+static int reader_end(rb_spool_reader* rd)
+{
+    uint64_t first, next;
+
+    if(segment_find(rd->segment, &first, &next) < 0 || !next)
+        return 0;
+
+    close(rd->fd);
+    rd->fd = -1;
+    if(rd->next < next)
+        rd->next = next;
+    return 1;
+}
+
+int rb_spool_read(rb_spool_reader* rd, uint64_t until, rb_spool_record* rec)
+{
+    char path[MAXPATHLEN];
+    spool_header hdr;
+    uint64_t next;
+    ssize_t r;
+    char* buf;
+
+    for(;;)
+    {
+        if(rd->next > until)
+            return 0;
+
+        if(rd->fd == -1)
+        {
+            if(segment_find(rd->next, &rd->segment, &next) < 0)
+                return 0;
+
+            segment_path(rd->segment, path, sizeof(path));
+            rd->fd = open(path, O_RDONLY);
+            if(rd->fd < 0)
+            {
+                /* Dropped while we were looking */
+                if(errno == ENOENT && next)
+                {
+                    if(rd->next < next)
+                        rd->next = next;
+                    continue;
+                }
+                log_error("couldn't open spool file: %s", path);
+                return -1;
+            }
+            rd->offset = 0;
+        }
+
+        r = pread(rd->fd, &hdr, sizeof(hdr), rd->offset);
+        if(r < 0)
+        {
+            log_error("couldn't read spool");
+            return -1;
+        }
+
+        if(r < (ssize_t)sizeof(hdr))
+        {
+            if(reader_end(rd))
+                continue;
+            return 0;
+        }
+
+        /* Not all the way written yet */
+        if(hdr.seq > until)
+            return 0;
+
+        if(hdr.len > MAX_RECORD)
+        {
+            r = -1;
+        }
+        else if(hdr.len + 1 > rd->alloc)
+        {
+            buf = (char*)realloc(rd->buf, hdr.len + 1);
+            if(!buf)
+            {
+                log_errorx("out of memory");
+                return -1;
+            }
+            rd->buf = buf;
+            rd->alloc = hdr.len + 1;
+        }
+
+        if(hdr.len <= MAX_RECORD)
+            r = pread(rd->fd, rd->buf, hdr.len, rd->offset + sizeof(hdr));
+        if(r != (ssize_t)hdr.len || spool_sum(&hdr, rd->buf) != hdr.sum)
+        {
+            /* Left over from a crash, the rest of the segment is lost */
+            log_warnx("spool file is corrupted after write %llu",
+                      (unsigned long long)rd->next - 1);
+            if(reader_end(rd))
+                continue;
+            return 0;
+        }
+
+        rd->offset += sizeof(hdr) + hdr.len;
+        if(hdr.seq < rd->next)
+            continue;
+
+        rd->buf[hdr.len] = 0;
+        rec->seq = hdr.seq;
+        rec->type = hdr.type;
+        rec->path = rd->buf;
+        rec->template = rec->path + strlen(rec->path) + 1;
+        rec->data = rec->template + strlen(rec->template) + 1;
+        if(!rec->template[0])
+            rec->template = NULL;
+
+        rd->next = hdr.seq + 1;
+        return 1;
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ * STARTUP
+ */
+
+static int compare_segments(const void* a, const void* b)
+{
+    uint64_t fa = ((const spool_segment*)a)->first;
+    uint64_t fb = ((const spool_segment*)b)->first;
+    return (fa < fb) ? -1 : (fa > fb);
+}
+
+static void segments_load()
+{
+    struct dirent* ent;
+    struct stat sb;
+    char path[MAXPATHLEN];
+    DIR* dir;
+    char* t;
+    uint64_t first;
+
+    dir = opendir(spool_dir);
+    if(!dir)
+        err(1, "couldn't open spool directory: %s", spool_dir);
+
+    while((ent = readdir(dir)) != NULL)
+    {
+        if(strncmp(ent->d_name, SEGMENT_PREFIX, strlen(SEGMENT_PREFIX)) != 0)
+            continue;
+        first = strtoull(ent->d_name + strlen(SEGMENT_PREFIX), &t, 16);
+        if(*t || t == ent->d_name + strlen(SEGMENT_PREFIX))
+            continue;
+
+        segment_path(first, path, sizeof(path));
+        if(stat(path, &sb) < 0)
+            continue;
+
+        segments = (spool_segment*)xrealloc(segments, sizeof(spool_segment) * (n_segments + 1));
+        segments[n_segments].first = first;
+        segments[n_segments].size = sb.st_size;
+        n_segments++;
+    }
+
+    closedir(dir);
+
+    if(n_segments)
+        qsort(segments, n_segments, sizeof(spool_segment), compare_segments);
+}
+
+static uint64_t done_load()
+{
+    char path[MAXPATHLEN];
+    unsigned long long done = 0;
+    FILE* f;
+
+    snprintf(path, sizeof(path), "%s/" DONE_FILE, spool_dir);
+    f = fopen(path, "r");
+    if(!f)
+    {
+        if(errno != ENOENT)
+            err(1, "couldn't open spool file: %s", path);
+        return 0;
+    }
+
+    if(fscanf(f, "%llu", &done) != 1)
+        warnx("invalid spool file, replaying all writes: %s", path);
+    fclose(f);
+    return done;
+}
+
+/* Find the last whole record in the spool */
+static uint64_t spool_scan()
+{
+    rb_spool_reader* rd;
+    rb_spool_record rec;
+    uint64_t last;
+
+    last = segments[n_segments - 1].first - 1;
+    rd = rb_spool_open(last + 1);
+    if(!rd)
+        errx(1, "out of memory");
+
+    while(rb_spool_read(rd, UINT64_MAX, &rec) > 0)
+        last = rec.seq;
+
+    rb_spool_close(rd);
+    return last;
+}
+
+uint64_t rb_spool_init(const char* dir, size_t max, int sync)
+{
+    uint64_t done;
+
+    spool_dir = strdup(dir);
+    if(!spool_dir)
+        errx(1, "out of memory");
+    spool_max = max;
+    spool_sync = sync;
+
+    segments_load();
+    done = done_load();
+    spool_done = done;
+
+    /* Where the last run left off, new writes go in a new segment */
+    spool_seq = n_segments ? spool_scan() : 0;
+    if(spool_seq < done)
+        spool_seq = done;
+    if(segment_add(spool_seq + 1) < 0)
+        errx(1, "couldn't create spool file in: %s", dir);
+
+    while(n_segments > 1 && segments[1].first - 1 <= done)
+        segment_remove();
+
+    if(spool_seq > done)
+        log_info("replaying %llu writes from the spool",
+                 (unsigned long long)(spool_seq - done));
+
+    return done + 1;
+}
+
+void rb_spool_uninit()
+{
+    if(!spool_dir)
+        return;
+
+    if(spool_fd != -1)
+    {
+        if(spool_sync != SPOOL_SYNC_NEVER)
+            spool_sync_now();
+        close(spool_fd);
+    }
+
+    spool_fd = -1;
+    free(segments);
+    segments = NULL;
+    n_segments = 0;
+    free(spool_buf);
+    spool_buf = NULL;
+    spool_alloc = 0;
+    free(spool_dir);
+    spool_dir = NULL;
+}
@@ -39,15 +39,24 @@
 #define _GNU_SOURCE
 
 #include "usuals.h"
+#include <ctype.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <err.h>
 
 #include <rrd.h>
 
+#include "hash.h"
 #include "log.h"
+#include "raw-binary.h"
 #include "rrdbotd.h"
+#include "server-mainloop.h"
 
 #define MAX_NUMLEN 40
 
@@ -119,158 +128,1832 @@ finally:
     return ret;
 }
 
-void rb_rrd_update(rb_poller *poll)
+/* -----------------------------------------------------------------------------
+ * WRITER THREADS
+ */
+
+/*
+ * Writing to RRD and raw files happens on a pool of threads, so a
+ * slow disk or a locked RRD doesn't hold up polling. Each file always
+ * goes to the same writer, so the writes to a file stay in order.
+ */
+
+#define WRITE_RRD   1
+#define WRITE_RAW   2
+#define WRITE_BIN   3               /* Binary raw file */
+
+/* The most writes queued for each writer before we wait */
+#define MAX_QUEUED  1024
+
+/* How often to report on the writers */
+#define STATS_INTERVAL  (5 * 60 * 1000)
+
+/* Raw files kept open by each writer, and seconds before an idle one is closed */
+#define MAX_RAW_FILES   256
+#define RAW_IDLE        300
+
+/* Seconds of values kept in a block of a binary raw file, before writing it */
+#define BIN_BLOCK_AGE   600
+
+/* Returned by writes that failed, but might work later */
+#define WRITE_AGAIN     1
+
+/* Longest wait in seconds before trying a failed write again */
+#define MAX_RETRY_WAIT  60
+
+/* How often to note which spooled writes are done */
+#define SPOOL_INTERVAL  1000
+
+typedef struct _write_job
+{
+    int type;
+    uint64_t seq;                   /* Sequence in the spool, or zero */
+    int direct;                     /* Given back by rrdcached */
+    char* path;
+    char* template;                 /* RRD template or NULL */
+    char* data;                     /* RRD values or raw line */
+    struct _write_job* next;
+}
+write_job;
+
+typedef struct _raw_file
+{
+    char* path;
+    FILE* fp;                       /* Either a text file */
+    rawbin_file* bin;               /* Or a binary one */
+    time_t used;
+    struct _raw_file* prev;         /* Most recently used first */
+    struct _raw_file* next;
+}
+raw_file;
+
+typedef struct _writer
+{
+    pthread_t thread;
+    pthread_cond_t queued;          /* Signalled when a job is added */
+    pthread_cond_t space;           /* Signalled when a job is taken */
+    write_job* first;
+    write_job* last;
+    int depth;                      /* Jobs queued now */
+    int max_depth;                  /* Most jobs queued since last report */
+    unsigned int written;           /* Jobs done since last report */
+
+    /* Spooled jobs that aren't done yet */
+    uint64_t busy;                  /* The job being written */
+    uint64_t left;                  /* First job left undone when quitting */
+    uint64_t dirty;                 /* First job not yet flushed to raw files */
+    int spilled;                    /* New jobs are only in the spool */
+    uint64_t spill;                 /* Next job to replay from the spool */
+
+    /* Only used by the writer itself */
+    hsh_t* raw_files;
+    raw_file* raw_first;
+    raw_file* raw_last;
+    int n_raw;
+    int raw_dirty;                  /* Written to since last flush */
+    rb_spool_reader* reader;
+}
+writer;
+
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static writer* writers = NULL;
+
+/* Writes on the main thread when there are no writer threads */
+static writer sync_writer;
+static int n_writers = 0;
+static int writers_quit = 0;
+
+/* Times the main thread had to wait for space, since last report */
+static unsigned int writers_waited = 0;
+
+/* Whether jobs go to the spool, and the last one that did */
+static int spool_on = 0;
+static uint64_t spool_last = 0;
+
+#ifndef HAVE_RRD_UPDATE_R
+/* Without the reentrant call, only one rrd_update at a time */
+static pthread_mutex_t rrd_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Errors where the storage may come back, and a write is worth trying again */
+static const int again_errors[] = {
+    EAGAIN, EINTR, EIO, ENOSPC, ENFILE, EMFILE, ENOLCK, EROFS, ETIMEDOUT,
+#ifdef EDQUOT
+    EDQUOT,
+#endif
+#ifdef ESTALE
+    ESTALE,
+#endif
+};
+
+static int write_again(int error)
+{
+    int i;
+
+    for(i = 0; i < countof(again_errors); ++i)
+    {
+        if(error == again_errors[i])
+            return WRITE_AGAIN;
+    }
+
+    return -1;
+}
+
+/*
+ * All librrd gives us is a message. It says "could not lock RRD" when
+ * another process has the file locked, and where a system call failed
+ * it ends with strerror(), as in "opening 'x.rrd': No space left on
+ * device". Those are the messages matched here.
+ */
+static int rrd_again(const char* error)
+{
+    int i;
+
+    if(strstr(error, "lock"))
+        return WRITE_AGAIN;
+
+    for(i = 0; i < countof(again_errors); ++i)
+    {
+        if(strstr(error, strerror(again_errors[i])))
+            return WRITE_AGAIN;
+    }
+
+    return -1;
+}
+
+/* Forward declaration */
+static int queue_cached(write_job* job);
+
+/* The data for an rrd job is one or more updates, a line each */
+static int write_rrd(write_job* job)
+{
+    const char** argv;
+    const char** updates;
+    char error[256];
+    char* values;
+    char* p;
+    int n_values = 1;
+    int n, r;
+
+    /* Updates go to rrdcached when it's in use, unless it gave them back */
+    if(!job->direct && queue_cached(job) == 0)
+        return 0;
+
+    for(p = job->data; *p; ++p)
+    {
+        if(*p == '\n')
+            ++n_values;
+    }
+
+    values = strdup(job->data);
+    argv = (const char**)calloc(n_values + 4, sizeof(char*));
+    if(!values || !argv)
+    {
+        log_errorx ("out of memory");
+        free(values);
+        free(argv);
+        return -1;
+    }
+
+    /* Room for the rrd_update arguments before the updates */
+    updates = argv + 4;
+    for(p = values, n = 0; p; )
+        updates[n++] = strsep(&p, "\n");
+
+#ifdef HAVE_RRD_UPDATE_R
+    rrd_clear_error();
+    r = rrd_update_r(job->path, job->template, n, updates);
+    if(r != 0)
+        strlcpy(error, rrd_get_error(), sizeof(error));
+#else
+    pthread_mutex_lock(&rrd_mutex);
+
+        /* Always have to clear before calling rrdtool. klunky :( */
+        optind = 0;
+        opterr = 0;
+
+        argv[0] = "rrdupdate";
+        argv[1] = job->path;
+        argv[2] = "-t";
+        argv[3] = job->template;
+
+        rrd_clear_error();
+        r = rrd_update(n + 4, (char**)argv);
+
+        /* The error is shared, another thread may be along once unlocked */
+        if(r != 0)
+            strlcpy(error, rrd_get_error(), sizeof(error));
+
+    pthread_mutex_unlock(&rrd_mutex);
+#endif
+
+    if(r != 0)
+    {
+        log_errorx ("couldn't update rrd file: %s: %s", job->path, error);
+        r = rrd_again(error);
+    }
+
+    free(values);
+    free(argv);
+    return r;
+}
+
+static void raw_unlink(writer* wr, raw_file* file)
+{
+    if(file->prev)
+        file->prev->next = file->next;
+    else
+        wr->raw_first = file->next;
+    if(file->next)
+        file->next->prev = file->prev;
+    else
+        wr->raw_last = file->prev;
+}
+
+static void raw_close(writer* wr, raw_file* file)
+{
+    raw_unlink(wr, file);
+    hsh_rem(wr->raw_files, file->path, -1);
+    wr->n_raw--;
+
+    if(file->bin)
+    {
+        if(rawbin_close(file->bin) < 0)
+            log_error("couldn't write to raw file: %s", file->path);
+    }
+    else if(fclose(file->fp) == EOF)
+    {
+        log_error("couldn't write to raw file: %s", file->path);
+    }
+
+    free(file->path);
+    free(file);
+}
+
+static int raw_fopen(raw_file* file, int binary)
+{
+    char errmsg[256];
+    char *parent;
+    int retried = 0;
+    int error;
+
+    for(;;)
+    {
+        if(binary)
+        {
+            file->bin = rawbin_open(file->path, errmsg, sizeof(errmsg));
+            if(file->bin)
+                return 0;
+        }
+        else
+        {
+            file->fp = fopen(file->path, "a");
+            if(file->fp)
+                return 0;
+            strlcpy(errmsg, strerror(errno), sizeof(errmsg));
+        }
+
+        if(errno != ENOENT || retried)
+            break;
+
+        /* Only look at the directories when the file isn't there */
+        if((parent = get_parent(file->path)) == NULL)
+            return -1;
+        if((mkdir_p(parent, 0777) == -1) && (errno != EEXIST))
+        {
+            error = errno;
+            log_errorx("couldn't create directory for raw file: %s : %s",
+                        file->path,  strerror(error));
+            free(parent);
+            errno = error;
+            return -1;
+        }
+        free(parent);
+        retried = 1;
+    }
+
+    error = errno;
+    log_errorx("couldn't open raw file: %s for writing : %s",
+                file->path, errmsg);
+    errno = error;
+    return -1;
+}
+
+/* Get an open handle for the raw file, most recently used go first */
+static raw_file* raw_open(writer* wr, const char* path, int binary)
+{
+    raw_file* file;
+
+    if(!wr->raw_files)
+    {
+        wr->raw_files = hsh_create();
+        if(!wr->raw_files)
+        {
+            log_errorx("out of memory");
+            return NULL;
+        }
+    }
+
+    file = (raw_file*)hsh_get(wr->raw_files, path, -1);
+    if(file)
+    {
+        raw_unlink(wr, file);
+    }
+    else
+    {
+        file = (raw_file*)calloc(1, sizeof(raw_file));
+        if(!file || !(file->path = strdup(path)))
+        {
+            log_errorx("out of memory");
+            free(file);
+            return NULL;
+        }
+
+        if(raw_fopen(file, binary) < 0)
+        {
+            free(file->path);
+            free(file);
+            return NULL;
+        }
+
+        if(!hsh_set(wr->raw_files, file->path, -1, file))
+        {
+            log_errorx("out of memory");
+            if(file->bin)
+                rawbin_close(file->bin);
+            else
+                fclose(file->fp);
+            free(file->path);
+            free(file);
+            return NULL;
+        }
+
+        wr->n_raw++;
+
+        /* Too many open, close the least used */
+        if(wr->n_raw > MAX_RAW_FILES && wr->raw_last)
+            raw_close(wr, wr->raw_last);
+    }
+
+    file->prev = NULL;
+    file->next = wr->raw_first;
+    if(wr->raw_first)
+        wr->raw_first->prev = file;
+    else
+        wr->raw_last = file;
+    wr->raw_first = file;
+
+    return file;
+}
+
+/* Binary raw files get the same line as the text ones */
+/* A time in seconds, with up to three decimals, in milliseconds */
+static int64_t parse_time(const char* str)
+{
+    int64_t when;
+    char* end;
+    int i;
+
+    when = strtoll(str, &end, 10) * 1000;
+    if(*end == '.')
+    {
+        for(i = 100, ++end; i && isdigit(*end); i /= 10, ++end)
+            when += (*end - '0') * i;
+    }
+
+    return when;
+}
+
+static int write_bin(raw_file* file, char* line)
+{
+    rawbin_value value;
+    char* field;
+    char* val;
+    char* end;
+    int64_t when;
+
+    when = parse_time(strsep(&line, "\t"));
+    field = strsep(&line, "\t");
+    val = strsep(&line, "\n");
+    if(!field || !val)
+        return 0;
+
+    value.type = RAWBIN_UNSET;
+    if(val[0])
+    {
+        value.type = RAWBIN_INT;
+        value.v.i_value = strtoll(val, &end, 10);
+        if(*end)
+        {
+            value.type = RAWBIN_FLOAT;
+            value.v.f_value = strtod(val, NULL);
+        }
+    }
+
+    return rawbin_add(file->bin, field, when, &value);
+}
+
+static int write_raw(writer* wr, write_job* job)
+{
+    raw_file* file;
+    int r;
+
+    if(!(file = raw_open(wr, job->path, job->type == WRITE_BIN)))
+        return write_again(errno);
+
+    if(file->bin)
+        r = write_bin(file, job->data);
+    else
+        r = (fputs(job->data, file->fp) == EOF) ? -1 : 0;
+
+    file->used = time(NULL);
+    wr->raw_dirty = 1;
+
+    /* Part of it may be written, so not worth trying again */
+    if(r < 0)
+        log_error("couldn't write to raw file: %s", job->path);
+
+    return r;
+}
+
+/* Write out what's buffered, and close files that aren't used any more */
+static void raw_flush(writer* wr)
+{
+    raw_file* file;
+    raw_file* next;
+    time_t now = time(NULL);
+
+    for(file = wr->raw_first; file; file = next)
+    {
+        next = file->next;
+
+        /* Binary files stay open to fill their blocks */
+        if(file->bin)
+        {
+            if(now - file->used >= BIN_BLOCK_AGE)
+                raw_close(wr, file);
+            else if(rawbin_flush(file->bin, (now - BIN_BLOCK_AGE) * 1000LL) < 0)
+                log_error("couldn't write to raw file: %s", file->path);
+        }
+        else
+        {
+            if(now - file->used >= RAW_IDLE)
+                raw_close(wr, file);
+            else if(fflush(file->fp) == EOF)
+                log_error("couldn't write to raw file: %s", file->path);
+        }
+    }
+
+    wr->raw_dirty = 0;
+
+    /* Everything written so far is out of the spool's hands */
+    pthread_mutex_lock(&writer_mutex);
+        wr->dirty = 0;
+    pthread_mutex_unlock(&writer_mutex);
+}
+
+static void raw_uninit(writer* wr)
+{
+    while(wr->raw_first)
+        raw_close(wr, wr->raw_first);
+
+    if(wr->raw_files)
+        hsh_free(wr->raw_files);
+    wr->raw_files = NULL;
+}
+
+static int write_job_run(writer* wr, write_job* job)
+{
+    if(job->type == WRITE_RRD)
+        return write_rrd(job);
+    else
+        return write_raw(wr, job);
+}
+
+/* The job and its strings in one block */
+static write_job* make_job(int type, const char* path, const char* template,
+                           const char* data)
+{
+    write_job* job;
+    size_t plen, tlen, dlen;
+
+    plen = strlen(path) + 1;
+    tlen = template ? strlen(template) + 1 : 0;
+    dlen = strlen(data) + 1;
+
+    job = (write_job*)calloc(1, sizeof(write_job) + plen + tlen + dlen);
+    if(!job)
+    {
+        log_errorx ("out of memory");
+        return NULL;
+    }
+
+    job->type = type;
+    job->path = (char*)(job + 1);
+    memcpy(job->path, path, plen);
+    if(template)
+    {
+        job->template = job->path + plen;
+        memcpy(job->template, template, tlen);
+    }
+    job->data = job->path + plen + tlen;
+    memcpy(job->data, data, dlen);
+
+    return job;
+}
+
+/*
+ * Spooled jobs that fail in a way that might clear up are tried again,
+ * waiting a little longer each time. The writer's other jobs wait too,
+ * so they stay in order, and pile up in the spool meanwhile.
+ */
+static int writer_run(writer* wr, write_job* job)
+{
+    struct timespec deadline;
+    int wait = 1;
+    int quit = 0;
+    int r;
+
+    for(;;)
+    {
+        r = write_job_run(wr, job);
+        if(r != WRITE_AGAIN || !job->seq)
+            break;
+
+        if(wait == 1)
+            log_warnx("will try writing again until it works: %s", job->path);
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wait;
+
+        pthread_mutex_lock(&writer_mutex);
+
+            while(!writers_quit &&
+                  pthread_cond_timedwait(&wr->queued, &writer_mutex, &deadline) != ETIMEDOUT)
+                ;
+            quit = writers_quit;
+
+        pthread_mutex_unlock(&writer_mutex);
+
+        /* Still in the spool for next time */
+        if(quit)
+            break;
+
+        wait = MIN(wait * 2, MAX_RETRY_WAIT);
+    }
+
+    if(wait > 1 && !quit && r == 0)
+        log_info("writing works again: %s", job->path);
+
+    pthread_mutex_lock(&writer_mutex);
+
+        wr->busy = 0;
+        if(quit && job->seq && (!wr->left || job->seq < wr->left))
+            wr->left = job->seq;
+
+        /* Raw files are only done when flushed */
+        if(r == 0 && job->seq && job->type != WRITE_RRD && !wr->dirty)
+            wr->dirty = job->seq;
+
+    pthread_mutex_unlock(&writer_mutex);
+
+    free(job);
+    return r;
+}
+
+static unsigned int path_hash(const char* path)
+{
+    unsigned int h = 0;
+    while(*path)
+        h = h * 33 + (unsigned char)*(path++);
+    return h;
+}
+
+/* Write this writer's jobs from the spool, up to the given one */
+static void writer_replay(writer* wr, uint64_t until)
+{
+    rb_spool_record rec;
+    write_job* job;
+    int index = wr - writers;
+    int quit = 0;
+    int r;
+
+    if(!wr->reader)
+        wr->reader = rb_spool_open(wr->spill);
+    if(!wr->reader)
+    {
+        log_errorx("out of memory");
+        return;
+    }
+
+    while(!quit && (r = rb_spool_read(wr->reader, until, &rec)) > 0)
+    {
+        job = NULL;
+        if(path_hash(rec.path) % n_writers == index)
+            job = make_job(rec.type, rec.path, rec.template, rec.data);
+
+        pthread_mutex_lock(&writer_mutex);
+            if(job)
+                wr->busy = job->seq = rec.seq;
+            wr->spill = rec.seq + 1;
+        pthread_mutex_unlock(&writer_mutex);
+
+        if(job)
+            writer_run(wr, job);
+
+        pthread_mutex_lock(&writer_mutex);
+            quit = writers_quit;
+        pthread_mutex_unlock(&writer_mutex);
+    }
+
+    if(quit)
+        return;
+
+    /* Rather than trying the same thing over and over */
+    if(r < 0)
+    {
+        log_errorx("couldn't replay writes %llu to %llu from the spool",
+                   (unsigned long long)wr->spill, (unsigned long long)until);
+        rb_spool_close(wr->reader);
+        wr->reader = rb_spool_open(until + 1);
+    }
+
+    pthread_mutex_lock(&writer_mutex);
+
+        /* Caught up, new jobs can be queued again */
+        wr->spill = until + 1;
+        if(spool_last == until)
+        {
+            wr->spilled = 0;
+            rb_spool_close(wr->reader);
+            wr->reader = NULL;
+            log_info("rrd writer %d caught up with the spool", index);
+        }
+
+    pthread_mutex_unlock(&writer_mutex);
+}
+
+/* Forward declarations */
+static void behind_init(int samples, int secs);
+static void behind_uninit();
+static void raw_paths_init();
+static void raw_paths_uninit();
+
+static void* writer_thread(void* arg)
+{
+    writer* wr = (writer*)arg;
+    write_job* job;
+    uint64_t until;
+    int replay;
+
+    for(;;)
+    {
+        pthread_mutex_lock(&writer_mutex);
+
+            /* Drain the queue before quitting */
+            while(!wr->first && !writers_quit && !wr->raw_dirty &&
+                  !(wr->spilled && spool_last >= wr->spill))
+                pthread_cond_wait(&wr->queued, &writer_mutex);
+
+            job = wr->first;
+            if(job)
+            {
+                wr->first = job->next;
+                if(!wr->first)
+                    wr->last = NULL;
+                wr->depth--;
+                wr->written++;
+                wr->busy = job->seq;
+                pthread_cond_signal(&wr->space);
+            }
+
+            /* Jobs left in the spool come after the queued ones */
+            replay = !job && wr->spilled && !writers_quit && spool_last >= wr->spill;
+            until = spool_last;
+
+        pthread_mutex_unlock(&writer_mutex);
+
+        if(job)
+            writer_run(wr, job);
+
+        else if(replay)
+            writer_replay(wr, until);
+
+        /* Nothing more queued, write out the raw files */
+        else if(wr->raw_dirty)
+            raw_flush(wr);
+
+        else
+            break;
+    }
+
+    raw_uninit(wr);
+    rb_spool_close(wr->reader);
+    wr->reader = NULL;
+    return NULL;
+}
+
+static int queue_cached(write_job* job)
+{
+    char* p;
+    char* t;
+
+    /* Either all the updates go to rrdcached or none do */
+    for(p = job->data; p; p = t)
+    {
+        t = strchr(p, '\n');
+        if(t)
+            *t = 0;
+        if(rb_cached_update(job->path, job->template, p, job->seq) < 0)
+        {
+            ASSERT(p == job->data);
+            if(t)
+                *t = '\n';
+            return -1;
+        }
+        if(t)
+            *(t++) = '\n';
+    }
+
+    return 0;
+}
+
+/* Returns zero when the write was done, queued or spooled */
+static int queue_write(int type, const char* path, const char* template, const char* data)
+{
+    write_job* job;
+    writer* wr;
+    uint64_t seq = 0;
+    int ret = 0;
+
+    job = make_job(type, path, template, data);
+    if(!job)
+        return -1;
+
+    /* No writer threads, so write right here */
+    if(!n_writers)
+        return writer_run(&sync_writer, job) == 0 ? 0 : -1;
+
+    /* Into the spool before anything else */
+    if(spool_on)
+        seq = job->seq = rb_spool_append(type, path, template, data);
+
+    wr = &writers[path_hash(path) % n_writers];
+
+    pthread_mutex_lock(&writer_mutex);
+
+        if(seq)
+            spool_last = seq;
+
+        /* Rather than wait for a writer, leave its jobs in the spool */
+        if(wr->spilled || (seq && wr->depth >= MAX_QUEUED))
+        {
+            if(!wr->spilled)
+            {
+                log_warnx("rrd writer %d is behind, leaving writes in the spool",
+                          (int)(wr - writers));
+                wr->spilled = 1;
+                wr->spill = seq;
+            }
+
+            if(!seq)
+            {
+                log_errorx("couldn't spool write, dropping it: %s", path);
+                ret = -1;
+            }
+
+            free(job);
+            job = NULL;
+        }
+
+        /* The writers are behind, wait for them to catch up */
+        else if(wr->depth >= MAX_QUEUED)
+        {
+            if(!writers_waited)
+                log_warnx("rrd writers are behind, waiting for them");
+            writers_waited++;
+            while(wr->depth >= MAX_QUEUED)
+                pthread_cond_wait(&wr->space, &writer_mutex);
+        }
+
+        if(job)
+        {
+            if(wr->last)
+                wr->last->next = job;
+            else
+                wr->first = job;
+            wr->last = job;
+
+            wr->depth++;
+            if(wr->depth > wr->max_depth)
+                wr->max_depth = wr->depth;
+        }
+
+        pthread_cond_signal(&wr->queued);
+
+    pthread_mutex_unlock(&writer_mutex);
+
+    return ret;
+}
+
+/*
+ * Updates that rrdcached couldn't take go back to the writer for the
+ * file, and are written with librrd. They keep their place in the
+ * spool. This never waits for space, as the writers may be waiting
+ * for rrdcached.
+ */
+void rb_rrd_requeue(const char* path, const char* template, const char* values,
+                    uint64_t seq)
+{
+    write_job* job;
+    writer* wr = NULL;
+
+    job = make_job(WRITE_RRD, path, template, values);
+    if(!job)
+        return;
+
+    job->seq = seq;
+    job->direct = 1;
+
+    pthread_mutex_lock(&writer_mutex);
+
+        if(n_writers && !writers_quit)
+        {
+            wr = &writers[path_hash(path) % n_writers];
+            if(wr->last)
+                wr->last->next = job;
+            else
+                wr->first = job;
+            wr->last = job;
+            wr->depth++;
+            pthread_cond_signal(&wr->queued);
+        }
+
+    pthread_mutex_unlock(&writer_mutex);
+
+    /* No writer threads, or they've stopped */
+    if(!wr)
+    {
+        write_rrd(job);
+        free(job);
+    }
+}
+
+/* The first spooled job that a writer hasn't done */
+static uint64_t writer_pending(writer* wr)
+{
+    uint64_t pending = UINT64_MAX;
+    write_job* job;
+
+    if(wr->busy)
+        pending = wr->busy;
+    if(wr->left && wr->left < pending)
+        pending = wr->left;
+    if(wr->dirty && wr->dirty < pending)
+        pending = wr->dirty;
+    if(wr->spilled && wr->spill < pending)
+        pending = wr->spill;
+
+    /* Not in order, as rrdcached gives back updates */
+    for(job = wr->first; job; job = job->next)
+    {
+        if(job->seq && job->seq < pending)
+            pending = job->seq;
+    }
+
+    return pending;
+}
+
+/* Let the spool know how far all the writers have got */
+static void spool_done()
+{
+    uint64_t done = UINT64_MAX;
+    uint64_t pending;
+    int i;
+
+    pthread_mutex_lock(&writer_mutex);
+
+        for(i = 0; i < n_writers; ++i)
+        {
+            pending = writer_pending(&writers[i]);
+            if(pending < done)
+                done = pending;
+        }
+
+        /*
+         * And the updates rrdcached hasn't taken yet. An update is still
+         * busy in its writer until rrdcached has it, and is back in the
+         * writer before rrdcached lets go, so none slip by here.
+         */
+        pending = rb_cached_pending();
+        if(pending < done)
+            done = pending;
+
+        if(done == UINT64_MAX)
+            done = spool_last;
+        else
+            done--;
+
+    pthread_mutex_unlock(&writer_mutex);
+
+    rb_spool_done(done);
+}
+
+static int spool_timer(mstime when, void* arg)
+{
+    spool_done();
+    return 1;
+}
+
+static int writer_stats(mstime when, void* arg)
+{
+    unsigned int written = 0;
+    unsigned int waited;
+    int depth = 0;
+    int max_depth = 0;
+    int i;
+
+    pthread_mutex_lock(&writer_mutex);
+
+        for(i = 0; i < n_writers; ++i)
+        {
+            depth += writers[i].depth;
+            written += writers[i].written;
+            if(writers[i].max_depth > max_depth)
+                max_depth = writers[i].max_depth;
+            writers[i].written = 0;
+            writers[i].max_depth = writers[i].depth;
+        }
+
+        waited = writers_waited;
+        writers_waited = 0;
+
+    pthread_mutex_unlock(&writer_mutex);
+
+    /* Only make noise when the writers are falling behind */
+    if(waited || max_depth > MAX_QUEUED / 2)
+        log_warnx("rrd writers: %u written, %d queued, %d most queued, waited %u times",
+                  written, depth, max_depth, waited);
+    else
+        log_debug("rrd writers: %u written, %d queued, %d most queued",
+                  written, depth, max_depth);
+
+    return 1;
+}
+
+static void spool_init()
+{
+    uint64_t from;
+    int i;
+
+    from = rb_spool_init(g_state.spool, (size_t)g_state.spool_size * 1024 * 1024,
+                         g_state.spool_sync);
+    spool_on = 1;
+
+    pthread_mutex_lock(&writer_mutex);
+
+        /* All the writers start with what's left in the spool */
+        spool_last = rb_spool_last();
+        for(i = 0; from <= spool_last && i < n_writers; ++i)
+        {
+            writers[i].spilled = 1;
+            writers[i].spill = from;
+            pthread_cond_signal(&writers[i].queued);
+        }
+
+    pthread_mutex_unlock(&writer_mutex);
+
+    if(server_timer(SPOOL_INTERVAL, spool_timer, NULL) == -1)
+        errx(1, "couldn't setup spool timer");
+}
+
+void rb_rrd_init(int threads, int samples, int secs)
+{
+    int i, r;
+
+    ASSERT(!writers);
+
+    /* Before the writers, which may start replaying the spool */
+    rb_cached_init(g_state.rrdcached);
+
+    behind_init(samples, secs);
+    raw_paths_init();
+
+    if(threads <= 0)
+        return;
+
+    writers = (writer*)xcalloc(sizeof(writer) * threads);
+    writers_quit = 0;
+
+    for(i = 0; i < threads; ++i)
+    {
+        pthread_cond_init(&writers[i].queued, NULL);
+        pthread_cond_init(&writers[i].space, NULL);
+
+        r = pthread_create(&writers[i].thread, NULL, writer_thread, &writers[i]);
+        if(r != 0)
+        {
+            log_errorx("couldn't start rrd writer thread: %s", strerror(r));
+            break;
+        }
+
+        n_writers++;
+    }
+
+    /* Write on the main thread when no threads could start */
+    if(!n_writers)
+    {
+        if(g_state.spool)
+            log_errorx("no rrd writer threads, not using the spool");
+        free(writers);
+        writers = NULL;
+        return;
+    }
+
+    if(server_timer(STATS_INTERVAL, writer_stats, NULL) == -1)
+        log_errorx("couldn't setup rrd writer stats timer");
+
+    if(g_state.spool)
+        spool_init();
+}
+
+void rb_rrd_uninit()
+{
+    int i;
+
+    /* Write out everything held back */
+    behind_uninit();
+    raw_uninit(&sync_writer);
+    raw_paths_uninit();
+
+    if(!writers)
+    {
+        rb_cached_uninit();
+        return;
+    }
+
+    /* The writers finish what's queued, and then quit */
+    pthread_mutex_lock(&writer_mutex);
+
+        writers_quit = 1;
+        for(i = 0; i < n_writers; ++i)
+            pthread_cond_signal(&writers[i].queued);
+
+    pthread_mutex_unlock(&writer_mutex);
+
+    for(i = 0; i < n_writers; ++i)
+    {
+        pthread_join(writers[i].thread, NULL);
+        pthread_cond_destroy(&writers[i].queued);
+        pthread_cond_destroy(&writers[i].space);
+        ASSERT(!writers[i].first);
+    }
+
+    /* After the writers, which send it updates, and before the spool */
+    rb_cached_uninit();
+
+    if(spool_on)
+    {
+        spool_done();
+        rb_spool_uninit();
+        spool_on = 0;
+    }
+
+    free(writers);
+    writers = NULL;
+    n_writers = 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * WRITE BEHIND
+ */
+
+/*
+ * With short intervals most of the time in rrd_update goes to opening,
+ * locking and reading the header of the file. When write behind is on,
+ * updates for each RRD file are held back and then written together
+ * in one rrd_update call. All of this happens on the main thread.
+ */
+
+/* The most updates we'll hold back for a file */
+#define MAX_BEHIND      512
+
+/* How often to look for updates that have waited long enough */
+#define BEHIND_INTERVAL 1000
+
+typedef struct _behind
+{
+    char* path;
+    char* template;
+    char* data;                     /* Updates, a line each */
+    size_t len;                     /* Length of data */
+    size_t alloc;                   /* Allocated size of data */
+    int count;                      /* Number of updates */
+    mstime first;                   /* When the first update was held */
+    struct _behind* next;
+}
+behind;
+
+static hsh_t* behind_by_path = NULL;
+static behind* behind_list = NULL;
+static int behind_samples = 0;
+static mstime behind_time = 0;
+
+/* Set from a signal handler to flush everything held back */
+static volatile sig_atomic_t behind_flush_all = 0;
+
+static void behind_write(behind* bh)
+{
+    hsh_rem(behind_by_path, bh->path, -1);
+
+    log_debug("writing %d held back updates: %s", bh->count, bh->path);
+    queue_write(WRITE_RRD, bh->path, bh->template, bh->data);
+
+    free(bh->path);
+    free(bh->template);
+    free(bh->data);
+    free(bh);
+}
+
+static void behind_flush(int all)
+{
+    behind** prev;
+    behind* bh;
+    mstime now = server_get_time();
+
+    for(prev = &behind_list; *prev; )
+    {
+        bh = *prev;
+        if(all || now - bh->first >= behind_time)
+        {
+            *prev = bh->next;
+            behind_write(bh);
+        }
+        else
+        {
+            prev = &bh->next;
+        }
+    }
+}
+
+static int behind_timer(mstime when, void* arg)
 {
-    char buf[MAX_NUMLEN];
-    const char* argv[5];
-    char* template;
-    char* items;
-    int r, tlen, ilen;
-    rb_item *item;
-    file_path *rrdpath;
-    file_path *rawpath;
+    int all = behind_flush_all;
+    behind_flush_all = 0;
+    behind_flush(all);
+    return 1;
+}
 
-    if(!poll->items)
+static void behind_remove(behind* bh)
+{
+    behind** prev;
+
+    for(prev = &behind_list; *prev; prev = &(*prev)->next)
+    {
+        if(*prev == bh)
+        {
+            *prev = bh->next;
+            break;
+        }
+    }
+
+    behind_write(bh);
+}
+
+static void queue_behind(const char* path, const char* template, const char* data)
+{
+    behind* bh;
+    size_t len;
+    char* p;
+
+    if(!behind_samples)
+    {
+        queue_write(WRITE_RRD, path, template, data);
         return;
+    }
 
-    tlen = 0;
-    ilen = MAX_NUMLEN + 1; /* Timestamp ':' */
+    bh = (behind*)hsh_get(behind_by_path, path, -1);
 
-    for(item = poll->items; item; item = item->next)
+    /* Updates with different fields can't go in one call */
+    if(bh && strcmp(bh->template, template) != 0)
     {
-        tlen += strlen(item->field) + 1; /* Field plus ':' or '\0' */
-        ilen += MAX_NUMLEN + 1;          /* Value plus ':' or '\0' */
+        behind_remove(bh);
+        bh = NULL;
     }
 
-    template = (char*)calloc(tlen, sizeof(char));
-    items = (char*)calloc(ilen, sizeof(char));
+    if(!bh)
+    {
+        bh = (behind*)calloc(1, sizeof(behind));
+        if(bh)
+        {
+            bh->path = strdup(path);
+            bh->template = strdup(template);
+        }
+        if(!bh || !bh->path || !bh->template ||
+           !hsh_set(behind_by_path, bh->path, -1, bh))
+        {
+            log_errorx("out of memory");
+            if(bh)
+            {
+                free(bh->path);
+                free(bh->template);
+                free(bh);
+            }
+            queue_write(WRITE_RRD, path, template, data);
+            return;
+        }
+
+        bh->first = server_get_time();
+        bh->next = behind_list;
+        behind_list = bh;
+    }
 
-    if(!template || !items)
+    len = strlen(data);
+    if(bh->len + len + 2 > bh->alloc)
     {
-        if(items)
-            free(items);
-        if(template)
-            free(template);
-        log_errorx ("out of memory");
+        p = (char*)realloc(bh->data, MAX(bh->alloc * 2, bh->len + len + 2));
+        if(!p)
+        {
+            log_errorx("out of memory");
+            behind_remove(bh);
+            queue_write(WRITE_RRD, path, template, data);
+            return;
+        }
+        bh->data = p;
+        bh->alloc = MAX(bh->alloc * 2, bh->len + len + 2);
+    }
+
+    if(bh->count)
+        bh->data[bh->len++] = '\n';
+    memcpy(bh->data + bh->len, data, len + 1);
+    bh->len += len;
+    bh->count++;
+
+    if(bh->count >= behind_samples)
+        behind_remove(bh);
+}
+
+void rb_rrd_flush()
+{
+    behind_flush_all = 1;
+}
+
+static void behind_init(int samples, int secs)
+{
+    if(samples <= 1)
+        return;
+
+    behind_samples = MIN(samples, MAX_BEHIND);
+    behind_time = (mstime)secs * 1000;
+
+    behind_by_path = hsh_create();
+    if(!behind_by_path)
+        errx(1, "out of memory");
+
+    if(server_timer(BEHIND_INTERVAL, behind_timer, NULL) == -1)
+        errx(1, "couldn't setup write behind timer");
+}
+
+static void behind_uninit()
+{
+    if(!behind_by_path)
         return;
+
+    behind_flush(1);
+    hsh_free(behind_by_path);
+    behind_by_path = NULL;
+    behind_samples = 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * RAW PATHS
+ */
+
+/*
+ * Raw file paths are strftime formats. Rather than formatting the path
+ * for every value, we work out when the format next changes and keep
+ * using the same path until then.
+ */
+
+typedef struct _raw_path
+{
+    char* format;
+    char path[MAXPATHLEN];
+    int period;                     /* Seconds the format is good for */
+    time_t from;
+    time_t until;
+}
+raw_path;
+
+static hsh_t* raw_paths = NULL;
+
+/* The smallest unit of time in a strftime format, 0 if it has none */
+static int raw_period(const char* format)
+{
+    const char* p;
+    int period = 0;
+    int unit;
+
+    for(p = strchr(format, '%'); p; p = strchr(p, '%'))
+    {
+        /* Skip the flags, width and modifiers */
+        for(++p; *p && strchr("_-0^#EO123456789", *p); ++p)
+            ;
+
+        switch(*p)
+        {
+        case 0:
+            return period;
+        case '%':
+        case 'n':
+        case 't':
+            unit = 0;
+            break;
+        case 'M':
+        case 'R':
+            unit = 60;
+            break;
+        case 'H':
+        case 'I':
+        case 'k':
+        case 'l':
+        case 'p':
+        case 'P':
+            unit = 3600;
+            break;
+        case 'a': case 'A': case 'b': case 'B': case 'C': case 'd':
+        case 'D': case 'e': case 'F': case 'g': case 'G': case 'h':
+        case 'j': case 'm': case 'u': case 'U': case 'V': case 'w':
+        case 'W': case 'x': case 'y': case 'Y': case 'z': case 'Z':
+            unit = 86400;
+            break;
+        default:
+            unit = 1;
+            break;
+        }
+
+        if(unit && (!period || unit < period))
+            period = unit;
+        ++p;
     }
 
-    /* Put in the right time */
-    snprintf(items, ilen, "%" PRId64 ":", (poll->last_polled / 1000L));
+    return period;
+}
 
-    /* Build the rest of the arguments */
-    for(item = poll->items; item; item = item->next)
+/* When the path formatted from tm next changes */
+static time_t raw_until(int period, time_t when, struct tm* tm)
+{
+    struct tm next;
+    time_t t;
+
+    switch(period)
     {
-        if(item != poll->items)
+    case 0:
+        return (time_t)LONG_MAX;
+    case 60:
+        return when + 60 - tm->tm_sec;
+    case 3600:
+        return when + 3600 - (tm->tm_min * 60) - tm->tm_sec;
+    case 86400:
+        /* Days aren't always the same length */
+        memcpy(&next, tm, sizeof(next));
+        next.tm_mday++;
+        next.tm_hour = next.tm_min = next.tm_sec = 0;
+        next.tm_isdst = -1;
+        t = mktime(&next);
+        return t > when ? t : when + 1;
+    default:
+        return when + 1;
+    }
+}
+
+static const char* raw_expand(const char* format, time_t when)
+{
+    raw_path* rp;
+    struct tm tm;
+
+    rp = (raw_path*)hsh_get(raw_paths, format, -1);
+    if(rp && when >= rp->from && when < rp->until)
+        return rp->path;
+
+    if(!rp)
+    {
+        rp = (raw_path*)calloc(1, sizeof(raw_path));
+        if(!rp || !(rp->format = strdup(format)) ||
+           !hsh_set(raw_paths, rp->format, -1, rp))
         {
-            strlcat(template, ":", tlen);
-            strlcat(items, ":", ilen);
+            log_errorx("out of memory");
+            if(rp)
+                free(rp->format);
+            free(rp);
+            return NULL;
         }
+        rp->period = raw_period(format);
+    }
+
+    rp->from = rp->until = 0;
+    if(!localtime_r(&when, &tm) ||
+       strftime(rp->path, sizeof(rp->path), format, &tm) == 0)
+    {
+        log_errorx("couldn't strftime the raw file path: %s for writting : %s",
+                    format, strerror(errno));
+        return NULL;
+    }
 
-        strlcat(template, item->field, tlen);
+    rp->from = when;
+    rp->until = raw_until(rp->period, when, &tm);
+    return rp->path;
+}
 
-        if(item->vtype == VALUE_UNSET)
-            strlcat(items, "U", ilen);
+static void raw_paths_init()
+{
+    raw_paths = hsh_create();
+    if(!raw_paths)
+        errx(1, "out of memory");
+}
+
+static void raw_paths_uninit()
+{
+    hsh_index_t* hi;
+    raw_path* rp;
+
+    if(!raw_paths)
+        return;
+
+    for(hi = hsh_first(raw_paths); hi; hi = hsh_next(hi))
+    {
+        rp = (raw_path*)hsh_this(hi, NULL, NULL);
+        free(rp->format);
+        free(rp);
+    }
+
+    hsh_free(raw_paths);
+    raw_paths = NULL;
+}
+
+/* -----------------------------------------------------------------------------
+ * CHANGED VALUES
+ *
+ * Raw paths with a heartbeat only get values that changed since they
+ * were last written, or that haven't been written for a heartbeat.
+ */
+
+typedef struct _raw_last
+{
+    rb_value v;
+    int vtype;
+    mstime when;                /* Zero when never written */
+}
+raw_last;
+
+typedef struct _raw_row
+{
+    struct asn_oid index;
+    raw_last last[1];           /* One for each item */
+}
+raw_row;
+
+static raw_last* raw_last_values(file_path* rawpath, rb_poller* poll, const rb_row* row)
+{
+    raw_row* rr;
+    size_t klen;
+
+    if(!row)
+    {
+        if(!rawpath->last)
+            rawpath->last = (raw_last*)xcalloc(sizeof(raw_last) * poll->n_items);
+        return rawpath->last;
+    }
+
+    if(!rawpath->last_rows)
+    {
+        rawpath->last_rows = hsh_create();
+        if(!rawpath->last_rows)
+            return NULL;
+    }
+
+    klen = row->index.len * sizeof(row->index.subs[0]);
+    rr = (raw_row*)hsh_get(rawpath->last_rows, row->index.subs, klen);
+    if(!rr)
+    {
+        rr = (raw_row*)xcalloc(sizeof(raw_row) + sizeof(raw_last) * (poll->n_items - 1));
+        rr->index = row->index;
+        if(!hsh_set(rawpath->last_rows, rr->index.subs, klen, rr))
+        {
+            free(rr);
+            return NULL;
+        }
+    }
+
+    return rr->last;
+}
+
+/* Whether to write the value, noting it down if so */
+static int raw_changed(raw_last* last, rb_item* item, mstime heartbeat)
+{
+    int same = 0;
+
+    if(last->vtype == item->vtype)
+    {
+        if(item->vtype == VALUE_REAL)
+            same = (last->v.i_value == item->v.i_value);
+        else if(item->vtype == VALUE_FLOAT)
+            same = (memcmp(&last->v.f_value, &item->v.f_value, sizeof(double)) == 0);
         else
+            same = 1;
+    }
+
+    if(same && last->when && item->last_polled >= last->when &&
+       item->last_polled - last->when < heartbeat)
+        return 0;
+
+    return 1;
+}
+
+/* Only once the value is on its way to the file */
+static void raw_written(raw_last* last, rb_item* item)
+{
+    last->v = item->v;
+    last->vtype = item->vtype;
+    last->when = item->last_polled;
+}
+
+void rb_rrd_forget(file_path* rawpath)
+{
+    hsh_index_t* hi;
+
+    free(rawpath->last);
+    rawpath->last = NULL;
+
+    if(rawpath->last_rows)
+    {
+        for(hi = hsh_first(rawpath->last_rows); hi; hi = hsh_next(hi))
+            free(hsh_this(hi, NULL, NULL));
+        hsh_free(rawpath->last_rows);
+        rawpath->last_rows = NULL;
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ * RRD UPDATES
+ */
+
+/* Fill in the row placeholders in the path of a table field */
+static const char* row_path(const char *path, const rb_row *row,
+                            char *buf, size_t len)
+{
+    char index[ASN_OIDSTRLEN];
+    const char *p, *t;
+
+    if(!row)
+        return path;
+
+    asn_oid2str_r(&row->index, index);
+    buf[0] = 0;
+
+    for(p = path; *p; p = t)
+    {
+        if(strncmp(p, "{index}", 7) == 0)
         {
-            if(item->vtype == VALUE_FLOAT)
-                snprintf(buf, MAX_NUMLEN, "%.4lf", item->v.f_value);
-            else
-                snprintf(buf, MAX_NUMLEN, "%" PRId64, item->v.i_value);
-            buf[MAX_NUMLEN - 1] = 0;
-            strlcat(items, buf, ilen);
+            strlcat(buf, index, len);
+            t = p + 7;
+        }
+        else if(strncmp(p, "{value}", 7) == 0)
+        {
+            strlcat(buf, row->value, len);
+            t = p + 7;
+        }
+        else
+        {
+            t = p + 1;
+            while(*t && *t != '{')
+                ++t;
+            strncat(buf, p, MIN((size_t)(t - p), len - strlen(buf) - 1));
         }
     }
 
-    /* Loop through all the attached rrd files */
-    for(rrdpath = poll->rrdlist; rrdpath; rrdpath = rrdpath->next)
+    return buf;
+}
+
+/* Write out a number without snprintf, returning the end */
+static char* format_int(char* p, int64_t value)
+{
+    char digits[24];
+    uint64_t v;
+    int n = 0;
+
+    v = (value < 0) ? -(uint64_t)value : (uint64_t)value;
+    do
     {
-        /* Always have to clear before calling rrdtool. klunky :( */
-        optind = 0;
-        opterr = 0;
+        digits[n++] = '0' + (v % 10);
+        v /= 10;
+    }
+    while(v);
 
-        argv[0] = "rrdupdate";
-        argv[1] = rrdpath->path;
-        argv[2] = "-t";
-        argv[3] = template;
-        argv[4] = items;
+    if(value < 0)
+        *(p++) = '-';
+    while(n)
+        *(p++) = digits[--n];
+
+    return p;
+}
 
-        log_debug ("updating RRD file: %s", rrdpath->path);
-        log_debug ("> template: %s", template);
-        log_debug ("> values: %s", items);
+/*
+ * Write out a time in seconds, with milliseconds for pollers with
+ * intervals that aren't whole seconds, returning the end
+ */
+static char* format_time(char* p, rb_poller* poll, mstime when)
+{
+    int ms;
 
-        rrd_clear_error();
-        r = rrd_update(5, (char**)argv);
+    p = format_int(p, when / 1000L);
+    if(poll->interval % 1000)
+    {
+        ms = when % 1000L;
+        *(p++) = '.';
+        *(p++) = '0' + ms / 100;
+        *(p++) = '0' + (ms / 10) % 10;
+        *(p++) = '0' + ms % 10;
+    }
 
-        if(r != 0)
-            log_errorx ("couldn't update rrd file: %s: %s",
-                        rrdpath->path, rrd_get_error());
+    return p;
+}
+
+/* Larger values (and NaN) go through snprintf */
+#define MAX_FAST_FLOAT  1e14
+
+/* The same as "%.4lf", returning the end */
+static char* format_float(char* p, double value)
+{
+    double whole, scaled, rounded, error, rest;
+    int frac, i;
+
+    if(!(value > -MAX_FAST_FLOAT && value < MAX_FAST_FLOAT))
+    {
+        i = snprintf(p, MAX_NUMLEN, "%.4lf", value);
+        return p + MIN(i, MAX_NUMLEN - 1);
+    }
+
+    /*
+     * Round the fraction the way printf does. The fma gives us what
+     * the multiply lost, so values close to halfway go the right way,
+     * and exactly halfway rounds to even.
+     */
+    whole = floor(fabs(value));
+    scaled = (fabs(value) - whole) * 10000.0;
+    error = fma(fabs(value) - whole, 10000.0, -scaled);
+    rounded = floor(scaled);
+    rest = scaled - rounded - 0.5;
+    if(rest > -error || (rest == -error && fmod(rounded, 2.0) != 0.0))
+        rounded += 1.0;
+
+    frac = (int)rounded;
+    if(frac >= 10000)
+    {
+        whole += 1.0;
+        frac -= 10000;
+    }
+
+    if(signbit(value))
+        *(p++) = '-';
+    p = format_int(p, (int64_t)whole);
+    *(p++) = '.';
+
+    for(i = 3; i >= 0; --i)
+    {
+        p[i] = '0' + (frac % 10);
+        frac /= 10;
+    }
+
+    return p + 4;
+}
+
+/* Build the update template once, and room to format the values in */
+void rb_rrd_prepare(rb_poller *poll)
+{
+    rb_item *item;
+    size_t len = 1;
+    size_t n;
+    char* p;
+
+    for(item = poll->items; item; item = item->next)
+        len += strlen(item->field) + 1;
+
+    p = poll->template = (char*)xcalloc(len);
+    for(item = poll->items; item; item = item->next)
+    {
+        if(item != poll->items)
+            *(p++) = ':';
+        n = strlen(item->field);
+        memcpy(p, item->field, n);
+        p += n;
+    }
+    *p = 0;
+
+    /* Timestamp and each value, plus ':' or '\0' */
+    poll->values = (char*)xcalloc((MAX_NUMLEN + 1) * (poll->n_items + 1));
+}
+
+void rb_rrd_update(rb_poller *poll, const rb_row *row)
+{
+    char rowbuf[MAXPATHLEN];
+    const char *rrd;
+    char buf[MAX_NUMLEN];
+    char* p;
+    rb_item *item;
+    file_path *rrdpath;
+    file_path *rawpath;
+    int i;
+
+    if(!poll->items)
+        return;
+
+    ASSERT(poll->template && poll->values);
+
+    /* Put in the right time, then the values */
+    p = format_time(poll->values, poll, poll->last_polled);
+
+    for(item = poll->items; item; item = item->next)
+    {
+        *(p++) = ':';
+
+        if(item->vtype == VALUE_UNSET)
+            *(p++) = 'U';
+        else if(item->vtype == VALUE_FLOAT)
+            p = format_float(p, item->v.f_value);
+        else
+            p = format_int(p, item->v.i_value);
     }
 
-    free(template);
-    free(items);
+    *p = 0;
+
+    /* Loop through all the attached rrd files */
+    for(rrdpath = poll->rrdlist; rrdpath; rrdpath = rrdpath->next)
+    {
+        rrd = row_path(rrdpath->path, row, rowbuf, sizeof(rowbuf));
+
+        log_debug ("updating RRD file: %s", rrd);
+        log_debug ("> template: %s", poll->template);
+        log_debug ("> values: %s", poll->values);
+
+        queue_behind(rrd, poll->template, poll->values);
+    }
 
     /* Loop through all the attached raw files */
     for(rawpath = poll->rawlist; rawpath; rawpath = rawpath->next) {
-        for(item = poll->items; item; item = item->next) {
-            char path[MAXPATHLEN];
-            char *parent = NULL;
-            FILE *fp;
-            struct tm *timeinfo;
+        const char* format = row_path(rawpath->path, row, rowbuf, sizeof(rowbuf));
+        raw_last* last = NULL;
+
+        if(rawpath->heartbeat)
+            last = raw_last_values(rawpath, poll, row);
+
+        for(item = poll->items, i = 0; item; item = item->next, ++i) {
+            const char* path;
+            char line[MAX_NUMLEN * 2 + 128];
+            char when[MAX_NUMLEN];
             time_t time;
-            size_t len;
+
+            /* Only changes, when we know what was written */
+            if(last && !raw_changed(&last[i], item, rawpath->heartbeat))
+                continue;
 
             /* time expects seconds */
             time = item->last_polled / 1000L;
-            timeinfo = localtime(&time);
-            len = strftime(path, sizeof(path), rawpath->path, timeinfo);
+            path = raw_expand(format, time);
 
-            if(len == 0)
-            {
-                log_errorx("couldn't strftime the raw file path: %s for writting : %s",
-                            rawpath->path, strerror(errno));
-                /* Try the next raw file */
+            /* Try the next raw file */
+            if(!path)
                 continue;
-            }
 
-            log_debug ("updating RAW file: %s -> %s", rawpath->path, path);
+            /* Item record for the raw file, binary ones keep all of a float */
+            if(item->vtype == VALUE_REAL)
+                *format_int(buf, item->v.i_value) = 0;
+            else if(item->vtype == VALUE_FLOAT && rawpath->binary)
+                snprintf(buf, MAX_NUMLEN, "%#.17g", item->v.f_value);
+            else if(item->vtype == VALUE_FLOAT)
+                *format_float(buf, item->v.f_value) = 0;
+            else
+                buf[0] = 0;
+            *format_time(when, poll, item->last_polled) = 0;
 
-            /* try to ensure directory exists */
-            if((parent = get_parent(path)) == NULL)
-                return;
-            if((mkdir_p(parent, 0777) == -1) && (errno != EEXIST))
-            {
-                log_errorx("couldn't create directory for raw file: %s : %s",
-                            path,  strerror(errno));
-                free(parent);
-                /* Try the next item */
-                continue;
-            }
-            free(parent);
-        
-            fp = fopen(path, "a");
-            if(fp == NULL)
+            /* A cut off line would run into the next one */
+            if(snprintf(line, sizeof(line), "%s\t%s\t%s\n", when,
+                        item->reference ? item->reference : item->field,
+                        buf) >= (int)sizeof(line))
             {
-                log_errorx("couldn't open raw file: %s for writing : %s",
-                            path,  strerror(errno));
-                /* Try the next item */
+                log_warnx("field name too long for raw file: %s", item->field);
                 continue;
             }
 
-            /* Write item record to raw file */
-            fprintf(fp, "%" PRId64 "\t", time);
-            if(item->reference)
-                fprintf(fp, "%s", item->reference);
-            else
-                fprintf(fp, "%s", item->field);
-            fprintf(fp, "\t");
-            if(item->vtype == VALUE_REAL)
-                fprintf(fp, "%" PRId64, item->v.i_value);
-            else if(item->vtype == VALUE_FLOAT)
-                fprintf(fp, "%.4lf", item->v.f_value);
-            fprintf(fp, "\n");
-
-            fclose(fp);
+            if(queue_write(rawpath->binary ? WRITE_BIN : WRITE_RAW, path, NULL, line) == 0 && last)
+                raw_written(&last[i], item);
         }
     }
+
+    if(poll->streamlist)
+        rb_stream_update(poll, row);
+
+    /* Without writer threads the raw files are written by now */
+    if(!n_writers && sync_writer.raw_dirty)
+        raw_flush(&sync_writer);
 }
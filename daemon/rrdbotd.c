@@ -45,6 +45,7 @@
 #include "snmp-engine.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <syslog.h>
@@ -61,6 +62,10 @@
 #define DEFAULT_WORK        "/var/db/rrdbot"
 #define DEFAULT_RETRIES     3
 #define DEFAULT_TIMEOUT     5
+#define DEFAULT_WRITERS     4
+#define DEFAULT_BEHIND_SECS 60
+#define DEFAULT_SPOOL_SIZE  64
+#define DEFAULT_HISTORY     360
 
 /* -----------------------------------------------------------------------------
  * GLOBALS
@@ -73,6 +78,9 @@ rb_state g_state;
 static int daemonized = 0;
 static int debug_level = LOG_ERR;
 
+/* SIGHUP writes to this, so the config is reloaded from the main loop */
+static int reload_pipe[2] = { -1, -1 };
+
 #include "mib/parse.h"
 
 #ifdef TEST
@@ -153,6 +161,9 @@ usage()
 {
     fprintf(stderr, "usage: rrdbotd [-M] [-c confdir] [-w workdir] [-m mibdir] \n");
     fprintf(stderr, "               [-d level] [-p pidfile] [-r retries] [-t timeout]\n");
+    fprintf(stderr, "               [-W writers] [-D rrdcached] [-B samples[:secs]]\n");
+    fprintf(stderr, "               [-S spooldir[:megabytes]] [-F sync]\n");
+    fprintf(stderr, "               [-L latestfile] [-H socket[:samples]]\n");
     fprintf(stderr, "       rrdbotd -V\n");
     exit(2);
 }
@@ -174,6 +185,32 @@ on_quit(int signal)
     server_stop();
 }
 
+static void
+on_flush(int signal)
+{
+    rb_rrd_flush();
+}
+
+static void
+on_reload(int signal)
+{
+    int erno = errno;
+    write(reload_pipe[1], "1", 1);
+    errno = erno;
+}
+
+static void
+reload_io(int fd, int type, void* arg)
+{
+    char buf[16];
+
+    /* Several signals are one reload */
+    while(read(fd, buf, sizeof(buf)) > 0)
+        ;
+
+    rb_config_reload();
+}
+
 static void
 writepid(const char* pidfile)
 {
@@ -223,9 +260,11 @@ main(int argc, char* argv[])
     g_state.confdir = DEFAULT_CONFIG;
     g_state.retries = DEFAULT_RETRIES;
     g_state.timeout = DEFAULT_TIMEOUT;
+    g_state.writers = DEFAULT_WRITERS;
+    g_state.spool_sync = SPOOL_SYNC_SECOND;
 
     /* Parse the arguments nicely */
-    while((ch = getopt(argc, argv, "b:c:d:m:Mp:r:t:w:V")) != -1)
+    while((ch = getopt(argc, argv, "b:B:c:d:D:F:H:L:m:Mp:r:S:t:w:W:V")) != -1)
     {
         switch(ch)
         {
@@ -237,6 +276,16 @@ main(int argc, char* argv[])
             local[++n_local] = NULL;
             break;
 
+        /* Hold back rrd updates and write them together */
+        case 'B':
+            g_state.behind = strtol(optarg, &t, 10);
+            g_state.behind_secs = DEFAULT_BEHIND_SECS;
+            if(*t == ':')
+                g_state.behind_secs = strtol(t + 1, &t, 10);
+            if(*t || g_state.behind < 0 || g_state.behind_secs <= 0)
+                errx(1, "invalid write behind (must be samples[:secs]): %s", optarg);
+            break;
+
         /* Config directory */
         case 'c':
             g_state.confdir = optarg;
@@ -251,6 +300,42 @@ main(int argc, char* argv[])
             debug_level += LOG_ERR;
             break;
 
+        /* Send updates to rrdcached */
+        case 'D':
+            g_state.rrdcached = optarg;
+            break;
+
+        /* When to sync the spool to disk */
+        case 'F':
+            if(strcmp(optarg, "always") == 0)
+                g_state.spool_sync = SPOOL_SYNC_ALWAYS;
+            else if(strcmp(optarg, "second") == 0)
+                g_state.spool_sync = SPOOL_SYNC_SECOND;
+            else if(strcmp(optarg, "never") == 0)
+                g_state.spool_sync = SPOOL_SYNC_NEVER;
+            else
+                errx(1, "invalid spool sync (must be always, second or never): %s", optarg);
+            break;
+
+        /* Keep recent samples and answer queries for them */
+        case 'H':
+            g_state.history = optarg;
+            g_state.history_size = DEFAULT_HISTORY;
+            t = strrchr(optarg, ':');
+            if(t)
+            {
+                *t = 0;
+                g_state.history_size = strtol(t + 1, &t, 10);
+                if(*t || g_state.history_size <= 0)
+                    errx(1, "invalid history (must be socket[:samples]): %s", optarg);
+            }
+            break;
+
+        /* Publish the latest values here */
+        case 'L':
+            g_state.latest = optarg;
+            break;
+
         /* mib directory */
         case 'm':
             mib_directory = optarg;
@@ -273,6 +358,20 @@ main(int argc, char* argv[])
                 errx(1, "invalid number of retries: %s", optarg);
             break;
 
+        /* Spool writes before doing them */
+        case 'S':
+            g_state.spool = optarg;
+            g_state.spool_size = DEFAULT_SPOOL_SIZE;
+            t = strrchr(optarg, ':');
+            if(t)
+            {
+                *t = 0;
+                g_state.spool_size = strtol(t + 1, &t, 10);
+                if(*t || g_state.spool_size <= 0)
+                    errx(1, "invalid spool (must be spooldir[:megabytes]): %s", optarg);
+            }
+            break;
+
         /* The default timeout */
         case 't':
             g_state.timeout = strtol(optarg, &t, 10);
@@ -285,6 +384,13 @@ main(int argc, char* argv[])
             g_state.rrddir = optarg;
             break;
 
+        /* The number of rrd writer threads */
+        case 'W':
+            g_state.writers = strtol(optarg, &t, 10);
+            if(*t || g_state.writers < 0)
+                errx(1, "invalid number of writers: %s", optarg);
+            break;
+
         /* Print version number */
         case 'V':
             version();
@@ -304,6 +410,13 @@ main(int argc, char* argv[])
     if(argc != 0)
         usage();
 
+    if(g_state.spool && !g_state.writers)
+        errx(1, "the spool needs at least one writer thread (-W)");
+
+    /* Held back updates would be lost in a crash, before the spool has them */
+    if(g_state.spool && g_state.behind)
+        errx(1, "updates can't be held back (-B) when using the spool (-S)");
+
     /* No bind addresses specified, use defaults... */
     if (local == NULL) {
         local = xrealloc (local, sizeof (char*) * 3);
@@ -328,6 +441,9 @@ main(int argc, char* argv[])
     snmp_engine_init (local, g_state.retries);
     rb_poll_engine_init();
 
+    /* Before forking, so problems with the socket show up */
+    rb_history_init(g_state.history, g_state.history_size);
+
     free (local);
     n_local = 0;
     local = NULL;
@@ -349,11 +465,25 @@ main(int argc, char* argv[])
         /* Allow things to proceed without resolver */
     }
 
+    /* Threads that write the rrd files */
+    rb_rrd_init(g_state.writers, g_state.behind, g_state.behind_secs);
+    rb_stream_init();
+    rb_latest_init(g_state.latest);
+
+    /* Reloads wake up the main loop */
+    if(pipe(reload_pipe) < 0)
+        err(1, "couldn't create reload pipe");
+    fcntl(reload_pipe[0], F_SETFL, fcntl(reload_pipe[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(reload_pipe[1], F_SETFL, fcntl(reload_pipe[1], F_GETFL, 0) | O_NONBLOCK);
+    if(server_watch(reload_pipe[0], SERVER_READ, reload_io, NULL) == -1)
+        err(1, "couldn't watch reload pipe");
+
     /* Handle signals */
     signal(SIGPIPE, SIG_IGN);
-    signal(SIGHUP, SIG_IGN);
+    signal(SIGHUP, on_reload);
     signal(SIGINT,  on_quit);
     signal(SIGTERM, on_quit);
+    signal(SIGUSR1, on_flush);
     siginterrupt(SIGINT, 1);
     siginterrupt(SIGTERM, 1);
 
@@ -373,9 +503,16 @@ main(int argc, char* argv[])
 
     /* Cleanups */
     rb_poll_engine_uninit();
+    rb_rrd_uninit();
+    rb_stream_uninit();
+    rb_latest_uninit();
+    rb_history_uninit();
     snmp_engine_stop();
     rb_config_free();
     async_resolver_uninit();
+    server_unwatch(reload_pipe[0]);
+    close(reload_pipe[0]);
+    close(reload_pipe[1]);
     server_uninit();
 
     if(pidfile != NULL)
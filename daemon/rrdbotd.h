@@ -55,6 +55,92 @@ typedef uint64_t mstime;
 struct _rb_item;
 struct _rb_poller;
 
+typedef union _rb_value
+{
+    int64_t i_value;
+    double f_value;
+}
+rb_value;
+
+#define VALUE_UNSET 0
+#define VALUE_REAL  1
+#define VALUE_FLOAT 2
+
+#define AGGREGATE_AVG   0
+#define AGGREGATE_MIN   1
+#define AGGREGATE_MAX   2
+#define AGGREGATE_LAST  3
+#define AGGREGATE_RATE  4
+
+/*
+ * The requests and value for an item in one polling cycle. When
+ * responses take longer than the poll interval, several cycles
+ * can be in flight at once, each with its own fetch.
+ */
+typedef struct _rb_fetch
+{
+    struct _rb_item* item;
+    int cycle;                          /* Index into poller cycles */
+
+    int field_request;
+    int hedge_request;                  /* Same request to the next host */
+    int query_request;
+    int query_matched;
+    int waiting;                        /* Waiting for shared value */
+
+    mstime last_request;
+    mstime last_polled;
+    mstime hedge_at;                    /* When to send hedge_request */
+    mstime hedge_sent;                  /* When hedge_request was sent */
+    int host;                           /* Host index of field_request */
+
+    rb_value v;
+    int vtype;
+
+    struct asn_oid row;                 /* Table index of a walked value */
+}
+rb_fetch;
+
+/* A row found when walking a table */
+typedef struct _rb_row
+{
+    struct asn_oid index;               /* Table index of the row */
+    char value[64];                     /* Query column value, for paths */
+}
+rb_row;
+
+/*
+ * A walk of a whole table in one polling cycle. For version 1 each
+ * step asks for the next row of the query column and all the field
+ * columns in one request. Otherwise each step asks for a run of rows
+ * of the query column with GETBULK, and then gets the fields of
+ * those rows.
+ */
+typedef struct _rb_walk
+{
+    struct asn_oid last;                /* Index of the last row found */
+    int pending;                        /* Requests outstanding in this step */
+    int code;                           /* Error during this step */
+    int found;                          /* This step found a row */
+    rb_row next;                        /* The row found by this step */
+
+    /* For GETBULK walks */
+    int repetitions;                    /* Rows asked for in each step */
+    int done;                           /* This step reached the end */
+    int first;                          /* First row found by this step */
+    int* requests;                      /* Field requests for those rows */
+    int n_requests;
+    int max_requests;
+
+    /* The rows found, and n_items values for each row */
+    rb_row* rows;
+    rb_value* values;
+    int* vtypes;
+    int n_rows;
+    int max_rows;
+}
+rb_walk;
+
 /*
  * Note that all the members are either in the config memory
  * or inline. This helps us keep memory management simple.
@@ -74,7 +160,6 @@ typedef struct _rb_item
 
     /* The oid that we are querying */
     struct asn_oid field_oid;
-    int field_request;
 
     /* Host names, with alternate hosts */
     #define MAX_HOSTNAMES 16
@@ -83,34 +168,70 @@ typedef struct _rb_item
     int hostindex;
     int n_hostnames;
 
+    /* Response times of each host, to decide when to hedge */
+    struct
+    {
+        mstime srtt;                    /* Smoothed round trip time */
+        mstime rttvar;                  /* Variation in round trip time */
+        int samples;
+    } rtts[MAX_HOSTNAMES];
+
     /* Query related stuff */
     int has_query;
     struct asn_oid query_oid;
     const char* query_match;
-    int query_matched;
+    struct snmp_match* query_matcher;   /* Compiled query_match */
+    int wildcard;                       /* Query every row of the table */
     int query_searched;
     struct asn_oid query_last;
-    int query_request;
-
-    /* Book keeping */
-    mstime last_request;
-    mstime last_polled;
+    rb_fetch* query_searcher;           /* Fetch doing a table search */
 
-    /* The last value / current request */
-    union
-    {
-        int64_t i_value;
-        double f_value;
-    } v;
+    /* One fetch per polling cycle in flight */
+    rb_fetch* fetches;
 
-    #define VALUE_UNSET 0
-    #define VALUE_REAL  1
-    #define VALUE_FLOAT 2
+    /* The value of the last written cycle */
+    mstime last_polled;
+    rb_value v;
     int vtype;
 
     /* Pointers to related */
     struct _rb_poller* poller;
 
+    /*
+     * Items polling the same source at the same interval share
+     * one fetch. The first such item does the polling, and the
+     * others subscribe to it.
+     */
+    struct _rb_item* shared;            /* The item polling for us, or NULL */
+    struct _rb_item* subscribers;       /* Items that share our value */
+    struct _rb_item* next_subscriber;
+
+    /* Entry in the latest values file, or -1 */
+    int latest;
+
+    /* Ring of recent samples, or -1 */
+    int history;
+
+    /* How values are combined when the poller has a step */
+    int aggregate;
+
+    /* The values so far in this step */
+    struct
+    {
+        int count;
+        double sum;
+        rb_value min;
+        int min_type;
+        rb_value max;
+        int max_type;
+        rb_value last;
+        int last_type;
+        mstime last_at;
+        rb_value base;                  /* Last value before, for rates */
+        int base_type;
+        mstime base_at;
+    } agg;
+
     /* Next in list of items */
     struct _rb_item* next;
 }
@@ -119,6 +240,14 @@ rb_item;
 typedef struct _file_path
 {
     const char * path;
+    int binary;                 /* Binary raw file */
+    struct _rb_stream* stream;  /* Connection for a stream */
+
+    /* Raw files that only get changes, and what was last written */
+    mstime heartbeat;           /* Write unchanged values this often */
+    struct _raw_last* last;
+    hsh_t* last_rows;           /* For table rows, by index */
+
     /* Next in list of items */
     struct _file_path* next;
 }
@@ -132,20 +261,61 @@ typedef struct _rb_poller
 
     file_path* rrdlist;
     file_path* rawlist;
+    file_path* streamlist;
+
+    /* Name of the config file, without .conf, for streams */
+    char* name;
+
+    /* The config file contents, all the strings point into this */
+    char* memory;
+    uint32_t signature;                 /* Hash of the config values */
+    int retired;                        /* Removed by a config reload */
 
     mstime interval;
     mstime timeout;
 
+    /* Write one value per field for each step, or zero */
+    mstime step;
+    mstime step_start;                  /* Start of the current step */
+
     /* The things to poll. rb_poller owns this list */
     rb_item* items;
+    int n_items;
+
+    /* The RRD update template, and the buffer values are formatted in */
+    char* template;
+    char* values;
 
-    /* Polling is active */
-    int polling;
+    /* Table pollers walk the table, one walk per cycle, or NULL */
+    rb_walk* walks;
 
-    /* Book keeping */
+    /*
+     * The polling cycles in flight. Cycles are written out in
+     * order, starting at the oldest.
+     */
+    #define MAX_CYCLES 8
+    struct
+    {
+        int polling;                    /* Cycle not yet written */
+        int outstanding;                /* Items still waiting for a value */
+        mstime last_request;
+        mstime last_polled;
+    } cycles[MAX_CYCLES];
+    int n_cycles;
+    int current;
+    int oldest;
+
+    /* Book keeping for the last written cycle */
     mstime last_request;
     mstime last_polled;
 
+    /*
+     * Pollers with shared items run off one timer, so that
+     * the shared values are fetched once per cycle.
+     */
+    struct _rb_poller* group;           /* The poller we run with, or NULL */
+    struct _rb_poller* group_next;      /* Next poller in the group */
+
     /* Next in list of pollers */
     struct _rb_poller* next;
 }
@@ -158,6 +328,16 @@ typedef struct _rb_state
     const char* rrddir;
     uint retries;
     uint timeout;
+    int writers;
+    int behind;
+    int behind_secs;
+    const char* rrdcached;
+    const char* spool;
+    int spool_size;
+    int spool_sync;
+    const char* latest;
+    const char* history;
+    int history_size;
 
     /* All the pollers/hosts */
     rb_poller* polls;
@@ -175,6 +355,7 @@ extern rb_state g_state;
  */
 
 void rb_config_parse();
+void rb_config_reload();
 void rb_config_free();
 
 /* -----------------------------------------------------------------------------
@@ -183,11 +364,95 @@ void rb_config_free();
 
 void rb_poll_engine_init();
 void rb_poll_engine_uninit();
+int rb_poll_engine_start(rb_poller* poll);
+void rb_poll_engine_stop(rb_poller* poll);
 
 /* -----------------------------------------------------------------------------
  * RRD UPDATE CODE (rrd-update.c)
  */
 
-void rb_rrd_update(rb_poller *poll);
+void rb_rrd_init(int threads, int samples, int secs);
+void rb_rrd_uninit();
+void rb_rrd_flush();
+void rb_rrd_prepare(rb_poller *poll);
+void rb_rrd_update(rb_poller *poll, const rb_row *row);
+void rb_rrd_requeue(const char* path, const char* template, const char* values,
+                    uint64_t seq);
+void rb_rrd_forget(file_path* rawpath);
+
+/* -----------------------------------------------------------------------------
+ * AGGREGATION (aggregate.c)
+ */
+
+void rb_aggregate_update(rb_poller* poll);
+void rb_aggregate_flush(rb_poller* poll);
+
+/* -----------------------------------------------------------------------------
+ * RRDCACHED CLIENT (rrd-cached.c)
+ */
+
+void rb_cached_init(const char* address);
+void rb_cached_uninit();
+int rb_cached_update(const char* path, const char* template, const char* values,
+                     uint64_t seq);
+uint64_t rb_cached_pending();
+
+/* -----------------------------------------------------------------------------
+ * STREAMING (stream.c)
+ */
+
+void rb_stream_init();
+const char* rb_stream_invalid(const char* url);
+void rb_stream_uninit();
+void rb_stream_update(rb_poller* poll, const rb_row* row);
+
+/* -----------------------------------------------------------------------------
+ * LATEST VALUES (latest.c)
+ */
+
+void rb_latest_init(const char* path);
+void rb_latest_uninit();
+void rb_latest_reload();
+void rb_latest_update(rb_poller* poll);
+
+/* -----------------------------------------------------------------------------
+ * RECENT HISTORY (history.c)
+ */
+
+void rb_history_init(const char* path, int samples);
+void rb_history_uninit();
+void rb_history_reload();
+void rb_history_update(rb_poller* poll);
+
+/* -----------------------------------------------------------------------------
+ * WRITE SPOOL (rrd-spool.c)
+ */
+
+#define SPOOL_SYNC_NEVER    0
+#define SPOOL_SYNC_SECOND   1
+#define SPOOL_SYNC_ALWAYS   2
+
+typedef struct _rb_spool_record
+{
+    uint64_t seq;
+    int type;
+    const char* path;
+    const char* template;
+    const char* data;
+}
+rb_spool_record;
+
+typedef struct _rb_spool_reader rb_spool_reader;
+
+uint64_t rb_spool_init(const char* dir, size_t max, int sync);
+void rb_spool_uninit();
+uint64_t rb_spool_append(int type, const char* path, const char* template,
+                         const char* data);
+uint64_t rb_spool_last();
+void rb_spool_done(uint64_t done);
+
+rb_spool_reader* rb_spool_open(uint64_t from);
+int rb_spool_read(rb_spool_reader* rd, uint64_t until, rb_spool_record* rec);
+void rb_spool_close(rb_spool_reader* rd);
 
 #endif /* __RRDBOTD_H__ */
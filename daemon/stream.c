@@ -0,0 +1,761 @@
+/*
+ * Copyright (c) 2008, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+
+#include "usuals.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <err.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include "async-resolver.h"
+#include "hash.h"
+#include "log.h"
+#include "rrdbotd.h"
+#include "server-mainloop.h"
+
+/*
+ * Streams every sample to a collector, in the Graphite plaintext or
+ * the Influx line protocol. Lines are put in a buffer for each stream
+ * as values come in, and written out from the mainloop when the socket
+ * can take them. While a stream is down the buffer fills, and once
+ * full, new lines are dropped.
+ */
+
+#define FORMAT_GRAPHITE     1
+#define FORMAT_INFLUX       2
+
+#define PREFIX_GRAPHITE     "graphite:"
+#define PREFIX_INFLUX       "influx:"
+
+#define DEFAULT_PORT        "2003"
+
+/* Lines buffered for a stream before we drop them */
+#define STREAM_BUFFER       (1024 * 1024)
+
+/* Lines put in each UDP packet */
+#define MAX_DATAGRAM        1400
+
+/* Longest wait in seconds before connecting again */
+#define MAX_RECONNECT       60
+
+/* How often to report on the streams */
+#define STATS_INTERVAL      (5 * 60 * 1000)
+
+typedef struct _rb_stream
+{
+    char* url;                      /* As configured */
+    int format;
+    int socktype;
+    char* host;                     /* Host and port, or NULL for unix */
+    struct sockaddr_un sun;
+
+    int fd;
+    int connecting;                 /* Waiting for connect to finish */
+    int connected;
+    int resolving;
+    int waiting;                    /* Waiting to reconnect */
+    int wait;                       /* Seconds to wait before reconnecting */
+    int failed;                     /* Already complained about this outage */
+
+    char* buf;
+    size_t start;                   /* Sent up to here */
+    size_t len;
+
+    unsigned int sent;              /* Lines since last report */
+    unsigned int dropped;
+
+    struct _rb_stream* next;
+}
+rb_stream;
+
+static rb_stream* streams = NULL;
+static hsh_t* stream_by_url = NULL;
+static int stats_timer = 0;
+
+static void stream_connect(rb_stream* stream);
+
+/* -----------------------------------------------------------------------------
+ * CONNECTION
+ */
+
+static void stream_watch(rb_stream* stream)
+{
+    int type = SERVER_READ;
+
+    if(stream->connecting || (stream->connected && stream->start < stream->len))
+        type |= SERVER_WRITE;
+    server_rewatch(stream->fd, type);
+}
+
+static int stream_retry(mstime when, void* arg)
+{
+    rb_stream* stream = (rb_stream*)arg;
+
+    stream->waiting = 0;
+    if(stream->fd != -1)
+    {
+        server_unwatch(stream->fd);
+        close(stream->fd);
+        stream->fd = -1;
+    }
+
+    stream_connect(stream);
+    return 0;
+}
+
+/* Close is left to the timer, as we may be in a callback for the fd */
+static void stream_fail(rb_stream* stream, const char* what, int error)
+{
+    char* t;
+
+    if(!stream->failed)
+        log_warnx("couldn't %s stream: %s: %s", what, stream->url, strerror(error));
+    stream->failed = 1;
+
+    stream->connecting = 0;
+    stream->connected = 0;
+    if(stream->fd != -1)
+        server_rewatch(stream->fd, 0);
+
+    /* The rest of a line that was part way sent is no use */
+    if(stream->start > 0 && stream->buf[stream->start - 1] != '\n')
+    {
+        t = memchr(stream->buf + stream->start, '\n', stream->len - stream->start);
+        stream->start = t ? (size_t)(t - stream->buf) + 1 : stream->len;
+    }
+
+    if(stream->waiting)
+        return;
+
+    if(server_oneshot(stream->wait * 1000, stream_retry, stream) == -1)
+    {
+        log_errorx("couldn't setup stream reconnect timer");
+        return;
+    }
+
+    stream->waiting = 1;
+    stream->wait = MIN(stream->wait * 2, MAX_RECONNECT);
+}
+
+static void stream_connected(rb_stream* stream)
+{
+    stream->connecting = 0;
+    stream->connected = 1;
+    stream->wait = 1;
+
+    if(stream->failed)
+        log_info("connected to stream: %s", stream->url);
+    else
+        log_debug("connected to stream: %s", stream->url);
+    stream->failed = 0;
+
+    stream_watch(stream);
+}
+
+/* Lines only go out whole, a packet at a time */
+static int stream_send_datagrams(rb_stream* stream)
+{
+    const char* p;
+    const char* end;
+    const char* t;
+    ssize_t r;
+
+    while(stream->start < stream->len)
+    {
+        p = stream->buf + stream->start;
+        end = stream->buf + stream->len;
+
+        /* As many lines as fit, or at least one */
+        t = memchr(p, '\n', end - p);
+        t = t ? t + 1 : end;
+        while(t < end && t - p < MAX_DATAGRAM)
+        {
+            const char* n = memchr(t, '\n', end - t);
+            n = n ? n + 1 : end;
+            if(n - p > MAX_DATAGRAM)
+                break;
+            t = n;
+        }
+
+        r = send(stream->fd, p, t - p, 0);
+        if(r < 0)
+        {
+            if(errno == EAGAIN || errno == EINTR)
+                return 0;
+
+            /* Nobody listening right now, these are lost */
+            if(errno != ECONNREFUSED)
+                return -1;
+        }
+
+        stream->start += t - p;
+    }
+
+    return 0;
+}
+
+static int stream_send(rb_stream* stream)
+{
+    ssize_t r;
+
+    if(stream->socktype == SOCK_DGRAM)
+        return stream_send_datagrams(stream);
+
+    while(stream->start < stream->len)
+    {
+        r = send(stream->fd, stream->buf + stream->start,
+                 stream->len - stream->start, 0);
+        if(r < 0)
+            return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        stream->start += r;
+    }
+
+    return 0;
+}
+
+static void stream_io(int fd, int type, void* arg)
+{
+    rb_stream* stream = (rb_stream*)arg;
+    char buf[256];
+    socklen_t len;
+    int error;
+    ssize_t r;
+
+    ASSERT(fd == stream->fd);
+
+    if(type == SERVER_READ)
+    {
+        /* Collectors don't say anything, other than closing */
+        r = recv(fd, buf, sizeof(buf), 0);
+        if(r == 0 && stream->socktype == SOCK_STREAM)
+            stream_fail(stream, "write to", ECONNRESET);
+        else if(r < 0 && errno != EAGAIN && errno != EINTR &&
+                stream->socktype == SOCK_STREAM)
+            stream_fail(stream, stream->connecting ? "connect to" : "write to", errno);
+        return;
+    }
+
+    if(stream->connecting)
+    {
+        len = sizeof(error);
+        if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+            error = errno;
+        if(error)
+        {
+            stream_fail(stream, "connect to", error);
+            return;
+        }
+        stream_connected(stream);
+    }
+
+    if(!stream->connected)
+        return;
+
+    if(stream_send(stream) < 0)
+    {
+        stream_fail(stream, "write to", errno);
+        return;
+    }
+
+    if(stream->start == stream->len)
+        stream->start = stream->len = 0;
+
+    stream_watch(stream);
+}
+
+static void stream_open(rb_stream* stream, struct sockaddr* addr, socklen_t addrlen)
+{
+    int fd;
+
+    ASSERT(stream->fd == -1);
+
+    fd = socket(addr->sa_family, stream->socktype, 0);
+    if(fd < 0)
+    {
+        stream_fail(stream, "create socket for", errno);
+        return;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    if(server_watch(fd, SERVER_READ, stream_io, stream) == -1)
+    {
+        close(fd);
+        stream_fail(stream, "watch", errno);
+        return;
+    }
+
+    stream->fd = fd;
+
+    if(connect(fd, addr, addrlen) < 0)
+    {
+        if(errno != EINPROGRESS && errno != EAGAIN)
+        {
+            stream_fail(stream, "connect to", errno);
+            return;
+        }
+
+        stream->connecting = 1;
+        stream_watch(stream);
+        return;
+    }
+
+    stream_connected(stream);
+}
+
+static void stream_resolved(int ecode, struct addrinfo* ai, void* arg)
+{
+    rb_stream* stream = (rb_stream*)arg;
+
+    stream->resolving = 0;
+
+    if(ecode)
+    {
+        if(!stream->failed)
+            log_warnx("couldn't resolve stream host: %s: %s", stream->url,
+                      gai_strerror(ecode));
+        stream_fail(stream, "resolve", EHOSTUNREACH);
+        return;
+    }
+
+    stream_open(stream, ai->ai_addr, ai->ai_addrlen);
+}
+
+static void stream_connect(rb_stream* stream)
+{
+    struct addrinfo hints;
+
+    if(!stream->host)
+    {
+        stream_open(stream, (struct sockaddr*)&stream->sun, sizeof(stream->sun));
+        return;
+    }
+
+    if(stream->resolving)
+        return;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = PF_UNSPEC;
+    hints.ai_socktype = stream->socktype;
+
+    /* Resolved again each time, in case the address moves */
+    stream->resolving = 1;
+    async_resolver_queue(stream->host, DEFAULT_PORT, &hints, stream_resolved, stream);
+}
+
+/* -----------------------------------------------------------------------------
+ * LINES
+ */
+
+/* Graphite names use dots between parts, so nothing else can have them */
+static char* put_name(char* p, char* end, const char* name, int format)
+{
+    for(; *name && p < end; ++name)
+    {
+        if(format == FORMAT_GRAPHITE)
+        {
+            *(p++) = (*name == ' ' || *name == '.') ? '_' : *name;
+        }
+        else
+        {
+            if((*name == ' ' || *name == ',' || *name == '=') && p + 1 < end)
+                *(p++) = '\\';
+            *(p++) = *name;
+        }
+    }
+
+    return p;
+}
+
+static char* put_value(char* p, char* end, rb_item* item, int format)
+{
+    if(item->vtype == VALUE_FLOAT)
+        p += snprintf(p, end - p, "%.17g", item->v.f_value);
+    else if(format == FORMAT_INFLUX)
+        p += snprintf(p, end - p, "%" PRId64 "i", item->v.i_value);
+    else
+        p += snprintf(p, end - p, "%" PRId64, item->v.i_value);
+
+    return MIN(p, end);
+}
+
+static void stream_add(rb_stream* stream, const char* line, size_t len)
+{
+    char* buf;
+
+    /* Room for the lines already sent */
+    if(stream->len + len > STREAM_BUFFER && stream->start)
+    {
+        memmove(stream->buf, stream->buf + stream->start, stream->len - stream->start);
+        stream->len -= stream->start;
+        stream->start = 0;
+    }
+
+    if(stream->len + len > STREAM_BUFFER)
+    {
+        stream->dropped++;
+        return;
+    }
+
+    if(!stream->buf)
+    {
+        buf = (char*)malloc(STREAM_BUFFER);
+        if(!buf)
+        {
+            log_errorx("out of memory");
+            stream->dropped++;
+            return;
+        }
+        stream->buf = buf;
+    }
+
+    memcpy(stream->buf + stream->len, line, len);
+    stream->len += len;
+    stream->sent++;
+}
+
+/* One line for each value: name[.row].field value time */
+static void stream_graphite(rb_stream* stream, rb_poller* poll, const char* row)
+{
+    char line[1024];
+    char* end = line + sizeof(line) - 1;
+    char* base;
+    char* p;
+    rb_item* item;
+    int64_t when = poll->last_polled / 1000L;
+    char fraction[8] = "";
+
+    /* Sub-second pollers send milliseconds too */
+    if(poll->interval % 1000)
+        snprintf(fraction, sizeof(fraction), ".%03d", (int)(poll->last_polled % 1000));
+
+    p = put_name(line, end, poll->name, FORMAT_GRAPHITE);
+    if(row && p < end)
+    {
+        *(p++) = '.';
+        p = put_name(p, end, row, FORMAT_GRAPHITE);
+    }
+    base = p;
+
+    for(item = poll->items; item; item = item->next)
+    {
+        if(item->vtype == VALUE_UNSET)
+            continue;
+
+        p = base;
+        if(p < end)
+            *(p++) = '.';
+        p = put_name(p, end, item->field, FORMAT_GRAPHITE);
+        if(p < end)
+            *(p++) = ' ';
+        p = put_value(p, end, item, FORMAT_GRAPHITE);
+        p += snprintf(p, end - p, " %" PRId64 "%s", when, fraction);
+        p = MIN(p, end);
+        *(p++) = '\n';
+
+        stream_add(stream, line, p - line);
+    }
+}
+
+/* One line for all the values: name[,row=row] field=value,... time */
+static void stream_influx(rb_stream* stream, rb_poller* poll, const char* row)
+{
+    char line[4096];
+    char* end = line + sizeof(line) - 1;
+    char* p;
+    rb_item* item;
+    int first = 1;
+
+    p = put_name(line, end, poll->name, FORMAT_INFLUX);
+    if(row && p + 5 < end)
+    {
+        memcpy(p, ",row=", 5);
+        p = put_name(p + 5, end, row, FORMAT_INFLUX);
+    }
+
+    for(item = poll->items; item; item = item->next)
+    {
+        if(item->vtype == VALUE_UNSET)
+            continue;
+
+        if(p < end)
+            *(p++) = first ? ' ' : ',';
+        first = 0;
+        p = put_name(p, end, item->field, FORMAT_INFLUX);
+        if(p < end)
+            *(p++) = '=';
+        p = put_value(p, end, item, FORMAT_INFLUX);
+    }
+
+    if(first)
+        return;
+
+    p += snprintf(p, end - p, " %" PRId64 "000000", poll->last_polled);
+    p = MIN(p, end);
+    *(p++) = '\n';
+
+    stream_add(stream, line, p - line);
+}
+
+void rb_stream_update(rb_poller* poll, const rb_row* row)
+{
+    char index[ASN_OIDSTRLEN];
+    const char* name = NULL;
+    file_path* path;
+    rb_stream* stream;
+
+    /* Rows go by their value where they have one */
+    if(row)
+    {
+        if(row->value[0])
+            name = row->value;
+        else
+            name = asn_oid2str_r(&row->index, index);
+    }
+
+    for(path = poll->streamlist; path; path = path->next)
+    {
+        stream = path->stream;
+        ASSERT(stream);
+
+        if(stream->format == FORMAT_INFLUX)
+            stream_influx(stream, poll, name);
+        else
+            stream_graphite(stream, poll, name);
+
+        if(stream->connected && stream->start < stream->len)
+            stream_watch(stream);
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ * SETUP
+ */
+
+static int stream_stats(mstime when, void* arg)
+{
+    rb_stream* stream;
+
+    for(stream = streams; stream; stream = stream->next)
+    {
+        if(stream->dropped)
+            log_warnx("stream: %s: %u lines, %u dropped, %u buffered bytes",
+                      stream->url, stream->sent, stream->dropped,
+                      (unsigned int)(stream->len - stream->start));
+        else
+            log_debug("stream: %s: %u lines, %u buffered bytes", stream->url,
+                      stream->sent, (unsigned int)(stream->len - stream->start));
+        stream->sent = stream->dropped = 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Fills in the format and address of a stream from its url, returning
+ * why the url is invalid, or NULL. The host is pointed into the url.
+ */
+static const char* stream_parse(rb_stream* stream, const char* url,
+                                const char** host)
+{
+    const char* addr = url;
+    const char* rest;
+
+    *host = NULL;
+    stream->format = FORMAT_GRAPHITE;
+
+    if(strncmp(addr, PREFIX_INFLUX, strlen(PREFIX_INFLUX)) == 0)
+    {
+        stream->format = FORMAT_INFLUX;
+        addr += strlen(PREFIX_INFLUX);
+    }
+    else if(strncmp(addr, PREFIX_GRAPHITE, strlen(PREFIX_GRAPHITE)) == 0)
+    {
+        addr += strlen(PREFIX_GRAPHITE);
+    }
+
+    if(strncmp(addr, "tcp://", 6) == 0)
+    {
+        stream->socktype = SOCK_STREAM;
+        rest = addr + 6;
+    }
+    else if(strncmp(addr, "udp://", 6) == 0)
+    {
+        stream->socktype = SOCK_DGRAM;
+        rest = addr + 6;
+    }
+    else if(strncmp(addr, "unix:", 5) == 0)
+    {
+        stream->socktype = SOCK_STREAM;
+        rest = addr + 5;
+        if(strlen(rest) >= sizeof(stream->sun.sun_path))
+            return "stream socket path is too long";
+        stream->sun.sun_family = AF_UNIX;
+        strlcpy(stream->sun.sun_path, rest, sizeof(stream->sun.sun_path));
+        return NULL;
+    }
+    else
+    {
+        return "invalid stream (must be tcp://host[:port], udp://host[:port] or unix:/path)";
+    }
+
+    if(!*rest || strchr(rest, '/'))
+        return "invalid stream host";
+    *host = rest;
+    return NULL;
+}
+
+/* Why the url of a stream is invalid, or NULL, for checking the config */
+const char* rb_stream_invalid(const char* url)
+{
+    rb_stream stream;
+    const char* host;
+
+    memset(&stream, 0, sizeof(stream));
+    return stream_parse(&stream, url, &host);
+}
+
+/* The url was checked when the config was loaded */
+static rb_stream* stream_create(const char* url)
+{
+    rb_stream* stream;
+    const char* host;
+
+    stream = (rb_stream*)xcalloc(sizeof(rb_stream));
+    stream->url = strdup(url);
+    if(!stream->url)
+        errx(1, "out of memory");
+    stream->fd = -1;
+    stream->wait = 1;
+
+    if(stream_parse(stream, url, &host) != NULL)
+        errx(2, "invalid stream: %s", url);
+
+    if(host)
+    {
+        stream->host = strdup(host);
+        if(!stream->host)
+            errx(1, "out of memory");
+    }
+
+    return stream;
+}
+
+static void stream_free(rb_stream* stream)
+{
+    free(stream->url);
+    free(stream->host);
+    free(stream->buf);
+    free(stream);
+}
+
+/* Connects the streams of pollers, called again for new pollers on reload */
+void rb_stream_init()
+{
+    rb_poller* poll;
+    file_path* path;
+    rb_stream* stream;
+
+    for(poll = g_state.polls; poll; poll = poll->next)
+    {
+        for(path = poll->streamlist; path; path = path->next)
+        {
+            if(path->stream)
+                continue;
+
+            if(!stream_by_url)
+            {
+                stream_by_url = hsh_create();
+                if(!stream_by_url)
+                    errx(1, "out of memory");
+            }
+
+            stream = (rb_stream*)hsh_get(stream_by_url, path->path, -1);
+            if(!stream)
+            {
+                stream = stream_create(path->path);
+                if(!hsh_set(stream_by_url, stream->url, -1, stream))
+                    errx(1, "out of memory");
+                stream->next = streams;
+                streams = stream;
+                stream_connect(stream);
+            }
+
+            path->stream = stream;
+        }
+    }
+
+    if(!streams || stats_timer)
+        return;
+
+    if(server_timer(STATS_INTERVAL, stream_stats, NULL) == -1)
+        log_errorx("couldn't setup stream stats timer");
+    stats_timer = 1;
+}
+
+void rb_stream_uninit()
+{
+    rb_stream* stream;
+
+    while(streams)
+    {
+        stream = streams;
+        streams = stream->next;
+
+        /* Whatever goes out without waiting */
+        if(stream->connected)
+            stream_send(stream);
+
+        if(stream->fd != -1)
+        {
+            server_unwatch(stream->fd);
+            close(stream->fd);
+        }
+
+        stream_free(stream);
+    }
+
+    if(stream_by_url)
+        hsh_free(stream_by_url);
+    stream_by_url = NULL;
+}
@@ -38,6 +38,10 @@
 
 #include "usuals.h"
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -52,10 +56,13 @@
 
 #include "parse.h"
 #include "mib-parser.h"
+#include "hash.h"
 
 /* Whether we print warnings when loading MIBs or not */
 const char* mib_directory = DEFAULT_MIB;
+const char* mib_cache = DEFAULT_MIB_CACHE;
 int mib_warnings = 0;
+int mib_lazy = 1;
 static int initialized = 0;
 
 /* -----------------------------------------------------------------------------
@@ -145,20 +152,45 @@ int mib_subid(mib_node n, const char* name);
 void mib_oid(mib_node n, struct asn_oid* oid);
 mib_node mib_get_node(struct asn_oid* oid);
 
-/* -----------------------------------------------------------------------------
- * RRDBOT GLUE CODE
- */
+static int cache_open();
+static void cache_close();
+static void cache_write();
 
-static void
-clear_tree_flags(struct tree *tp)
+/* The nodes with a given label, in tree order */
+typedef struct _label_entry
 {
-    for( ; tp; tp = tp->next_peer)
-    {
-        tp->reported = 0;
-        if(tp->child_list)
-            clear_tree_flags(tp->child_list);
-    }
+    struct tree* tp;
+    struct _label_entry* next;
 }
+label_entry;
+
+/* Lower case label -> first label_entry */
+static hsh_t* label_index = NULL;
+static label_entry* label_entries = NULL;
+static char* label_keys = NULL;
+
+static void label_build();
+static void label_free();
+static label_entry* label_find(const char* label);
+static struct tree* best_tree_node(const char* pattern, struct tree* tp, u_int* match);
+
+/* The modules which define a given label */
+typedef struct _lazy_entry
+{
+    struct module* mp;
+    struct _lazy_entry* next;   /* The next module with this label */
+    struct _lazy_entry* link;   /* All entries, for freeing */
+}
+lazy_entry;
+
+static int lazy_build();
+static void lazy_free();
+static int lazy_load(const char* label);
+static void lazy_load_all();
+
+/* -----------------------------------------------------------------------------
+ * RRDBOT GLUE CODE
+ */
 
 void
 mib_init()
@@ -168,7 +200,12 @@ mib_init()
 
     init_mib_internals();
     add_mibdir(mib_directory);
-    read_all_mibs();
+
+    /* The MIBs themselves are only parsed when needed */
+    if(mib_lazy && lazy_build() == 0)
+        label_build();
+    else
+        lazy_load_all();
 
     initialized = 1;
 }
@@ -177,13 +214,24 @@ mib_node
 mib_lookup(const char* match)
 {
     extern struct tree *tree_head;
-    struct tree* mib;
+    label_entry* entry;
+    u_int score;
 
     ASSERT(initialized);
 
-    clear_tree_flags(tree_head);
-    mib = find_best_tree_node(match, NULL, NULL);
-    return (mib_node)mib;
+    if(!match || !*match)
+        return NULL;
+
+    /* An exact label is found straight away */
+    entry = label_find(match);
+    if(!entry && lazy_load(match))
+        entry = label_find(match);
+    if(entry)
+        return (mib_node)entry->tp;
+
+    /* Otherwise search the whole tree for the closest match */
+    lazy_load_all();
+    return (mib_node)best_tree_node(match, tree_head, &score);
 }
 
 int
@@ -191,9 +239,21 @@ mib_subid(mib_node n, const char* name)
 {
     struct tree *parent = (struct tree*)n;
     struct tree *tp = NULL;
+    label_entry* entry;
 
     ASSERT(initialized);
 
+    if(label_index)
+    {
+        for(entry = label_find(name); entry; entry = entry->next)
+        {
+            if(entry->tp->parent == parent)
+                return entry->tp->subid;
+        }
+
+        return -1;
+    }
+
     for(tp = parent->child_list; tp; tp = tp->next_peer)
     {
         if(strcasecmp(name, tp->label) == 0)
@@ -252,8 +312,15 @@ void
 mib_uninit()
 {
     if(initialized)
+    {
+        label_free();
+        lazy_free();
         unload_all_mibs();
+    }
     initialized = 0;
+
+    /* Looked for again, in case the MIBs change */
+    cache_close();
 }
 
 /* -----------------------------------------------------------------------------
@@ -262,6 +329,1015 @@ mib_uninit()
 
 #include "parse.c"
 
+/* -----------------------------------------------------------------------------
+ * LABEL INDEX
+ */
+
+static int
+label_key(const char* label, char* key, size_t len)
+{
+    size_t i;
+
+    for(i = 0; label[i]; ++i)
+    {
+        if(i + 1 >= len)
+            return -1;
+        key[i] = tolower((unsigned char)label[i]);
+    }
+
+    key[i] = 0;
+    return i;
+}
+
+static void
+label_count(struct tree* tp, int* n_nodes, size_t* n_keys)
+{
+    for( ; tp; tp = tp->next_peer)
+    {
+        if(tp->label)
+        {
+            (*n_nodes)++;
+            *n_keys += strlen(tp->label) + 1;
+        }
+        label_count(tp->child_list, n_nodes, n_keys);
+    }
+}
+
+static int
+label_add(struct tree* tp, label_entry** entry, char** key)
+{
+    label_entry* prev;
+    int len;
+
+    for( ; tp; tp = tp->next_peer)
+    {
+        if(tp->label)
+        {
+            len = label_key(tp->label, *key, strlen(tp->label) + 1);
+            (*entry)->tp = tp;
+            (*entry)->next = NULL;
+
+            /* Later nodes with the same label go on the end */
+            prev = (label_entry*)hsh_get(label_index, *key, len);
+            if(prev)
+            {
+                while(prev->next)
+                    prev = prev->next;
+                prev->next = *entry;
+            }
+            else if(!hsh_set(label_index, *key, len, *entry))
+            {
+                return -1;
+            }
+
+            (*entry)++;
+            *key += len + 1;
+        }
+
+        if(label_add(tp->child_list, entry, key) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void
+label_free()
+{
+    if(label_index)
+        hsh_free(label_index);
+    free(label_entries);
+    free(label_keys);
+    label_index = NULL;
+    label_entries = NULL;
+    label_keys = NULL;
+}
+
+static void
+label_build()
+{
+    extern struct tree *tree_head;
+    label_entry* entry;
+    size_t n_keys = 0;
+    int n_nodes = 0;
+    char* key;
+
+    label_count(tree_head, &n_nodes, &n_keys);
+
+    label_index = hsh_create();
+    label_entries = calloc(n_nodes + 1, sizeof(label_entry));
+    label_keys = malloc(n_keys + 1);
+
+    entry = label_entries;
+    key = label_keys;
+
+    /* Without the index lookups still work, just more slowly */
+    if(!label_index || !label_entries || !label_keys ||
+       label_add(tree_head, &entry, &key) < 0)
+        label_free();
+}
+
+static label_entry*
+label_find(const char* label)
+{
+    char key[MAXTOKEN + 1];
+    int len;
+
+    if(!label_index)
+        return NULL;
+
+    len = label_key(label, key, sizeof(key));
+    if(len < 0)
+        return NULL;
+
+    return (label_entry*)hsh_get(label_index, key, len);
+}
+
+/* The node that best matches a pattern, the first in tree order on a tie */
+static struct tree*
+best_tree_node(const char* pattern, struct tree* tp, u_int* match)
+{
+    struct tree* best = NULL;
+    struct tree* child;
+    u_int best_match = MAX_BAD;
+    u_int child_match;
+
+    for( ; tp && best_match != 0; tp = tp->next_peer)
+    {
+        if(tp->label && (child_match = compute_match(tp->label, pattern)) < best_match)
+        {
+            best = tp;
+            best_match = child_match;
+        }
+
+        if(best_match != 0 && tp->child_list)
+        {
+            child = best_tree_node(pattern, tp->child_list, &child_match);
+            if(child_match < best_match)
+            {
+                best = child;
+                best_match = child_match;
+            }
+        }
+    }
+
+    *match = best_match;
+    return best;
+}
+
+/* -----------------------------------------------------------------------------
+ * LAZY LOADING
+ */
+
+/*
+ * Instead of parsing every MIB up front, the files are only scanned for
+ * the labels they define. A module, and the modules it imports, are
+ * parsed when one of its labels is first needed. Anything that needs
+ * the whole tree, such as a fuzzy match or formatting, loads the rest.
+ */
+
+/* Lower case label -> first lazy_entry */
+static hsh_t* lazy_index = NULL;
+static lazy_entry* lazy_entries = NULL;
+static int lazy_loaded = 0;
+static int lazy_all = 0;
+
+/* The macros which define a node in the tree */
+static const char* lazy_macros[] = {
+    "OBJECT-TYPE",
+    "OBJECT-IDENTITY",
+    "MODULE-IDENTITY",
+    "NOTIFICATION-TYPE",
+    "TRAP-TYPE",
+    "OBJECT-GROUP",
+    "NOTIFICATION-GROUP",
+    "MODULE-COMPLIANCE",
+    "AGENT-CAPABILITIES",
+    NULL
+};
+
+typedef struct _lazy_token
+{
+    const char* str;
+    size_t len;
+}
+lazy_token;
+
+#define TOKEN_IS(t, s) \
+    ((t).len == strlen(s) && strncmp((t).str, (s), (t).len) == 0)
+
+static void
+lazy_add(const lazy_token* label, struct module* mp)
+{
+    char key[MAXTOKEN + 1];
+    lazy_entry* entry;
+    lazy_entry* prev;
+    int len;
+
+    if(label->len > MAXTOKEN)
+        return;
+    memcpy(key, label->str, label->len);
+    key[label->len] = 0;
+    len = label_key(key, key, sizeof(key));
+
+    prev = (lazy_entry*)hsh_get(lazy_index, key, len);
+    for(entry = prev; entry; entry = entry->next)
+    {
+        if(entry->mp == mp)
+            return;
+        prev = entry;
+    }
+
+    entry = (lazy_entry*)malloc(sizeof(lazy_entry) + len + 1);
+    if(!entry)
+        return;
+
+    memcpy(entry + 1, key, len + 1);
+    entry->mp = mp;
+    entry->next = NULL;
+
+    /* Later modules with the same label go on the end */
+    if(prev)
+    {
+        prev->next = entry;
+    }
+    else if(!hsh_set(lazy_index, entry + 1, len, entry))
+    {
+        free(entry);
+        return;
+    }
+
+    entry->link = lazy_entries;
+    lazy_entries = entry;
+}
+
+/* Finds 'label MACRO' and 'label OBJECT IDENTIFIER ::=' at the top level */
+static void
+lazy_scan(struct module* mp)
+{
+    lazy_token tokens[4];
+    const char* p;
+    const char* end;
+    char* data;
+    long size;
+    FILE* fp;
+    int i;
+
+    fp = fopen(mp->file, "r");
+    if(!fp)
+        return;
+
+    data = NULL;
+    if(fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) > 0 &&
+       fseek(fp, 0, SEEK_SET) == 0 && (data = malloc(size)) != NULL)
+        size = fread(data, 1, size, fp);
+    fclose(fp);
+
+    if(!data)
+        return;
+
+    memset(tokens, 0, sizeof(tokens));
+
+    for(p = data, end = data + size; p < end; )
+    {
+        if(isspace((unsigned char)*p))
+        {
+            p++;
+            continue;
+        }
+
+        /* Comments run to the end of the line or the next -- */
+        if(*p == '-' && p + 1 < end && p[1] == '-')
+        {
+            for(p += 2; p < end && *p != '\n'; p++)
+            {
+                if(*p == '-' && p + 1 < end && p[1] == '-')
+                {
+                    p++;
+                    break;
+                }
+            }
+            p++;
+            continue;
+        }
+
+        memmove(tokens, tokens + 1, sizeof(lazy_token) * 3);
+        tokens[3].str = p;
+
+        if(*p == '"')
+        {
+            for(p++; p < end && *p != '"'; p++)
+                ;
+            p++;
+        }
+        else if(is_labelchar((unsigned char)*p))
+        {
+            while(p < end && is_labelchar((unsigned char)*p))
+                p++;
+        }
+        else if(*p == ':' && end - p >= 3 && strncmp(p, "::=", 3) == 0)
+        {
+            p += 3;
+        }
+        else
+        {
+            p++;
+        }
+
+        if(p > end)
+            p = end;
+        tokens[3].len = p - tokens[3].str;
+
+        if(TOKEN_IS(tokens[3], "::=") && TOKEN_IS(tokens[2], "IDENTIFIER") &&
+           TOKEN_IS(tokens[1], "OBJECT") && tokens[0].len &&
+           islower((unsigned char)tokens[0].str[0]))
+        {
+            lazy_add(&tokens[0], mp);
+            continue;
+        }
+
+        if(!tokens[2].len || !islower((unsigned char)tokens[2].str[0]))
+            continue;
+
+        for(i = 0; lazy_macros[i]; i++)
+        {
+            if(TOKEN_IS(tokens[3], lazy_macros[i]))
+            {
+                lazy_add(&tokens[2], mp);
+                break;
+            }
+        }
+    }
+
+    free(data);
+}
+
+static int
+lazy_build()
+{
+    struct module* mp;
+
+    lazy_index = hsh_create();
+    lazy_all = 0;
+
+    /* Without the index everything has to be loaded */
+    if(!lazy_index)
+        return -1;
+
+    for(mp = module_head; mp; mp = mp->next)
+    {
+        if(mp->file)
+            lazy_scan(mp);
+    }
+
+    return 0;
+}
+
+static void
+lazy_free()
+{
+    lazy_entry* entry;
+
+    if(lazy_index)
+        hsh_free(lazy_index);
+    lazy_index = NULL;
+
+    while(lazy_entries)
+    {
+        entry = lazy_entries;
+        lazy_entries = entry->link;
+        free(entry);
+    }
+
+    lazy_loaded = 0;
+    lazy_all = 0;
+}
+
+/* Loads the modules that define a label, returns whether any were loaded */
+static int
+lazy_load(const char* label)
+{
+    char key[MAXTOKEN + 1];
+    lazy_entry* entry;
+    int loaded = 0;
+    int len;
+
+    if(lazy_all || !lazy_index)
+        return 0;
+
+    len = label_key(label, key, sizeof(key));
+    if(len < 0)
+        return 0;
+
+    entry = (lazy_entry*)hsh_get(lazy_index, key, len);
+    for( ; entry; entry = entry->next)
+    {
+        if(entry->mp->no_imports == -1)
+        {
+            read_module(entry->mp->name);
+            loaded = 1;
+        }
+    }
+
+    if(loaded)
+    {
+        lazy_loaded = 1;
+        adopt_orphans();
+        label_free();
+        label_build();
+    }
+
+    return loaded;
+}
+
+static void
+lazy_load_all()
+{
+    int reload;
+
+    if(lazy_all)
+        return;
+
+    reload = lazy_loaded;
+    label_free();
+    lazy_free();
+
+    /*
+     * The order modules are loaded in decides which one a node is
+     * listed under. So start again, loading them in the usual order.
+     */
+    if(reload)
+    {
+        unload_all_mibs();
+        init_mib_internals();
+        add_mibdir(mib_directory);
+    }
+
+    read_all_mibs();
+    label_build();
+    lazy_all = 1;
+
+    /* So the MIBs don't need parsing next time */
+    if(cache_open() < 0)
+        cache_write();
+}
+
+/* -----------------------------------------------------------------------------
+ * COMPILED CACHE
+ */
+
+/*
+ * The parsed MIB tree is written to a cache file, so that later symbolic
+ * OIDs can be resolved and formatted without parsing all the MIB files.
+ * The cache is memory mapped, and only used when it was made from the
+ * same MIB directory, as found from the names, sizes and modify times
+ * of the files in it.
+ *
+ * The file is a header, the nodes of the tree in depth first order,
+ * the indexes of the nodes sorted by label, and then the strings.
+ */
+
+#define CACHE_MAGIC     "RRDBOTMC"
+#define CACHE_VERSION   1
+#define CACHE_NONE      0xFFFFFFFF
+
+typedef struct _cache_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t n_nodes;
+    uint64_t stamp;
+    uint32_t n_labels;
+    uint32_t n_strings;
+}
+cache_header;
+
+typedef struct _cache_node
+{
+    uint32_t parent;
+    uint32_t child;
+    uint32_t peer;
+    uint32_t subid;
+    uint32_t label;             /* Offset into the strings */
+    int32_t modid;
+    uint32_t module;            /* Offset of module name, or zero */
+}
+cache_node;
+
+typedef struct _cache_map
+{
+    void* map;
+    size_t size;
+    const cache_header* header;
+    const cache_node* nodes;
+    const uint32_t* labels;
+    const char* strings;
+}
+cache_map;
+
+/* Zero when not yet looked for, 1 when mapped, -1 when unusable */
+static int cache_state = 0;
+static cache_map cache;
+
+/* A hash of the MIB directory listing, the cache is valid for this */
+static uint64_t
+cache_stamp(const char* dirname)
+{
+    char path[MAXPATHLEN];
+    struct dirent* dire;
+    struct stat sb;
+    uint64_t stamp = 14695981039346656037ULL;
+    uint64_t entry;
+    const char* p;
+    DIR* dir;
+
+    /* Files can come in any order, so each one is added to the stamp */
+    for(p = dirname; *p; ++p)
+        stamp = (stamp ^ (unsigned char)*p) * 1099511628211ULL;
+
+    dir = opendir(dirname);
+    if(!dir)
+        return 0;
+
+    while((dire = readdir(dir)) != NULL)
+    {
+        if(dire->d_name[0] == '.')
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", dirname, dire->d_name);
+        if(stat(path, &sb) < 0)
+            continue;
+
+        entry = 14695981039346656037ULL;
+        for(p = dire->d_name; *p; ++p)
+            entry = (entry ^ (unsigned char)*p) * 1099511628211ULL;
+        entry = (entry ^ (uint64_t)sb.st_size) * 1099511628211ULL;
+        entry = (entry ^ (uint64_t)sb.st_mtime) * 1099511628211ULL;
+        stamp += entry;
+    }
+
+    closedir(dir);
+    return stamp;
+}
+
+static void
+cache_close()
+{
+    if(cache.map)
+        munmap(cache.map, cache.size);
+    memset(&cache, 0, sizeof(cache));
+    cache_state = 0;
+}
+
+static int
+cache_open()
+{
+    const cache_header* header;
+    const cache_node* node;
+    struct stat sb;
+    size_t size;
+    void* map;
+    uint32_t i;
+    int valid = 1;
+    int fd;
+
+    if(cache_state)
+        return cache_state > 0 ? 0 : -1;
+
+    cache_state = -1;
+    if(!mib_cache)
+        return -1;
+
+    fd = open(mib_cache, O_RDONLY);
+    if(fd < 0)
+        return -1;
+
+    if(fstat(fd, &sb) < 0 || sb.st_size < sizeof(cache_header))
+    {
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return -1;
+
+    header = (const cache_header*)map;
+    size = sizeof(cache_header) + header->n_nodes * sizeof(cache_node) +
+           header->n_labels * sizeof(uint32_t) + header->n_strings;
+
+    if(memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+       header->version != CACHE_VERSION || size != sb.st_size ||
+       header->n_strings == 0 || header->stamp != cache_stamp(mib_directory))
+    {
+        munmap(map, sb.st_size);
+        return -1;
+    }
+
+    cache.map = map;
+    cache.size = sb.st_size;
+    cache.header = header;
+    cache.nodes = (const cache_node*)(header + 1);
+    cache.labels = (const uint32_t*)(cache.nodes + header->n_nodes);
+    cache.strings = (const char*)(cache.labels + header->n_labels);
+
+    /* Don't trust anything in the file, nodes only link in depth first order */
+    for(i = 0, node = cache.nodes; valid && i < header->n_nodes; ++i, ++node)
+    {
+        if((node->parent != CACHE_NONE && node->parent >= i) ||
+           (node->child != CACHE_NONE && (node->child <= i || node->child >= header->n_nodes)) ||
+           (node->peer != CACHE_NONE && (node->peer <= i || node->peer >= header->n_nodes)) ||
+           node->label >= header->n_strings || node->module >= header->n_strings)
+            valid = 0;
+    }
+    for(i = 0; valid && i < header->n_labels; ++i)
+    {
+        if(cache.labels[i] >= header->n_nodes)
+            valid = 0;
+    }
+
+    if(!valid || cache.strings[header->n_strings - 1] != 0)
+    {
+        cache_close();
+        cache_state = -1;
+        return -1;
+    }
+
+    cache_state = 1;
+    return 0;
+}
+
+#define CACHE_LABEL(n) \
+    (cache.strings + cache.nodes[n].label)
+
+static void
+cache_oid(uint32_t n, struct asn_oid* oid)
+{
+    uint32_t p;
+    int len = 0;
+
+    for(p = n; p != CACHE_NONE; p = cache.nodes[p].parent)
+        len++;
+
+    oid->len = len < ASN_MAXOIDLEN ? len : ASN_MAXOIDLEN;
+    for(p = n; p != CACHE_NONE; p = cache.nodes[p].parent)
+    {
+        if(--len < ASN_MAXOIDLEN)
+            oid->subs[len] = cache.nodes[p].subid;
+    }
+}
+
+/* The node for an OID, or CACHE_NONE */
+static uint32_t
+cache_node_at(struct asn_oid* oid)
+{
+    uint32_t n = 0;
+    int i;
+
+    if(!cache.header->n_nodes || !oid->len)
+        return CACHE_NONE;
+
+    for(i = 0; ; ++i)
+    {
+        while(n != CACHE_NONE && cache.nodes[n].subid != oid->subs[i])
+            n = cache.nodes[n].peer;
+        if(n == CACHE_NONE || i == oid->len - 1)
+            return n;
+        n = cache.nodes[n].child;
+    }
+}
+
+/* The first node in the tree with this label, as the MIB lookup finds */
+static int
+cache_label(const char* label, struct asn_oid* oid)
+{
+    uint32_t lo = 0;
+    uint32_t hi = cache.header->n_labels;
+    uint32_t mid;
+
+    while(lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if(strcasecmp(CACHE_LABEL(cache.labels[mid]), label) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if(lo >= cache.header->n_labels ||
+       strcasecmp(CACHE_LABEL(cache.labels[lo]), label) != 0)
+        return -1;
+
+    cache_oid(cache.labels[lo], oid);
+    return 0;
+}
+
+static int
+cache_subid(struct asn_oid* oid, const char* label)
+{
+    uint32_t n;
+
+    n = cache_node_at(oid);
+    if(n == CACHE_NONE)
+        return -1;
+
+    for(n = cache.nodes[n].child; n != CACHE_NONE; n = cache.nodes[n].peer)
+    {
+        if(strcasecmp(label, CACHE_LABEL(n)) == 0)
+            return cache.nodes[n].subid;
+    }
+
+    return -1;
+}
+
+/* The same as mib_format() below, but from the cache */
+static void
+cache_format(struct asn_oid* oid, FILE* f, int verbose)
+{
+    const char* name = NULL;
+    uint32_t n;
+    int module;
+    int i, start = 0;
+
+    if(!verbose)
+    {
+        module = -1;
+
+        /* Search for the last module the OID is part of */
+        for(i = 0, n = 0; n != CACHE_NONE && i < oid->len; i++, n = cache.nodes[n].child)
+        {
+            while(n != CACHE_NONE && cache.nodes[n].subid != oid->subs[i])
+                n = cache.nodes[n].peer;
+
+            if(n == CACHE_NONE)
+                break;
+
+            if(module == -1 || cache.nodes[n].modid != module) {
+                module = cache.nodes[n].modid;
+                name = cache.nodes[n].module ? cache.strings + cache.nodes[n].module : NULL;
+                start = i + 1;
+            }
+        }
+
+        /* Print out the last module found */
+        if(module != -1) {
+            if(name)
+                fprintf(f, "%s::", name);
+            else
+                start = 0;
+        }
+    }
+
+    for(i = 0, n = 0; n != CACHE_NONE && i < oid->len; i++, n = cache.nodes[n].child)
+    {
+        while(n != CACHE_NONE && cache.nodes[n].subid != oid->subs[i])
+            n = cache.nodes[n].peer;
+
+        if(n == CACHE_NONE)
+            break;
+
+        /* Skip until the module we found above */
+        if(i >= start)
+            fprintf(f, "%s%s", i > start ? "." : "", CACHE_LABEL(n));
+    }
+
+    /* Print out anything not in the mib */
+    for( ; i < oid->len; i++)
+        fprintf(f, "%s%d", i > start ? "." : "", (int)(oid->subs[i]));
+}
+
+/* Building a cache from the parsed tree */
+typedef struct _cache_build
+{
+    cache_node* nodes;
+    uint32_t n_nodes;
+    uint32_t max_nodes;
+    char* strings;
+    uint32_t n_strings;
+    uint32_t max_strings;
+    uint32_t* modules;          /* Module name of each modid */
+    int max_modules;
+    int failed;
+}
+cache_build;
+
+static cache_build* sorting = NULL;
+
+static uint32_t
+build_string(cache_build* cb, const char* str)
+{
+    size_t len = strlen(str) + 1;
+    uint32_t at;
+    char* s;
+
+    if(cb->n_strings + len > cb->max_strings)
+    {
+        cb->max_strings = (cb->max_strings + len) * 2;
+        s = realloc(cb->strings, cb->max_strings);
+        if(!s)
+        {
+            cb->failed = 1;
+            return 0;
+        }
+        cb->strings = s;
+    }
+
+    at = cb->n_strings;
+    memcpy(cb->strings + at, str, len);
+    cb->n_strings += len;
+    return at;
+}
+
+static uint32_t
+build_module(cache_build* cb, int modid)
+{
+    struct module* mp;
+    uint32_t* modules;
+    int i;
+
+    if(modid < 0)
+        return 0;
+
+    /* The same module name is used by many nodes */
+    if(modid >= cb->max_modules)
+    {
+        modules = realloc(cb->modules, sizeof(uint32_t) * (modid + 64));
+        if(!modules)
+        {
+            cb->failed = 1;
+            return 0;
+        }
+        for(i = cb->max_modules; i < modid + 64; ++i)
+            modules[i] = CACHE_NONE;
+        cb->modules = modules;
+        cb->max_modules = modid + 64;
+    }
+
+    if(cb->modules[modid] == CACHE_NONE)
+    {
+        cb->modules[modid] = 0;
+        for(mp = module_head; mp; mp = mp->next)
+        {
+            if(mp->modid == modid && mp->name)
+            {
+                cb->modules[modid] = build_string(cb, mp->name);
+                break;
+            }
+        }
+    }
+
+    return cb->modules[modid];
+}
+
+/* Adds these peers and their children, returning the first */
+static uint32_t
+build_nodes(cache_build* cb, struct tree* tp, uint32_t parent)
+{
+    uint32_t first = CACHE_NONE;
+    uint32_t last = CACHE_NONE;
+    cache_node* nodes;
+    uint32_t n, child;
+
+    for( ; tp && !cb->failed; tp = tp->next_peer)
+    {
+        if(cb->n_nodes == cb->max_nodes)
+        {
+            cb->max_nodes = cb->max_nodes ? cb->max_nodes * 2 : 1024;
+            nodes = realloc(cb->nodes, sizeof(cache_node) * cb->max_nodes);
+            if(!nodes)
+            {
+                cb->failed = 1;
+                break;
+            }
+            cb->nodes = nodes;
+        }
+
+        n = cb->n_nodes;
+        memset(&cb->nodes[n], 0, sizeof(cache_node));
+        cb->nodes[n].parent = parent;
+        cb->nodes[n].peer = CACHE_NONE;
+        cb->nodes[n].subid = tp->subid;
+        cb->nodes[n].label = build_string(cb, tp->label ? tp->label : "");
+        cb->nodes[n].modid = tp->modid;
+        cb->nodes[n].module = build_module(cb, tp->modid);
+        cb->n_nodes++;
+
+        if(last != CACHE_NONE)
+            cb->nodes[last].peer = n;
+        else
+            first = n;
+        last = n;
+
+        /* The nodes may move while adding children */
+        child = build_nodes(cb, tp->child_list, n);
+        cb->nodes[n].child = child;
+    }
+
+    return first;
+}
+
+static int
+compare_labels(const void* a, const void* b)
+{
+    uint32_t one = *(const uint32_t*)a;
+    uint32_t two = *(const uint32_t*)b;
+    int r;
+
+    r = strcasecmp(sorting->strings + sorting->nodes[one].label,
+                   sorting->strings + sorting->nodes[two].label);
+    if(r != 0)
+        return r;
+
+    /* The first in the tree wins, like a tree search */
+    return one < two ? -1 : (one > two ? 1 : 0);
+}
+
+static void
+cache_write()
+{
+    extern struct tree *tree_head;
+    cache_header header;
+    cache_build cb;
+    uint32_t* labels = NULL;
+    uint32_t n_labels = 0;
+    char* temp = NULL;
+    uint32_t i;
+    FILE* f = NULL;
+    int r;
+
+    if(!mib_cache)
+        return;
+
+    memset(&cb, 0, sizeof(cb));
+
+    /* Offset zero is the empty string */
+    build_string(&cb, "");
+    build_nodes(&cb, tree_head, CACHE_NONE);
+
+    if(!cb.failed)
+        labels = malloc(sizeof(uint32_t) * (cb.n_nodes + 1));
+    if(labels)
+    {
+        for(i = 0; i < cb.n_nodes; ++i)
+        {
+            if(cb.strings[cb.nodes[i].label])
+                labels[n_labels++] = i;
+        }
+
+        sorting = &cb;
+        qsort(labels, n_labels, sizeof(uint32_t), compare_labels);
+        sorting = NULL;
+
+        temp = malloc(strlen(mib_cache) + 5);
+    }
+
+    if(temp)
+    {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+        header.version = CACHE_VERSION;
+        header.n_nodes = cb.n_nodes;
+        header.stamp = cache_stamp(mib_directory);
+        header.n_labels = n_labels;
+        header.n_strings = cb.n_strings;
+
+        /* Written next to the cache, and then moved over it */
+        strcpy(temp, mib_cache);
+        strcat(temp, ".tmp");
+        f = fopen(temp, "w");
+    }
+
+    if(f)
+    {
+        fwrite(&header, sizeof(header), 1, f);
+        fwrite(cb.nodes, sizeof(cache_node), cb.n_nodes, f);
+        fwrite(labels, sizeof(uint32_t), n_labels, f);
+        fwrite(cb.strings, 1, cb.n_strings, f);
+
+        r = ferror(f);
+        if(fclose(f) != 0)
+            r = 1;
+
+        if(r || rename(temp, mib_cache) < 0)
+        {
+            if(mib_warnings)
+                warn("couldn't write mib cache: %s", mib_cache);
+            unlink(temp);
+        }
+    }
+    else if(temp && mib_warnings)
+    {
+        warn("couldn't write mib cache: %s", temp);
+    }
+
+    free(cb.nodes);
+    free(cb.strings);
+    free(cb.modules);
+    free(labels);
+    free(temp);
+}
+
 /* -------------------------------------------------------------------------- */
 
 static int
@@ -270,6 +1346,7 @@ parse_mixed_mib(const char* mib, struct asn_oid* oid)
     mib_node n;
     int ret = 0;
     unsigned int sub;
+    int named, r;
     char* next;
     char* t;
     char* copy;
@@ -294,9 +1371,22 @@ parse_mixed_mib(const char* mib, struct asn_oid* oid)
         }
 
         sub = strtoul(src, &t, 10);
+        named = (*t || sub < 0);
+
+        /* The compiled cache resolves names without parsing the MIBs */
+        if(named && !initialized && cache_open() == 0)
+        {
+            if(oid->len == 0 && cache_label(src, oid) == 0)
+                continue;
+            if(oid->len > 0 && (r = cache_subid(oid, src)) >= 0)
+            {
+                sub = r;
+                named = 0;
+            }
+        }
 
         /* An invalid number, try getting a named MIB */
-        if(*t || sub < 0)
+        if(named)
         {
             /* Only initializes first time around */
             mib_init();
@@ -319,10 +1409,16 @@ parse_mixed_mib(const char* mib, struct asn_oid* oid)
 
             /* Try a by name search for sub item */
             n = mib_get_node(oid);
-            if(n == NULL)
-                sub = -1;
-            else
-                sub = mib_subid(n, src);
+            r = n ? mib_subid(n, src) : -1;
+
+            /* It may be in a MIB that hasn't been loaded */
+            if(r < 0 && lazy_load(src))
+            {
+                n = mib_get_node(oid);
+                r = n ? mib_subid(n, src) : -1;
+            }
+
+            sub = r;
         }
 
         /* Make sure this is a valid part */
@@ -390,7 +1486,14 @@ mib_format(struct asn_oid* oid, FILE* f, int verbose)
     int module;
     int i, start = 0;
 
+    if(!initialized && cache_open() == 0)
+    {
+        cache_format(oid, f, verbose);
+        return 0;
+    }
+
     mib_init();
+    lazy_load_all();
 
     if(!verbose)
     {
@@ -44,10 +44,13 @@
 #include <bsnmp/snmp.h>
 
 #define DEFAULT_MIB         DATA_PREFIX "/mib"
+#define DEFAULT_MIB_CACHE   "/var/db/rrdbot/mib-cache"
 
 /* Whether we print warnings when loading MIBs or not */
 extern const char* mib_directory;
+extern const char* mib_cache;          /* Compiled MIB cache, or NULL */
 extern int mib_warnings;
+extern int mib_lazy;                   /* Only parse the MIBs that are used */
 
 void mib_init();
 void mib_uninit();
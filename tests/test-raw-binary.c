@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2008, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+
+#include "usuals.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "raw-binary.h"
+
+/*
+ * Writes points to a binary raw file, and checks that the same points
+ * come back when reading it: after closing, after appending to it
+ * again, and when it wasn't closed and has no index.
+ */
+
+#define N_POINTS 5000
+
+typedef struct _test_point
+{
+    const char* field;
+    int64_t when;
+    rawbin_value value;
+}
+test_point;
+
+static test_point points[N_POINTS * 2];
+static int n_points = 0;
+
+static int read_index = 0;
+static int failures = 0;
+
+static void
+check(int ok, const char* what, int index)
+{
+    if(!ok)
+    {
+        warnx("point %d: %s", index, what);
+        failures++;
+    }
+}
+
+static void
+make_points(int64_t start, int count)
+{
+    test_point* p;
+    int64_t when = start;
+    int i;
+
+    for(i = 0; i < count; ++i)
+    {
+        /* Mostly regular, with some jitter, jumps and a step back */
+        if(i % 97 == 50)
+            when -= 1500;
+        else if(i % 31 == 0)
+            when += 60000 + (i % 7);
+        else
+            when += 1000 + (i % 3) - 1;
+
+        p = &points[n_points++];
+        p->field = "in";
+        p->when = when;
+        if(i % 400 == 123)
+        {
+            p->value.type = RAWBIN_UNSET;
+            p->value.v.i_value = 0;
+        }
+        else
+        {
+            p->value.type = RAWBIN_INT;
+            p->value.v.i_value = (i % 5 == 0) ? -(int64_t)i * 12345 : (int64_t)i * i;
+        }
+
+        p = &points[n_points++];
+        p->field = "out";
+        p->when = when + 250;
+
+        /* The type changes part of the way through */
+        if(i > count / 2 && i < count / 2 + 10)
+        {
+            p->value.type = RAWBIN_INT;
+            p->value.v.i_value = INT64_MAX - i;
+        }
+        else
+        {
+            p->value.type = RAWBIN_FLOAT;
+            p->value.v.f_value = (i % 11 == 0) ? 0.0 : 1.0 / (i + 1) - i * 0.25;
+        }
+    }
+}
+
+static void
+write_points(rawbin_file* rf, int from, int to)
+{
+    int i;
+
+    for(i = from; i < to; ++i)
+    {
+        if(rawbin_add(rf, points[i].field, points[i].when, &points[i].value) < 0)
+            err(1, "couldn't add point %d", i);
+    }
+}
+
+static void
+read_point(const char* field, int64_t when, const rawbin_value* value, void* arg)
+{
+    const char* want = (const char*)arg;
+    test_point* p;
+
+    /* Skip over the points for other fields */
+    while(read_index < n_points && strcmp(points[read_index].field, want) != 0)
+        read_index++;
+
+    if(read_index >= n_points)
+    {
+        check(0, "extra point", read_index);
+        return;
+    }
+
+    p = &points[read_index];
+    check(strcmp(field, p->field) == 0, "wrong field", read_index);
+    check(when == p->when, "wrong time", read_index);
+    check(value->type == p->value.type, "wrong type", read_index);
+    if(value->type == RAWBIN_FLOAT)
+        check(memcmp(&value->v.f_value, &p->value.v.f_value, sizeof(double)) == 0,
+              "wrong value", read_index);
+    else if(value->type == RAWBIN_INT)
+        check(value->v.i_value == p->value.v.i_value, "wrong value", read_index);
+
+    read_index++;
+}
+
+static void
+check_field(rawbin_reader* rr, const char* field, int count)
+{
+    read_index = 0;
+    if(rawbin_read(rr, field, INT64_MIN, INT64_MAX, read_point, (void*)field) < 0)
+        errx(1, "couldn't read field: %s", field);
+
+    /* All of them up to count, and no more */
+    while(read_index < count && strcmp(points[read_index].field, field) != 0)
+        read_index++;
+    check(read_index >= count, "missing points", read_index);
+}
+
+static void
+check_file(const char* path, int count)
+{
+    rawbin_reader* rr;
+    char errbuf[256];
+
+    rr = rawbin_map(path, errbuf, sizeof(errbuf));
+    if(!rr)
+        errx(1, "couldn't read file: %s", errbuf);
+
+    check_field(rr, "in", count);
+    check_field(rr, "out", count);
+    rawbin_unmap(rr);
+}
+
+static void
+count_point(const char* field, int64_t when, const rawbin_value* value, void* arg)
+{
+    (*(int*)arg)++;
+}
+
+static void
+check_range(const char* path, int count)
+{
+    rawbin_reader* rr;
+    char errbuf[256];
+    int64_t from, to;
+    int want = 0;
+    int got = 0;
+    int i;
+
+    from = points[count / 3].when;
+    to = points[count / 2].when;
+    for(i = 0; i < count; ++i)
+    {
+        if(strcmp(points[i].field, "in") == 0 &&
+           points[i].when >= from && points[i].when <= to)
+            want++;
+    }
+
+    rr = rawbin_map(path, errbuf, sizeof(errbuf));
+    if(!rr)
+        errx(1, "couldn't read file: %s", errbuf);
+    if(rawbin_read(rr, "in", from, to, count_point, &got) < 0)
+        errx(1, "couldn't read field: in");
+    rawbin_unmap(rr);
+
+    check(want == got, "wrong number of points in range", count);
+}
+
+static void
+copy_file(const char* from, const char* to)
+{
+    char buf[8192];
+    ssize_t r;
+    int in, out;
+
+    in = open(from, O_RDONLY);
+    out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(in < 0 || out < 0)
+        err(1, "couldn't copy file: %s", from);
+    while((r = read(in, buf, sizeof(buf))) > 0)
+    {
+        if(write(out, buf, r) != r)
+            err(1, "couldn't copy file: %s", to);
+    }
+    close(in);
+    close(out);
+}
+
+int
+main(int argc, char* argv[])
+{
+    char path[MAXPATHLEN];
+    char copy[MAXPATHLEN];
+    char errbuf[256];
+    rawbin_file* rf;
+    int half;
+
+    snprintf(path, sizeof(path), "test-raw-binary-%d.bin", (int)getpid());
+    snprintf(copy, sizeof(copy), "test-raw-binary-%d.copy", (int)getpid());
+    unlink(path);
+
+    /* Millisecond times, around now */
+    make_points(INT64_C(1700000000123), N_POINTS);
+    half = n_points / 2;
+
+    rf = rawbin_open(path, errbuf, sizeof(errbuf));
+    if(!rf)
+        errx(1, "couldn't open file: %s", errbuf);
+    write_points(rf, 0, half);
+    if(rawbin_close(rf) < 0)
+        err(1, "couldn't close file");
+
+    check_file(path, half);
+    check_range(path, half);
+
+    /* Appending cuts off the index, and writes it again */
+    rf = rawbin_open(path, errbuf, sizeof(errbuf));
+    if(!rf)
+        errx(1, "couldn't open file again: %s", errbuf);
+    write_points(rf, half, n_points);
+
+    /* Without closing there's no index, and the records are scanned */
+    if(rawbin_flush(rf, INT64_MAX) < 0)
+        err(1, "couldn't flush file");
+    copy_file(path, copy);
+    check_file(copy, n_points);
+
+    if(rawbin_close(rf) < 0)
+        err(1, "couldn't close file");
+    check_file(path, n_points);
+    check_range(path, n_points);
+
+    unlink(path);
+    unlink(copy);
+
+    if(failures)
+        errx(1, "%d failures", failures);
+    return 0;
+}
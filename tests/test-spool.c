@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2008, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+
+#include "usuals.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <err.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "rrdbotd.h"
+
+/*
+ * Puts writes in the spool and reads them back: across segments, after
+ * some are done, and after a crash left half a record at the end.
+ */
+
+#define N_WRITES    3000
+#define SPOOL_SIZE  (64 * 1024 * 1024)
+
+static char spool_dir[MAXPATHLEN];
+static int failures = 0;
+
+void
+log_vmessage(int level, int erno, const char* msg, va_list va)
+{
+    /* The warnings about the crash are expected */
+    if(level > LOG_ERR)
+        return;
+
+    if(erno)
+    {
+        errno = erno;
+        vwarn(msg, va);
+    }
+    else
+        vwarnx(msg, va);
+}
+
+static void
+check(int ok, const char* what, uint64_t seq)
+{
+    if(!ok)
+    {
+        warnx("write %llu: %s", (unsigned long long)seq, what);
+        failures++;
+    }
+}
+
+/* Each write is different, and some are big enough to fill segments */
+static void
+make_write(uint64_t seq, int* type, char* path, const char** template,
+           char* data, size_t len)
+{
+    size_t n, i;
+
+    *type = (int)(seq % 2);
+    snprintf(path, MAXPATHLEN, "/var/db/rrdbot/%llu.rrd", (unsigned long long)seq);
+    *template = (seq % 3) ? "in:out" : NULL;
+
+    n = (seq * 37) % 2000 + 1;
+    if(n >= len)
+        n = len - 1;
+    for(i = 0; i < n; ++i)
+        data[i] = 'a' + (char)((seq + i) % 26);
+    data[n] = 0;
+}
+
+static void
+append_writes(uint64_t from, uint64_t to)
+{
+    char path[MAXPATHLEN];
+    char data[4096];
+    const char* template;
+    uint64_t seq;
+    int type;
+
+    for(seq = from; seq <= to; ++seq)
+    {
+        make_write(seq, &type, path, &template, data, sizeof(data));
+        check(rb_spool_append(type, path, template, data) == seq, "wrong sequence", seq);
+    }
+}
+
+/* Returns the last sequence read */
+static uint64_t
+read_writes(uint64_t from)
+{
+    char path[MAXPATHLEN];
+    char data[4096];
+    const char* template;
+    rb_spool_reader* rd;
+    rb_spool_record rec;
+    uint64_t seq = from - 1;
+    int type;
+
+    rd = rb_spool_open(from);
+    if(!rd)
+        errx(1, "out of memory");
+
+    while(rb_spool_read(rd, UINT64_MAX, &rec) > 0)
+    {
+        check(rec.seq == ++seq, "out of order", rec.seq);
+        make_write(rec.seq, &type, path, &template, data, sizeof(data));
+        check(rec.type == type, "wrong type", rec.seq);
+        check(strcmp(rec.path, path) == 0, "wrong path", rec.seq);
+        check(template ? rec.template && strcmp(rec.template, template) == 0 :
+                         rec.template == NULL, "wrong template", rec.seq);
+        check(strcmp(rec.data, data) == 0, "wrong data", rec.seq);
+    }
+
+    rb_spool_close(rd);
+    return seq;
+}
+
+/* The segment with the highest sequence that has anything in it */
+static void
+last_segment(char* path, size_t len)
+{
+    struct dirent* ent;
+    struct stat sb;
+    char best[MAXPATHLEN];
+    char file[MAXPATHLEN * 2];
+    DIR* dir;
+
+    best[0] = 0;
+    dir = opendir(spool_dir);
+    if(!dir)
+        err(1, "couldn't open spool directory: %s", spool_dir);
+
+    while((ent = readdir(dir)) != NULL)
+    {
+        if(strncmp(ent->d_name, "spool-0", 7) != 0)
+            continue;
+        snprintf(file, sizeof(file), "%s/%s", spool_dir, ent->d_name);
+        if(stat(file, &sb) == 0 && sb.st_size > 0 && strcmp(ent->d_name, best) > 0)
+            strlcpy(best, ent->d_name, sizeof(best));
+    }
+
+    closedir(dir);
+
+    if(!best[0])
+        errx(1, "no spool segments in: %s", spool_dir);
+    snprintf(path, len, "%s/%s", spool_dir, best);
+}
+
+static void
+remove_spool()
+{
+    struct dirent* ent;
+    char file[MAXPATHLEN * 2];
+    DIR* dir;
+
+    dir = opendir(spool_dir);
+    if(!dir)
+        return;
+    while((ent = readdir(dir)) != NULL)
+    {
+        if(ent->d_name[0] == '.')
+            continue;
+        snprintf(file, sizeof(file), "%s/%s", spool_dir, ent->d_name);
+        unlink(file);
+    }
+    closedir(dir);
+    rmdir(spool_dir);
+}
+
+int
+main(int argc, char* argv[])
+{
+    char path[MAXPATHLEN];
+    struct stat sb;
+
+    snprintf(spool_dir, sizeof(spool_dir), "test-spool-%d", (int)getpid());
+    if(mkdir(spool_dir, 0700) < 0)
+        err(1, "couldn't create spool directory: %s", spool_dir);
+
+    /* A new spool, written over several segments */
+    check(rb_spool_init(spool_dir, SPOOL_SIZE, SPOOL_SYNC_ALWAYS) == 1, "wrong start", 0);
+    append_writes(1, N_WRITES);
+    check(read_writes(1) == N_WRITES, "missing writes", N_WRITES);
+
+    /* Some are done, the rest are replayed on the next start */
+    rb_spool_done(1000);
+    rb_spool_uninit();
+    check(rb_spool_init(spool_dir, SPOOL_SIZE, SPOOL_SYNC_ALWAYS) == 1001, "wrong replay", 1001);
+    check(rb_spool_last() == N_WRITES, "wrong last write", N_WRITES);
+    check(read_writes(1001) == N_WRITES, "missing writes", N_WRITES);
+
+    /* A crash in the middle of the last write, it's cut off */
+    append_writes(N_WRITES + 1, N_WRITES + 100);
+    rb_spool_uninit();
+    last_segment(path, sizeof(path));
+    if(stat(path, &sb) < 0 || truncate(path, sb.st_size - 10) < 0)
+        err(1, "couldn't truncate spool segment: %s", path);
+
+    check(rb_spool_init(spool_dir, SPOOL_SIZE, SPOOL_SYNC_ALWAYS) == 1001, "wrong replay", 1001);
+    check(rb_spool_last() == N_WRITES + 99, "wrong last write", N_WRITES + 99);
+    check(read_writes(1001) == N_WRITES + 99, "missing writes", N_WRITES + 99);
+
+    /* And it goes on from there */
+    append_writes(N_WRITES + 100, N_WRITES + 110);
+    check(read_writes(1001) == N_WRITES + 110, "missing writes", N_WRITES + 110);
+    rb_spool_uninit();
+
+    remove_spool();
+
+    if(failures)
+        errx(1, "%d failures", failures);
+    return 0;
+}
@@ -58,6 +58,7 @@
 #define CONFIG_GENERAL  "general"
 #define CONFIG_POLL     "poll"
 #define CONFIG_INTERVAL "interval"
+#define CONFIG_STEP "step"
 #define CONFIG_ARCHIVE  "archive"
 #define CONFIG_TYPE     "type"
 #define CONFIG_MIN      "min"
@@ -150,6 +151,7 @@ typedef struct _create_ctx
     const char* confname;
     create_file_path* rrdlist;
     uint interval;
+    uint step;
     int cfs;
     int create;
     int skip;
@@ -233,6 +235,7 @@ context_reset(create_ctx* ctx)
     ctx->confname = NULL;
     ctx->cfs = FLAG_AVERAGE;
     ctx->interval = 0;
+    ctx->step = 0;
 
     ctx->create = 0;
     ctx->skip = 0;
@@ -339,6 +342,7 @@ create_file(create_ctx* ctx, const char* rrd)
     int argc, r, cfs;
     const char** argv;
     char *val_cf;
+    uint interval;
 
     if(!ctx->interval)
     {
@@ -346,6 +350,9 @@ create_file(create_ctx* ctx, const char* rrd)
         return -1;
     }
 
+    /* The RRD is updated once per step, when there is one */
+    interval = ctx->step ? ctx->step : ctx->interval;
+
     if(!ctx->fields)
     {
         warnx("%s: no fields defined", ctx->confname);
@@ -360,14 +367,14 @@ create_file(create_ctx* ctx, const char* rrd)
         ASSERT(rra->num);
         ASSERT(rra->total);
 
-        steps = (rra->per / rra->num) / ctx->interval;
+        steps = (rra->per / rra->num) / interval;
         if(!steps)
         {
             warnx("%s: archive has too many data points for polling interval. ignoring",
                   ctx->confname);
             continue;
         }
-        rows = rra->total / (ctx->interval * steps);
+        rows = rra->total / (interval * steps);
 	cfs = ctx->cfs;
 	while (cfs) {
             arg = (create_arg*)xcalloc(sizeof(create_arg));
@@ -409,7 +416,7 @@ create_file(create_ctx* ctx, const char* rrd)
         ASSERT(field->name);
         arg = (create_arg*)xcalloc(sizeof(create_arg));
         snprintf(arg->buf, sizeof(arg->buf), "DS:%s:%s:%d:%s:%s",
-                 field->name, field->dst, ctx->interval * 3, field->min, field->max);
+                 field->name, field->dst, interval * 3, field->min, field->max);
         arg->buf[sizeof(arg->buf) - 1] = 0;
         arg->next = args;
         args = arg;
@@ -418,7 +425,7 @@ create_file(create_ctx* ctx, const char* rrd)
 
     /* And the interval */
     arg = (create_arg*)xcalloc(sizeof(create_arg));
-    snprintf(arg->buf, sizeof(arg->buf), "-s%d", ctx->interval);
+    snprintf(arg->buf, sizeof(arg->buf), "-s%d", interval);
     arg->buf[sizeof(arg->buf) - 1] = 0;
     arg->next = args;
     args = arg;
@@ -502,6 +509,14 @@ check_create_file(create_ctx* ctx)
 
     for(rrdpath = ctx->rrdlist; rrdpath; rrdpath = rrdpath->next)
     {
+        /* Table fields write one rrd per row, which we don't know here */
+        if(strstr(rrdpath->path, "{index}") || strstr(rrdpath->path, "{value}"))
+        {
+            warnx("can't create rrd files for each table row, skipping: %s",
+                  rrdpath->path);
+            continue;
+        }
+
         if(!g_print)
         {
             /* Make sure it exists */
@@ -567,6 +582,23 @@ unit_to_seconds(char* unit)
         return 0;
 }
 
+/* Seconds, or milliseconds with 'ms' rounded up, as RRD steps are whole seconds */
+static uint
+parse_seconds(const char* value)
+{
+    unsigned long n;
+    char* t;
+
+    n = strtoul(value, &t, 10);
+    if(t == value)
+        return 0;
+    if(strcmp(t, "ms") == 0)
+        return (n + 999) / 1000;
+    if(strcmp(t, "s") == 0 || !*t)
+        return n;
+    return 0;
+}
+
 static int
 add_cfs(create_ctx* ctx, char* value)
 {
@@ -731,14 +763,25 @@ cfg_value(const char* filename, const char* header, const char* name,
         /* Interval option */
         if(strcmp(name, CONFIG_INTERVAL) == 0)
         {
-            ctx->interval = strtoul(value, &t, 10);
-            if(*t || !ctx->interval)
+            ctx->interval = parse_seconds(value);
+            if(!ctx->interval)
             {
                 warnx("%s: invalid 'interval' value: %s", ctx->confname, value);
                 ctx->skip = 1;
             }
         }
 
+        /* Step option, values are aggregated and written once per step */
+        if(strcmp(name, CONFIG_STEP) == 0)
+        {
+            ctx->step = parse_seconds(value);
+            if(!ctx->step)
+            {
+                warnx("%s: invalid 'step' value: %s", ctx->confname, value);
+                ctx->skip = 1;
+            }
+        }
+
         /* Ignore other options */
         return 0;
     }
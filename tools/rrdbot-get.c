@@ -71,6 +71,7 @@ struct context
 	int has_query;				/* Whether we are a table query or not */
 	struct asn_oid query_oid;		/* OID to use in table query */
 	char *query_match;			/* Value to match in table query */
+	struct snmp_match *query_matcher;	/* Compiled query_match */
 
 	uint64_t timeout;                   /* Receive timeout */
 
@@ -157,6 +158,7 @@ parse_argument (char *uri)
 	char* copy;
 	char *user, *host, *port, *scheme, *path, *query;
 	char *value, *name;
+	char errbuf[128];
 
 	/* Parse the SNMP URI */
 	copy = strdup (uri);
@@ -195,6 +197,12 @@ parse_argument (char *uri)
 		ctx.has_query = 1;
 		ctx.query_match = value;
 
+		if (value) {
+			ctx.query_matcher = snmp_engine_match_compile (value, errbuf, sizeof (errbuf));
+			if (!ctx.query_matcher)
+				errx (2, "invalid query match: %s: %s", value, errbuf);
+		}
+
 		/* And parse the query OID */
 		if (mib_parse (name, &(ctx.query_oid)) == -1)
 			errx (2, "invalid MIB: %s", name);
@@ -355,8 +363,8 @@ process_query (void)
 		}
 
 		/* Match the results */
-		if (ctx.query_match)
-			matched = snmp_engine_match (&value, ctx.query_match);
+		if (ctx.query_matcher)
+			matched = snmp_engine_match_value (&value, ctx.query_matcher);
 
 		/* When query match is null, anything matches */
 		else
@@ -499,6 +507,10 @@ main (int argc, char* argv[])
 	if(argc != 1)
 		usage ();
 
+	/* Formatting the output needs all the MIBs anyway */
+	if (!ctx.numeric)
+		mib_lazy = 0;
+
 	/* No bind addresses specified, use defaults... */
 	if (local == NULL) {
 		local = xrealloc (local, sizeof (char*) * 3);
@@ -543,6 +555,7 @@ main (int argc, char* argv[])
     		process_simple ();
     	}
 
+    	snmp_engine_match_free (ctx.query_matcher);
     	snmp_engine_stop ();
     	server_uninit ();
 
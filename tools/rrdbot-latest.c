@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2008, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+
+
+#include "usuals.h"
+#include <errno.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "latest-values.h"
+
+/*
+ * Prints the latest values that rrdbotd published, without any
+ * SNMP or RRD work. Values are read from shared memory, so this is
+ * cheap enough to run as often as needed.
+ */
+
+static void
+print_value(latest_reader* lr, int index)
+{
+    latest_value value;
+    const char* name;
+    const char* field;
+
+    if(latest_entry(lr, index, &name, &field) < 0 ||
+       latest_get(lr, index, &value) < 0)
+        return;
+
+    printf("%s\t%s\t", name, field);
+    if(value.when)
+        printf("%" PRId64 ".%03d\t", value.when / 1000, (int)(value.when % 1000));
+    else
+        printf("-\t");
+    if(value.type == LATEST_INT)
+        printf("%" PRId64, value.v.i_value);
+    else if(value.type == LATEST_FLOAT)
+        printf("%.4lf", value.v.f_value);
+    else
+        printf("U");
+    printf("\n");
+}
+
+/* Print all the fields of a config, or one field as name.field */
+static int
+print_arg(latest_reader* lr, const char* arg)
+{
+    const char* name;
+    const char* field;
+    char* buf;
+    char* t;
+    int found = 0;
+    int i, n;
+
+    buf = strdup(arg);
+    if(!buf)
+        errx(1, "out of memory");
+
+    t = strrchr(buf, '.');
+    if(t)
+    {
+        *t = 0;
+        i = latest_find(lr, buf, t + 1);
+        if(i >= 0)
+        {
+            print_value(lr, i);
+            found = 1;
+        }
+    }
+
+    free(buf);
+
+    if(!found)
+    {
+        n = latest_count(lr);
+        for(i = 0; i < n; ++i)
+        {
+            if(latest_entry(lr, i, &name, &field) == 0 && strcmp(name, arg) == 0)
+            {
+                print_value(lr, i);
+                found = 1;
+            }
+        }
+    }
+
+    if(!found)
+    {
+        warnx("no such config or field: %s", arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+print_all(latest_reader* lr, int argc, char* argv[])
+{
+    int ret = 0;
+    int i, n;
+
+    if(argc == 0)
+    {
+        n = latest_count(lr);
+        for(i = 0; i < n; ++i)
+            print_value(lr, i);
+    }
+
+    for(i = 0; i < argc; ++i)
+    {
+        if(print_arg(lr, argv[i]) < 0)
+            ret = 1;
+    }
+
+    fflush(stdout);
+    return ret;
+}
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: rrdbot-latest [-f file] [-w seconds] [config[.field] ...]\n");
+    fprintf(stderr, "       rrdbot-latest -V\n");
+    exit(2);
+}
+
+static void
+version()
+{
+    printf("rrdbot-latest (version %s)\n", VERSION);
+    printf("   default latest values file: %s\n", LATEST_DEFAULT);
+    exit(0);
+}
+
+int
+main(int argc, char* argv[])
+{
+    const char* path = LATEST_DEFAULT;
+    char errmsg[256];
+    latest_reader* lr;
+    int watch = 0;
+    int ret;
+    char ch;
+    char* t;
+
+    /* Parse the arguments nicely */
+    while((ch = getopt(argc, argv, "f:w:V")) != -1)
+    {
+        switch(ch)
+        {
+
+        /* The latest values file */
+        case 'f':
+            path = optarg;
+            break;
+
+        /* Print again every so many seconds */
+        case 'w':
+            watch = strtol(optarg, &t, 10);
+            if(*t || watch <= 0)
+                errx(2, "invalid watch interval (must be above zero): %s", optarg);
+            break;
+
+        /* Print version number */
+        case 'V':
+            version();
+            break;
+
+        /* Usage information */
+        case '?':
+        default:
+            usage();
+            break;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    lr = latest_open(path, errmsg, sizeof(errmsg));
+    if(!lr)
+        errx(1, "%s", errmsg);
+
+    ret = print_all(lr, argc, argv);
+
+    while(watch)
+    {
+        sleep(watch);
+
+        /* The daemon started again with a new file */
+        if(!latest_running(lr))
+        {
+            latest_close(lr);
+            lr = latest_open(path, errmsg, sizeof(errmsg));
+            if(!lr)
+                errx(1, "%s", errmsg);
+        }
+
+        printf("\n");
+        ret = print_all(lr, argc, argv);
+    }
+
+    latest_close(lr);
+    return ret;
+}
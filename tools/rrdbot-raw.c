@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2008, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+
+#include "usuals.h"
+#include <errno.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "raw-binary.h"
+
+/*
+ * Prints binary raw files in the same form as the text raw files,
+ * ordered by time.
+ */
+
+typedef struct _raw_point
+{
+    const char* field;
+    int64_t when;
+    rawbin_value value;
+    size_t order;
+}
+raw_point;
+
+typedef struct _raw_ctx
+{
+    raw_point* points;
+    size_t n_points;
+    size_t alloc;
+}
+raw_ctx;
+
+static void
+add_point(const char* field, int64_t when, const rawbin_value* value, void* arg)
+{
+    raw_ctx* ctx = (raw_ctx*)arg;
+    raw_point* point;
+
+    if(ctx->n_points == ctx->alloc)
+    {
+        ctx->alloc = ctx->alloc ? ctx->alloc * 2 : 1024;
+        ctx->points = (raw_point*)xrealloc(ctx->points, ctx->alloc * sizeof(raw_point));
+    }
+
+    point = &ctx->points[ctx->n_points];
+    point->field = field;
+    point->when = when;
+    point->value = *value;
+    point->order = ctx->n_points++;
+}
+
+static int
+compare_points(const void* a, const void* b)
+{
+    const raw_point* pa = (const raw_point*)a;
+    const raw_point* pb = (const raw_point*)b;
+
+    if(pa->when != pb->when)
+        return pa->when < pb->when ? -1 : 1;
+    return pa->order < pb->order ? -1 : (pa->order > pb->order ? 1 : 0);
+}
+
+static int
+print_file(const char* path, const char* field, int64_t from, int64_t to)
+{
+    char errmsg[256];
+    rawbin_reader* rr;
+    raw_ctx ctx;
+    raw_point* point;
+    size_t i;
+    int ret = 0;
+
+    rr = rawbin_map(path, errmsg, sizeof(errmsg));
+    if(!rr)
+    {
+        warnx("couldn't read raw file: %s: %s", path, errmsg);
+        return -1;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    if(rawbin_read(rr, field, from, to, add_point, &ctx) < 0)
+    {
+        warnx("some of the raw file is corrupted: %s", path);
+        ret = -1;
+    }
+
+    qsort(ctx.points, ctx.n_points, sizeof(raw_point), compare_points);
+
+    for(i = 0; i < ctx.n_points; ++i)
+    {
+        point = &ctx.points[i];
+        /* Milliseconds only when there are some, like the CSV files */
+        if(point->when % 1000)
+            printf("%" PRId64 ".%03d\t%s\t", point->when / 1000,
+                   (int)(point->when % 1000), point->field);
+        else
+            printf("%" PRId64 "\t%s\t", point->when / 1000, point->field);
+        if(point->value.type == RAWBIN_INT)
+            printf("%" PRId64, point->value.v.i_value);
+        else if(point->value.type == RAWBIN_FLOAT)
+            printf("%.4lf", point->value.v.f_value);
+        printf("\n");
+    }
+
+    free(ctx.points);
+    rawbin_unmap(rr);
+    return ret;
+}
+
+static int64_t
+parse_time(const char* arg)
+{
+    int64_t when;
+    char* t;
+
+    when = strtoll(arg, &t, 10);
+    if(*t)
+        errx(2, "invalid time (must be seconds since the epoch): %s", arg);
+    return when * 1000;
+}
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: rrdbot-raw [-f field] [-s start] [-e end] file ...\n");
+    fprintf(stderr, "       rrdbot-raw -V\n");
+    exit(2);
+}
+
+static void
+version()
+{
+    printf("rrdbot-raw (version %s)\n", VERSION);
+    exit(0);
+}
+
+int
+main(int argc, char* argv[])
+{
+    const char* field = NULL;
+    int64_t from = INT64_MIN;
+    int64_t to = INT64_MAX;
+    int ret = 0;
+    char ch;
+    int i;
+
+    /* Parse the arguments nicely */
+    while((ch = getopt(argc, argv, "e:f:s:V")) != -1)
+    {
+        switch(ch)
+        {
+
+        /* Last time to print */
+        case 'e':
+            to = parse_time(optarg) + 999;
+            break;
+
+        /* Only this field */
+        case 'f':
+            field = optarg;
+            break;
+
+        /* First time to print */
+        case 's':
+            from = parse_time(optarg);
+            break;
+
+        /* Print version number */
+        case 'V':
+            version();
+            break;
+
+        /* Usage information */
+        case '?':
+        default:
+            usage();
+            break;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if(argc < 1)
+        usage();
+
+    for(i = 0; i < argc; ++i)
+    {
+        if(print_file(argv[i], field, from, to) < 0)
+            ret = 1;
+    }
+
+    return ret;
+}